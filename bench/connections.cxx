@@ -0,0 +1,179 @@
+/*
+  Measures how many idle connections fit in memory for each server mode
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "net.hxx"
+#include "netmsg.hxx"
+#include "reactor.hxx"
+#include "util.hxx"
+
+#define WORKERS 16
+
+static uint64_t resident()
+{
+  uint64_t size, rss;
+  std::ifstream statm("/proc/self/statm");
+  statm >> size >> rss;
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+static std::string threads()
+{
+  std::string line;
+  std::ifstream status("/proc/self/status");
+  while (std::getline(status, line))
+    if (line.compare(0, 8, "Threads:") == 0)
+      return line.substr(8);
+  return "?";
+}
+
+static void serve(NetMsg * netmsg)
+{
+  try
+    {
+      while (true)
+        {
+          Message *msg = netmsg->wait_new();
+          msg->set(std::string(1, '\0'));
+          netmsg->reply_only(msg);
+        }
+    }
+  catch(const char * e)
+    {}
+  catch(const std::string & e)
+    {}
+}
+
+static void ping(int fd, uint64_t id)
+{
+  // Speak the raw frame format as a remote peer would
+  std::string frame;
+  Write::i8(1, frame);
+  Write::i64(id, frame);
+  Write::i64(1, frame);
+  Write::i8(3, frame);
+  if (write(fd, frame.data(), frame.length()) != (ssize_t)frame.length())
+    throw "Failed to write ping";
+
+  uint8_t reply[18];
+  size_t got = 0;
+  ssize_t red;
+  while (got < sizeof(reply))
+    if ((red = read(fd, reply + got, sizeof(reply) - got)) > 0)
+      got += red;
+    else
+      throw "Failed to read pong";
+}
+
+int main(int argc, char * argv[])
+{
+  std::string mode = argc > 1 ? argv[1] : "reactor";
+  size_t count = argc > 2 ? atol(argv[2]) : 1000;
+  if (mode != "thread" && mode != "reactor")
+    {
+      std::cerr << "bench_connections [thread|reactor] [connections]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  // Each connection needs a pair of descriptors
+  struct rlimit lim;
+  getrlimit(RLIMIT_NOFILE, &lim);
+  lim.rlim_cur = lim.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &lim);
+
+  Reactor * reactor = NULL;
+  if (mode == "reactor")
+    {
+      reactor = new Reactor(WORKERS);
+      reactor->start();
+    }
+
+  uint64_t base = resident();
+  std::vector<int> peers;
+  try
+    {
+      for (size_t i = 0; i < count; i++)
+        {
+          int fds[2];
+          if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+            throw "Ran out of sockets, raise the open file limit";
+          peers.push_back(fds[1]);
+
+          Net * net = new Net(fds[0], "bench", 0);
+          if (reactor == NULL)
+            {
+              // Mirror the server's client thread on top of the NetMsg threads
+              NetMsg * netmsg = new NetMsg(net);
+              netmsg->start();
+              std::thread(serve, netmsg).detach();
+            }
+          else
+            reactor->add(new NetMsg(net, false),
+                         [](NetMsg * netmsg)
+                         {
+                           Message *msg = netmsg->wait_new();
+                           msg->set(std::string(1, '\0'));
+                           netmsg->reply_only(msg);
+                           return true;
+                         },
+                         [](NetMsg * netmsg) {});
+        }
+
+      // Make sure every connection is live and answering
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < peers.size(); i++)
+        ping(peers[i], i);
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now() - start).count();
+
+      uint64_t used = resident() - base;
+      std::cout << "mode:            " << mode << std::endl
+                << "connections:     " << count << std::endl
+                << "threads:        " << threads() << std::endl
+                << "resident bytes:  " << used << std::endl
+                << "bytes/conn:      " << used / count << std::endl
+                << "conns/GB:        "
+                << (used ? (uint64_t)count * (1ull << 30) / used : 0)
+                << std::endl
+                << "ping round (us): " << elapsed << std::endl;
+    }
+  catch(const char * e)
+    {
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  // The connection threads are still parked so skip the teardown
+  std::cout.flush();
+  _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,167 @@
+/*
+  Compares the in flight message table with a locked hash map
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+
+#include "slots.hxx"
+
+#define SLOTS 4096
+
+struct Item
+{
+  uint64_t id;
+};
+
+// The maps NetMsg used to keep, every operation takes the lock
+class Locked
+{
+public:
+  Item *find(uint64_t id)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = map.find(id);
+    return it == map.end() ? NULL : it->second;
+  }
+
+  void insert(uint64_t id, Item * item)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    map[id] = item;
+  }
+
+  void erase(uint64_t id)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    map.erase(id);
+  }
+
+private:
+  std::mutex lock;
+  std::unordered_map<uint64_t, Item*> map;
+};
+
+// Writers are serialized by a lock just as NetMsg does with its msgs lock
+class Table
+{
+public:
+  Table() : slots(SLOTS) {}
+
+  Item *find(uint64_t id)
+  {
+    return slots.find(id);
+  }
+
+  void insert(uint64_t id, Item * item)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    slots.insert(id, item);
+  }
+
+  void erase(uint64_t id)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    slots.erase(id);
+  }
+
+private:
+  std::mutex lock;
+  Slots<Item> slots;
+};
+
+static double rate(size_t count, std::chrono::steady_clock::time_point start)
+{
+  double secs = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+  return count / secs;
+}
+
+// Requests are sent and their replies looked up and retired in the order
+// they were sent, with a window of them in flight
+template <class T>
+static void run(const char * name, size_t count, size_t window,
+                size_t readers)
+{
+  T table;
+  std::vector<Item> items(window);
+  std::atomic<uint64_t> next(0);
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+
+  // Listeners looking up the replies in flight
+  for (size_t r = 0; r < readers; r++)
+    threads.push_back(std::thread([&]()
+      {
+        uint64_t found = 0;
+        while (!done)
+          {
+            uint64_t top = next;
+            if (top > window && table.find(top - window / 2) != NULL)
+              found++;
+          }
+        if (found == UINT64_MAX)
+          std::cout << found;
+      }));
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t id = 0; id < count; id++)
+    {
+      Item *item = &items[id % window];
+      item->id = id;
+      if (id >= window)
+        {
+          table.find(id - window);
+          table.erase(id - window);
+        }
+      table.insert(id, item);
+      next = id + 1;
+    }
+  double ops = rate(count, start);
+  done = true;
+  for (size_t r = 0; r < threads.size(); r++)
+    threads[r].join();
+
+  std::cout << name << " (" << window << " in flight, " << readers
+            << " readers): " << (uint64_t)ops << " msgs/sec" << std::endl;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t count = argc > 1 ? atol(argv[1]) : 5000000;
+
+  size_t windows[] = { 16, 1024 };
+  for (size_t w = 0; w < 2; w++)
+    for (size_t readers = 0; readers < 2; readers++)
+      {
+        run<Locked>("unordered_map", count, windows[w], readers);
+        run<Table>("slots        ", count, windows[w], readers);
+      }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+/*
+  Measures NetMsg messages per second over a loopback connection
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <unistd.h>
+
+#include "net.hxx"
+#include "netmsg.hxx"
+
+#define PORT 17655
+
+static void echo(NetMsg * netmsg, size_t count)
+{
+  // Replies to requests and swallows the one way messages
+  for (size_t i = 0; i < count; i++)
+    {
+      Message *msg = netmsg->wait_new();
+      if (msg->get() == "r")
+        netmsg->reply_only(msg);
+      else
+        netmsg->destroy(msg);
+    }
+}
+
+static void requests(NetMsg * netmsg, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      Message *msg = netmsg->send_and_wait("r");
+      netmsg->destroy(msg);
+    }
+}
+
+static double rate(size_t count, std::chrono::steady_clock::time_point start)
+{
+  double secs = std::chrono::duration<double>
+    (std::chrono::steady_clock::now() - start).count();
+  return count / secs;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t count = argc > 1 ? atol(argv[1]) : 100000;
+  size_t threads = argc > 2 ? atol(argv[2]) : 8;
+  uint16_t port = argc > 3 ? atoi(argv[3]) : PORT;
+
+  try
+    {
+      NetServer server("127.0.0.1", port);
+      NetClient client("127.0.0.1", port);
+      Net *cnet = client.connect(), *snet = server.accept();
+      NetMsg cmsg(cnet), smsg(snet);
+      cmsg.start();
+      smsg.start();
+
+      // One way bursts of tiny messages
+      std::thread sink(echo, &smsg, count);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < count; i++)
+        cmsg.send_only("o");
+      sink.join();
+      std::cout << "one way msgs/sec:       " << (uint64_t)rate(count, start)
+                << std::endl;
+
+      // Concurrent request and reply pairs
+      size_t each = count / threads / 10;
+      std::thread replier(echo, &smsg, each * threads);
+      std::vector<std::thread> senders;
+      start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < threads; i++)
+        senders.push_back(std::thread(requests, &cmsg, each));
+      for (size_t i = 0; i < threads; i++)
+        senders[i].join();
+      replier.join();
+      std::cout << "round trips/sec (" << threads << " threads): "
+                << (uint64_t)rate(each * threads, start) << std::endl;
+
+      cmsg.close();
+      smsg.close();
+      delete cnet;
+      delete snet;
+    }
+  catch(const char * e)
+    {
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+    }
+  catch(const std::string & e)
+    {
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*
+  Measures NetMsg round trips with many threads waiting on replies at once
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "net.hxx"
+#include "netmsg.hxx"
+
+#define REQUESTERS 64
+
+static void echo(NetMsg * netmsg, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    netmsg->reply_only(netmsg->wait_new());
+}
+
+static void requests(NetMsg * netmsg, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+    {
+      Message *msg = netmsg->send_and_wait("r");
+      netmsg->destroy(msg);
+    }
+}
+
+static uint64_t switches()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+int main(int argc, char * argv[])
+{
+  size_t count = argc > 1 ? atol(argv[1]) : 200000;
+  size_t threads = argc > 2 ? atol(argv[2]) : REQUESTERS;
+  size_t each = count / threads;
+
+  try
+    {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw "Failed to create sockets";
+      Net cnet(fds[0], "client", 0), snet(fds[1], "server", 0);
+      NetMsg cmsg(&cnet), smsg(&snet);
+      cmsg.start();
+      smsg.start();
+
+      std::thread replier(echo, &smsg, each * threads);
+      std::vector<std::thread> senders;
+      uint64_t before = switches();
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < threads; i++)
+        senders.push_back(std::thread(requests, &cmsg, each));
+      for (size_t i = 0; i < threads; i++)
+        senders[i].join();
+      replier.join();
+      double secs = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+
+      std::cout << "requesters:          " << threads << std::endl
+                << "round trips/sec:     " << (uint64_t)(each * threads / secs)
+                << std::endl
+                << "context switches/rt: "
+                << (double)(switches() - before) / (each * threads)
+                << std::endl;
+
+      cmsg.close();
+      smsg.close();
+    }
+  catch(const char * e)
+    {
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+    }
+  catch(const std::string & e)
+    {
+      std::cerr << e << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
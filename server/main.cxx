@@ -19,17 +19,23 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cerrno>
 #include <cstdlib>
 #include <string>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include <list>
 #include <thread>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "../src/net.hxx"
 #include "../src/netmsg.hxx"
@@ -37,6 +43,11 @@
 #include "../src/config.hxx"
 #include "../src/metadata.hxx"
 #include "../src/util.hxx"
+#include "../src/reactor.hxx"
+#include "../src/delta.hxx"
+#include "../src/chunks.hxx"
+#include "../src/hasher.hxx"
+#include "../src/journal.hxx"
 #include "user.hxx"
 
 #define LOGIN_INV 1
@@ -44,18 +55,99 @@
 #define HAND_LOGIN 0
 #define HAND_REG   1
 
+// Set on the command by clients which send a byte of NetMsg features
+#define HAND_EXT   0x80
+
+// Set on the command along with HAND_EXT by clients which send a second
+// byte of features after the first, which we answer with a second byte too
+#define HAND_MORE  0x40
+
+// Sent with the NetMsg features by clients which understand the inline
+// push and pull commands, and echoed back if we do too
+#define HAND_INLINE 0x80
+
+// Sent alongside by clients which can send and apply deltas, and echoed
+// back if we do too
+#define HAND_DELTA 0x40
+
+// Sent alongside by clients which push files as lists of chunks
+#define HAND_CHUNKS 0x20
+
+// Sent alongside by clients which send the hash of each file they push, so
+// the metadata and updates carry the hashes too
+#define HAND_HASHES 0x10
+
+// Sent in the second byte of features, which is kept above the first, by
+// clients which ask for the changes since a cursor, and echoed back since
+// we keep a journal of them
+#define HAND_JOURNAL 0x0100
+
+// Sent alongside by clients which compare their copy of the metadata with
+// our tree when the journal doesn't reach back far enough
+#define HAND_TREE 0x0200
+
 #define REG_INV 1
 #define REG_CLOSED 2
 
+#define HAND_TIMEOUT 30
+#define DEFAULT_WORKERS 16
+
+// Milliseconds a request to a client waits for its reply
+#define DEFAULT_MSG_TIMEOUT 30000
+
+// Frames gathered by each connection's writer during a burst
+#define DEFAULT_BATCH_BYTES 65536
+#define DEFAULT_BATCH_DELAY 200
+
+// Changes remembered for each user
+#define DEFAULT_JOURNAL_SIZE 65536
+
+// Bytes of file signatures kept for each user
+#define DEFAULT_SIG_CACHE_SIZE 16777216
+
+// Largest push whose space is reserved before its body arrives, since the
+// size is only the client's word
+#define RESERVE_MAX (1ull << 30)
+
 struct UserData
 {
   Metadata *mtd;
+  ChunkIndex *chunks;
+  Journal *journal;
   std::mutex lock;
   std::unordered_set<NetMsg *> handles;
+
+  // Updates for the other clients, queued under lock and sent once it is
+  // released. The handles are only changed under both locks, so sending
+  // just needs handles_lock and a stalled client never holds up commands
+  std::mutex handles_lock;
+  std::vector<std::pair<NetMsg *, std::string>> updates;
+
+  // Files pushed whole along with their modification times, queued under
+  // lock and split into chunks once it is released
+  std::vector<std::pair<std::string, uint64_t>> unindexed;
+
+  // Signatures of the stored files along with the modification time they
+  // were taken at, shared by every client of the user. The least recently
+  // used are dropped once they take more than sig_cache_size bytes
+  struct Sig
+  {
+    uint64_t modified;
+    std::string sig;
+    std::list<std::string>::iterator used;
+  };
+  std::unordered_map<std::string, Sig> sigs;
+  std::list<std::string> sigs_used;
+  size_t sigs_bytes;
 };
 
 std::unordered_map<std::string, UserData*> udata;
 std::mutex udata_lock;
+size_t batch_bytes = DEFAULT_BATCH_BYTES;
+uint64_t batch_delay = DEFAULT_BATCH_DELAY;
+uint64_t msg_timeout = DEFAULT_MSG_TIMEOUT;
+size_t journal_size = DEFAULT_JOURNAL_SIZE;
+size_t sig_cache_size = DEFAULT_SIG_CACHE_SIZE;
 
 uint64_t filesize(const std::string & path)
 {
@@ -65,13 +157,59 @@ uint64_t filesize(const std::string & path)
   return (uint64_t)stats.st_size;
 }
 
-std::string handshake(Net * net, User * user)
+/**
+ * Reserves space for a file about to be written, if it is no larger than
+ * RESERVE_MAX and the filesystem has room for it
+ * @param file The file, which is empty
+ * @param size The size the client announced
+ * @return The bytes reserved
+ */
+uint64_t reserve(int file, uint64_t size)
+{
+#ifdef __linux__
+  struct statvfs vfs;
+  if (size == 0 || size > RESERVE_MAX || fstatvfs(file, &vfs) < 0 ||
+      size > (uint64_t)vfs.f_bavail * vfs.f_frsize)
+    return 0;
+  if (fallocate(file, FALLOC_FL_KEEP_SIZE, 0, size) < 0)
+    return 0;
+  return size;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Gives back the reserved space past the end of a written file, which
+ * KEEP_SIZE would otherwise leave allocated when the body came up short.
+ * Punching a hole doesn't reach past the end of the file on every
+ * filesystem, but truncating to the written length does
+ * @param file The file
+ * @param reserved The bytes reserved for it
+ */
+void unreserve(int file, uint64_t reserved)
+{
+  struct stat stats;
+  if (fstat(file, &stats) < 0 || (uint64_t)stats.st_size >= reserved)
+    return;
+  if (ftruncate(file, stats.st_size) < 0)
+    global_log.message("Failed to release reserved space", Log::WARNING);
+}
+
+std::string handshake(Net * net, User * user, uint16_t & features)
 {
   // Send the version
   net->write8(0);
 
-  // Check the command
+  // Check the command, newer clients tell us which features they support
   uint8_t cmd = net->read8();
+  bool ext = cmd & HAND_EXT;
+  bool more = ext && (cmd & HAND_MORE);
+  cmd &= ~(HAND_EXT | HAND_MORE);
+  features = ext ? net->read8() & (NETMSG_FEATURES | HAND_INLINE | HAND_DELTA |
+                                   HAND_CHUNKS | HAND_HASHES) : 0;
+  if (more)
+    features |= (net->read8() << 8) & (HAND_JOURNAL | HAND_TREE);
 
   // Grab the login data
   size_t user_len = (size_t)net->read16();
@@ -111,6 +249,7 @@ std::string handshake(Net * net, User * user)
     try
       {
         dir = user->reg(username, pass);
+        net->write8(0);
       }
     catch(const char * e)
       {
@@ -118,6 +257,12 @@ std::string handshake(Net * net, User * user)
         throw std::string("Failed to register ") + username;
       }
 
+  // Let the client know which of its features are in use
+  if (ext)
+    net->write8(features);
+  if (more)
+    net->write8(features >> 8);
+
   global_log.message(username + " authenticated successfully", Log::NOTICE);
   return dir;
 }
@@ -127,11 +272,290 @@ std::string handshake(Net * net, User * user)
 #define CMD_PUSH 2
 #define CMD_PULL 3
 #define CMD_DEL 4
+#define CMD_PUSH_INLINE 5
+#define CMD_PULL_INLINE 6
+#define CMD_SIG 7
+#define CMD_PUSH_DELTA 8
+#define CMD_PULL_DELTA 9
+#define CMD_PUSH_CHUNKS 10
+#define CMD_META_SINCE 11
+#define CMD_TREE 12
+
+// Answer to an inline pull whose file is too large to go in the reply, the
+// body follows once the client acknowledges it like CMD_PULL
+#define PULL_STREAM 2
+
+// Largest file sent in the reply to an inline pull
+#define INLINE_MAX 65536
+
+// Answer to a delta push made against a copy which has since changed, the
+// client pushes the whole file instead
+#define DELTA_STALE 3
+
+// Answer to a request for the metadata since a cursor the journal doesn't
+// reach back to, when the client would rather compare trees than fetch it
+// whole
+#define META_TREE 2
+
+// Smallest file whose chunks are indexed, smaller ones are always pushed
+// whole so there is no use finding chunks in them
+#define CHUNK_INDEX_MIN 262144
 
 #define BUFF 2048
 
+/**
+ * Sends an update to every client of the user but the one it came from
+ */
+void send_update(NetMsg * netmsg, UserData * data, const std::string & cmd)
+{
+  // A client which stops reading only holds the other senders of this user
+  // until its send timeout, commands carry on meanwhile
+  for (auto it = data->handles.begin(), end = data->handles.end();
+       it != end; it++)
+    {
+      if (*it == netmsg)
+        continue;
+
+      NetMsg *other = *it;
+      try
+        {
+          other->send_async(cmd, [other](Message * reply)
+            {
+              if (reply != NULL)
+                other->destroy(reply);
+              else
+                global_log.message("Failed to push update to client",
+                                   Log::WARNING);
+            });
+        }
+      catch(const char * e)
+        {
+          global_log.message("Failed to push update to client",
+                             Log::WARNING);
+        }
+      catch(const std::string & e)
+        {
+          global_log.message("Failed to push update to client",
+                             Log::WARNING);
+        }
+    }
+}
+
+/**
+ * Queues an update for every other client of the user, the caller must hold
+ * the user data lock and send_updates() once it drops it
+ */
+void broadcast(NetMsg * netmsg, UserData * data, const std::string & cmd)
+{
+  data->updates.push_back(std::make_pair(netmsg, cmd));
+}
+
+/**
+ * Pushes the queued updates out, without the user data lock held
+ */
+void send_updates(UserData * data,
+                  std::vector<std::pair<NetMsg *, std::string>> & updates)
+{
+  std::lock_guard<std::mutex> lock(data->handles_lock);
+
+  for (auto & update : updates)
+    send_update(update.first, data, update.second);
+  updates.clear();
+}
+
+/**
+ * Forgets the signature of a stored file, if there is one
+ */
+void drop_sig(UserData * data, const std::string & filename)
+{
+  auto it = data->sigs.find(filename);
+  if (it == data->sigs.end())
+    return;
+  data->sigs_bytes -= it->second.sig.length();
+  data->sigs_used.erase(it->second.used);
+  data->sigs.erase(it);
+}
+
+/**
+ * Gets the signature of a stored file, which is only taken again once the
+ * file changes rather than for every client which asks
+ * @return The signature, valid while the user data stays locked
+ */
+const std::string & signature(const std::string & user_dir, UserData * data,
+                              const std::string & filename)
+{
+  uint64_t modified = data->mtd->get_file(filename).modified;
+  auto it = data->sigs.find(filename);
+  if (it != data->sigs.end() && it->second.modified == modified)
+    {
+      data->sigs_used.splice(data->sigs_used.begin(), data->sigs_used,
+                             it->second.used);
+      return it->second.sig;
+    }
+
+  std::ifstream in(user_dir + filename, std::ios::in | std::ios::binary);
+  if (!in)
+    throw std::string("Failed to open ") + filename;
+  std::string sig = Delta::signature(in, filesize(user_dir + filename));
+
+  // Make room by dropping the signatures asked for longest ago, a single
+  // signature larger than the cache is still kept until the next one
+  drop_sig(data, filename);
+  while (!data->sigs_used.empty() &&
+         data->sigs_bytes + sig.length() > sig_cache_size)
+    {
+      std::string oldest = data->sigs_used.back();
+      drop_sig(data, oldest);
+    }
+
+  data->sigs_used.push_front(filename);
+  UserData::Sig & cached = data->sigs[filename];
+  cached.modified = modified;
+  cached.sig = std::move(sig);
+  cached.used = data->sigs_used.begin();
+  data->sigs_bytes += cached.sig.length();
+  return cached.sig;
+}
+
+/**
+ * Reads a chunk out of a stored file
+ * @param in The file, opened and positioned by the caller
+ * @param chunk The chunk, whose hash the data is checked against
+ * @param buff Filled with the chunk, at least CHUNK_MAX bytes
+ * @return True if the file held the chunk
+ */
+bool read_chunk(std::istream & in, const Chunker::Chunk & chunk, char * buff)
+{
+  in.read(buff, chunk.length);
+  return (size_t)in.gcount() == chunk.length &&
+    Chunker::hash((uint8_t*)buff, chunk.length) == chunk.hash;
+}
+
+/**
+ * Reads the hash of the contents which clients that negotiated hashes put
+ * after the filename of a push
+ * @return The hash, or an empty string if the client doesn't send them
+ */
+std::string read_hash(uint8_t * & ret, size_t & ret_len, uint16_t features)
+{
+  std::string hash;
+  if (!(features & HAND_HASHES))
+    return hash;
+  size_t len = Read::i8(ret, ret_len);
+  if (len != 0 && len != HASH_LEN)
+    throw "Invalid file hash";
+  if (ret_len < len)
+    throw "Invalid file hash";
+  hash.assign((char*)ret, len);
+  ret += len;
+  ret_len -= len;
+  return hash;
+}
+
+/**
+ * Checks whether there is no use storing a pushed file, since the stored
+ * copy is newer or already holds the same contents
+ */
+bool skip_push(const Metadata::Data & fd, uint64_t modified,
+               const std::string & hash)
+{
+  if (fd.modified > modified)
+    return true;
+  return !hash.empty() && !fd.deleted && fd.hash == hash;
+}
+
+/**
+ * Records where the chunks of a stored file are so later pushes of this or
+ * any other file can reuse them
+ */
+void index_chunks(UserData * data, const std::string & filename,
+                  uint64_t modified, const std::vector<Chunker::Chunk> & chunks)
+{
+  ChunkIndex::Location loc;
+  loc.filename = filename;
+  loc.modified = modified;
+  for (auto it = chunks.begin(), end = chunks.end(); it != end; it++)
+    {
+      loc.offset = it->offset;
+      loc.length = it->length;
+      data->chunks->add(it->hash, loc, *data->mtd);
+    }
+  data->chunks->flush();
+}
+
+/**
+ * Splits the queued files into chunks without the user data lock held,
+ * taking it only to record those of files which haven't changed since
+ */
+void index_files(const std::string & user_dir, UserData * data,
+                 std::vector<std::pair<std::string, uint64_t>> & files)
+{
+  for (auto & file : files)
+    {
+      std::vector<Chunker::Chunk> split;
+      try
+        {
+          std::ifstream in(user_dir + file.first,
+                           std::ios::in | std::ios::binary);
+          split = Chunker::split(in);
+        }
+      catch(const char * e)
+        {
+          global_log.message(std::string("Failed to index ") + file.first,
+                             Log::WARNING);
+          continue;
+        }
+
+      // A push which replaced the file while it was read holds the lock
+      // until its metadata is updated, so a match means the read was whole
+      std::lock_guard<std::mutex> lock(data->lock);
+      Metadata::Data fd = data->mtd->get_file(file.first);
+      if (!fd.deleted && fd.modified == file.second)
+        index_chunks(data, file.first, file.second, split);
+    }
+  files.clear();
+}
+
+void pushed(const std::string & user_dir, NetMsg * netmsg, UserData * data,
+            uint16_t features, const std::string & filename,
+            uint64_t modified, const std::string & hash,
+            const std::vector<Chunker::Chunk> * chunks = NULL)
+{
+  drop_sig(data, filename);
+
+  // Update Metadata
+  struct stat stats;
+  stat((user_dir + filename).c_str(), &stats);
+  data->mtd->modify_file(filename, stats.st_size, modified, hash);
+  data->journal->record(filename);
+
+  // Files pushed whole are only worth splitting for clients which push
+  // chunks, which is none of those encrypting their files
+  if (chunks != NULL)
+    index_chunks(data, filename, modified, *chunks);
+  else if ((features & HAND_CHUNKS) && stats.st_size >= CHUNK_INDEX_MIN)
+    data->unindexed.push_back(std::make_pair(filename, modified));
+
+  // Send the update message to all clients
+  std::string cmd;
+  Write::i32(filename.length(), cmd);
+  cmd.append(filename);
+  Write::i64(modified, cmd);
+  Write::i8(0, cmd);
+
+  // Clients which don't know about hashes ignore the bytes after the flag
+  if (!hash.empty())
+    {
+      Write::i8(hash.length(), cmd);
+      cmd.append(hash);
+    }
+  broadcast(netmsg, data, cmd);
+
+  global_log.message(std::string("Pushed file ") + filename, Log::NOTICE);
+}
+
 void exec_command(const std::string & user_dir, Message * msg,
-                  NetMsg * netmsg, UserData * data)
+                  NetMsg * netmsg, UserData * data, uint16_t features)
 {
   uint8_t *ret = (uint8_t*)msg->get().data(), cmd;
   size_t ret_len = msg->get().length();
@@ -140,12 +564,95 @@ void exec_command(const std::string & user_dir, Message * msg,
   if (cmd == CMD_META)
     {
       size_t size;
-      uint8_t * dat = data->mtd->serialize(size);
+      uint8_t * dat = data->mtd->serialize(size, features & HAND_HASHES);
       std::string sdat((char*)dat, size);
       global_log.message(std::to_string(size), Log::NOTICE);
       msg->set(sdat);
       netmsg->reply_only(msg);
     }
+  else if (cmd == CMD_META_SINCE && (features & HAND_JOURNAL))
+    {
+      // Only the files which changed after the client's cursor are sent,
+      // or everything if the journal no longer reaches back that far
+      uint64_t epoch = Read::i64(ret, ret_len);
+      uint64_t seq = Read::i64(ret, ret_len);
+      bool tree = ret_len > 0 && Read::i8(ret, ret_len) &&
+        (features & HAND_TREE);
+      std::vector<std::string> changed;
+      bool full = !data->journal->since(epoch, seq, changed);
+
+      // A client with a copy of the metadata which is mostly right finds
+      // what differs from the root of the tree down instead
+      if (full && tree)
+        {
+          std::string sdat, root = data->mtd->digest("/");
+          Write::i8(META_TREE, sdat);
+          Write::i64(data->journal->epoch(), sdat);
+          Write::i64(data->journal->seq(), sdat);
+          Write::i8(root.length(), sdat);
+          sdat.append(root);
+          msg->set(sdat);
+          netmsg->reply_only(msg);
+          return;
+        }
+
+      Metadata part;
+      for (auto it = changed.begin(), end = changed.end(); it != end; it++)
+        part.set_file(*it, data->mtd->get_file(*it));
+
+      size_t size;
+      uint8_t * dat = (full ? data->mtd : &part)->serialize(size, true);
+      std::string sdat;
+      Write::i8(full, sdat);
+      Write::i64(data->journal->epoch(), sdat);
+      Write::i64(data->journal->seq(), sdat);
+      sdat.append((char*)dat, size);
+      delete[] dat;
+      global_log.message(std::string(full ? "Full" : "Partial") +
+                         " metadata of " + std::to_string(size) + " bytes",
+                         Log::NOTICE);
+      msg->set(sdat);
+      netmsg->reply_only(msg);
+    }
+  else if (cmd == CMD_TREE && (features & HAND_TREE))
+    {
+      // Lists each directory asked for, files along with their metadata
+      // so the differences found need no further requests
+      std::string sdat;
+      for (uint32_t count = Read::i32(ret, ret_len); count > 0; count--)
+        {
+          uint32_t path_len = Read::i32(ret, ret_len);
+          if (ret_len < path_len)
+            throw "Invalid tree request";
+          std::string path((char*)ret, path_len);
+          ret += path_len;
+          ret_len -= path_len;
+
+          std::vector<Metadata::Child> children = data->mtd->children(path);
+          Write::i32(children.size(), sdat);
+          for (auto it = children.begin(), end = children.end();
+               it != end; it++)
+            {
+              Write::i32(it->name.length(), sdat);
+              sdat.append(it->name);
+              Write::i8(it->dir, sdat);
+              Write::i8(it->digest.length(), sdat);
+              sdat.append(it->digest);
+              if (it->dir)
+                continue;
+
+              Metadata::Data fd =
+                data->mtd->get_file(Metadata::join(path, it->name));
+              Write::i64(fd.modified, sdat);
+              Write::i8(fd.deleted, sdat);
+              Write::i64(fd.size, sdat);
+              Write::i8(fd.hash.length(), sdat);
+              sdat.append(fd.hash);
+            }
+        }
+      msg->set(sdat);
+      netmsg->reply_only(msg);
+    }
   else if (cmd == CMD_PUSH)
     {
       // Read in the metadata
@@ -154,10 +661,16 @@ void exec_command(const std::string & user_dir, Message * msg,
       std::string filename((char*)ret, filename_len);
       ret += filename_len;
       ret_len -= filename_len;
+      std::string hash = read_hash(ret, ret_len, features);
 
-      // If the metadata has changed kill it
+      // Newer clients announce the size of the body
+      uint64_t size = 0;
+      if (ret_len >= 8)
+        size = Read::i64(ret, ret_len);
+
+      // If the metadata has changed or the contents haven't, kill it
       std::string cmd;
-      if (data->mtd->get_file(filename).modified > modified)
+      if (skip_push(data->mtd->get_file(filename), modified, hash))
         {
           Write::i8(1, cmd);
           msg->set(cmd);
@@ -167,80 +680,531 @@ void exec_command(const std::string & user_dir, Message * msg,
           return;
         }
 
-      // Read all of the file contents and push to file
-      std::ofstream out(user_dir + filename,
-                        std::ios::out | std::ios::binary);
+      // Open the file the contents are received straight into
+      int file = open((user_dir + filename).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (file < 0)
+        {
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Failed to create ") + filename,
+                             Log::WARNING);
+          return;
+        }
+
+      // Reserve the space up front so the file isn't fragmented
+      uint64_t reserved = reserve(file, size);
+
       Write::i8(0, cmd);
       msg->set(cmd);
       global_log.message("Writing to data file", Log::DEBUG);
-      netmsg->reply_and_wait(msg, &out);
-      out.close();
+      try
+        {
+          netmsg->reply_and_wait(msg, file);
+        }
+      catch(...)
+        {
+          unreserve(file, reserved);
+          close(file);
+          throw;
+        }
+      unreserve(file, reserved);
+      close(file);
 
       // Acknowledge successful transfer
       global_log.message("Writing Succeeded", Log::DEBUG);
       msg->set(cmd);
       netmsg->reply_only(msg);
 
-      // Update Metadata
+      pushed(user_dir, netmsg, data, features, filename, modified, hash);
+    }
+  else if (cmd == CMD_PUSH_INLINE)
+    {
+      // The body follows the header in the same message
+      uint64_t modified = Read::i64(ret, ret_len);
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+      std::string hash = read_hash(ret, ret_len, features);
+
+      // Only apply it if the client's copy is at least as new as ours and
+      // differs from it
+      std::string cmd;
+      if (skip_push(data->mtd->get_file(filename), modified, hash))
+        {
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Skipped Push: ") + filename,
+                             Log::NOTICE);
+          return;
+        }
+
+      int file = open((user_dir + filename).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      while (file >= 0 && ret_len > 0)
+        {
+          ssize_t wrote = write(file, ret, ret_len);
+          if (wrote < 0 && errno == EINTR)
+            continue;
+          if (wrote <= 0)
+            break;
+          ret += wrote;
+          ret_len -= wrote;
+        }
+      if (file >= 0)
+        close(file);
+      // Unlike a skip this is an error, so the client is told apart
+      if (file < 0 || ret_len > 0)
+        {
+          Write::i8(2, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Failed to write ") + filename,
+                             Log::WARNING);
+          return;
+        }
+
+      Write::i8(0, cmd);
+      msg->set(cmd);
+      netmsg->reply_only(msg);
+
+      pushed(user_dir, netmsg, data, features, filename, modified, hash);
+    }
+  else if (cmd == CMD_PULL)
+    {
+      // Get the client filename
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+
+      // Get metadata or write 1 on failure
+      Metadata::Data fd = data->mtd->get_file(filename);
+      std::string cmd;
+      int file = open((user_dir + filename).c_str(), O_RDONLY);
       struct stat stats;
-      stat((user_dir + filename).c_str(), &stats);
-      data->mtd->modify_file(filename, stats.st_size, modified);
+      if (file < 0 || fstat(file, &stats) < 0)
+        {
+          global_log.message(std::string("Failed to open ") + filename,
+                             Log::WARNING);
+          if (file >= 0)
+            close(file);
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          return;
+        }
 
-      // Send the update message to all clients
-      cmd.clear();
-      Write::i32(filename.length(), cmd);
-      cmd.append(filename);
-      Write::i64(modified, cmd);
+      // Write the metadata, then send the file straight from the page cache
       Write::i8(0, cmd);
-      for (auto it = data->handles.begin(), end = data->handles.end();
-           it != end; it++)
+      Write::i64(fd.modified, cmd);
+      msg->set(cmd);
+      try
         {
-          if (*it == netmsg)
-            continue;
+          msg = netmsg->reply_and_wait(msg);
+          msg = netmsg->reply_and_wait(msg, file, stats.st_size);
+        }
+      catch(...)
+        {
+          close(file);
+          throw;
+        }
+      close(file);
+      netmsg->destroy(msg);
 
-         try
-            {
-              Message *msg2 = (*it)->send_and_wait(cmd);
-              netmsg->destroy(msg2);
-            }
-          catch(const char * e)
+      global_log.message(std::string("Pulled file ") + filename, Log::NOTICE);
+    }
+  else if (cmd == CMD_PULL_INLINE)
+    {
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+      Metadata::Data fd = data->mtd->get_file(filename);
+
+      std::string cmd;
+      int file = open((user_dir + filename).c_str(), O_RDONLY);
+      struct stat stats;
+      if (file < 0 || fstat(file, &stats) < 0)
+        {
+          global_log.message(std::string("Failed to open ") + filename,
+                             Log::WARNING);
+          if (file >= 0)
+            close(file);
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          return;
+        }
+
+      // Large files still go straight from the page cache once the client
+      // is ready for them
+      if (stats.st_size > INLINE_MAX)
+        {
+          Write::i8(PULL_STREAM, cmd);
+          Write::i64(fd.modified, cmd);
+          msg->set(cmd);
+          try
             {
-              global_log.message("Failed to push update to client",
-                                 Log::WARNING);
+              msg = netmsg->reply_and_wait(msg);
+              msg = netmsg->reply_and_wait(msg, file, stats.st_size);
             }
-          catch(const std::string & e)
+          catch(...)
             {
-              global_log.message("Failed to push update to client",
-                                 Log::WARNING);
+              close(file);
+              throw;
             }
+          close(file);
+          netmsg->destroy(msg);
+          global_log.message(std::string("Pulled file ") + filename,
+                             Log::NOTICE);
+          return;
+        }
+
+      // Small files go in the reply along with their modification time
+      Write::i8(0, cmd);
+      Write::i64(fd.modified, cmd);
+      size_t head = cmd.length();
+      cmd.resize(head + stats.st_size);
+      while (head < cmd.length())
+        {
+          ssize_t red = read(file, &cmd[head], cmd.length() - head);
+          if (red < 0 && errno == EINTR)
+            continue;
+          if (red <= 0)
+            break;
+          head += red;
+        }
+      close(file);
+
+      // A short read would hand the client a truncated file as if it were
+      // whole
+      if (head != cmd.length())
+        {
+          global_log.message(std::string("Failed to read ") + filename,
+                             Log::WARNING);
+          cmd.clear();
+          Write::i8(1, cmd);
         }
+      msg->set(cmd);
+      netmsg->reply_only(msg);
 
-      global_log.message(std::string("Pushed file ") + filename, Log::NOTICE);
+      global_log.message(std::string("Pulled file ") + filename, Log::NOTICE);
     }
-  else if (cmd == CMD_PULL)
+  else if (cmd == CMD_SIG)
     {
-      // Get the client filename
       uint32_t filename_len = Read::i32(ret, ret_len);
       std::string filename((char*)ret, filename_len);
       ret += filename_len;
       ret_len -= filename_len;
+      Metadata::Data fd = data->mtd->get_file(filename);
 
-      // Get metadata or write 1 on failure
+      // Without a copy to sign the client pushes the whole file
+      std::string cmd;
+      try
+        {
+          if (fd.deleted || fd.modified == 0)
+            throw std::string("No copy to sign of ") + filename;
+          const std::string & sig = signature(user_dir, data, filename);
+          Write::i8(0, cmd);
+          Write::i64(fd.modified, cmd);
+          cmd.append(sig);
+        }
+      catch(const char * e)
+        {
+          cmd.clear();
+          Write::i8(1, cmd);
+        }
+      catch(const std::string & e)
+        {
+          cmd.clear();
+          Write::i8(1, cmd);
+        }
+      msg->set(cmd);
+      netmsg->reply_only(msg);
+    }
+  else if (cmd == CMD_PUSH_DELTA)
+    {
+      // The body is a delta against the copy the client was sent the
+      // signature of
+      uint64_t modified = Read::i64(ret, ret_len);
+      uint64_t basis = Read::i64(ret, ret_len);
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+      std::string hash = read_hash(ret, ret_len, features);
       Metadata::Data fd = data->mtd->get_file(filename);
 
-      // Write the metadata
       std::string cmd;
+      if (skip_push(fd, modified, hash))
+        {
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Skipped Push: ") + filename,
+                             Log::NOTICE);
+          return;
+        }
+
+      // The new file is built beside the old one and replaces it whole, so
+      // a broken delta never leaves a half written file behind
+      std::string path = user_dir + filename;
+      std::string temp = user_dir + ".delta-XXXXXX";
+      std::ifstream in;
+      int file = -1;
+      if (fd.modified == basis && !fd.deleted)
+        {
+          in.open(path, std::ios::in | std::ios::binary);
+          if (in)
+            file = mkstemp(&temp[0]);
+        }
+      if (file < 0)
+        {
+          Write::i8(DELTA_STALE, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          return;
+        }
+      fchmod(file, 0644);
+      close(file);
+
+      std::ofstream out(temp, std::ios::out | std::ios::binary |
+                        std::ios::trunc);
+      DeltaWriter patch(in, out);
+      Write::i8(0, cmd);
+      msg->set(cmd);
+      try
+        {
+          netmsg->reply_and_wait(msg, &patch);
+          patch.finish();
+          out.close();
+          if (!out || rename(temp.c_str(), path.c_str()) < 0)
+            throw "Failed to replace the file";
+        }
+      catch(const char * e)
+        {
+          unlink(temp.c_str());
+          cmd.clear();
+          Write::i8(2, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Failed to patch ") + filename +
+                             ": " + e, Log::WARNING);
+          return;
+        }
+      catch(...)
+        {
+          unlink(temp.c_str());
+          throw;
+        }
+
+      msg->set(cmd);
+      netmsg->reply_only(msg);
+
+      pushed(user_dir, netmsg, data, features, filename, modified, hash);
+    }
+  else if (cmd == CMD_PULL_DELTA)
+    {
+      // The signature of the client's copy follows the filename
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+      std::string sig((char*)ret, ret_len);
+      Metadata::Data fd = data->mtd->get_file(filename);
+
+      // The delta's length goes ahead of it, so it is made up front
+      std::string cmd;
+      std::ifstream in(user_dir + filename, std::ios::in | std::ios::binary);
+      std::fstream delta;
+      uint64_t len = 0;
+      try
+        {
+          if (!in)
+            throw "Failed to open the file";
+          File::temp(delta);
+          len = Delta::encode(sig, in, delta);
+          delta.seekg(0);
+        }
+      catch(const char * e)
+        {
+          global_log.message(std::string("Failed to pull ") + filename +
+                             ": " + e, Log::WARNING);
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          return;
+        }
+
       Write::i8(0, cmd);
       Write::i64(fd.modified, cmd);
       msg->set(cmd);
       msg = netmsg->reply_and_wait(msg);
-
-      // Write the file
-      std::ifstream fin(user_dir + filename, std::ios::in | std::ios::binary);
-      msg = netmsg->reply_and_wait(msg, &fin, fd.size);
+      msg = netmsg->reply_and_wait(msg, &delta, len);
       netmsg->destroy(msg);
 
-      global_log.message(std::string("Pulled file ") + filename, Log::NOTICE);
+      global_log.message(std::string("Pulled delta of ") + filename,
+                         Log::NOTICE);
+    }
+  else if (cmd == CMD_PUSH_CHUNKS)
+    {
+      // The header lists the length and hash of each chunk of the file
+      uint64_t modified = Read::i64(ret, ret_len);
+      uint32_t filename_len = Read::i32(ret, ret_len);
+      std::string filename((char*)ret, filename_len);
+      ret += filename_len;
+      ret_len -= filename_len;
+      std::string hash = read_hash(ret, ret_len, features);
+      uint32_t count = Read::i32(ret, ret_len);
+      if ((uint64_t)count * (4 + CHUNK_HASH) != ret_len)
+        throw "Invalid chunk list";
+      std::vector<Chunker::Chunk> chunks(count);
+      uint64_t offset = 0;
+      for (uint32_t i = 0; i < count; i++)
+        {
+          chunks[i].offset = offset;
+          chunks[i].length = Read::i32(ret, ret_len);
+          chunks[i].hash.assign((char*)ret, CHUNK_HASH);
+          ret += CHUNK_HASH;
+          ret_len -= CHUNK_HASH;
+          if (chunks[i].length == 0 || chunks[i].length > CHUNK_MAX)
+            throw "Invalid chunk list";
+          offset += chunks[i].length;
+        }
+
+      std::string cmd;
+      if (skip_push(data->mtd->get_file(filename), modified, hash))
+        {
+          Write::i8(1, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Skipped Push: ") + filename,
+                             Log::NOTICE);
+          return;
+        }
+
+      // Chunks found in the stored files are checked against their hashes
+      // before being relied on, and each one we lack is asked for once in
+      // the order it first shows up
+      std::vector<char> buff(CHUNK_MAX);
+      std::vector<const ChunkIndex::Location *> where(count);
+      std::unordered_map<std::string, uint64_t> sent;
+      std::ifstream src;
+      std::string src_name, asked;
+      uint64_t body = 0;
+      size_t asked_count = 0;
+      for (uint32_t i = 0; i < count; i++)
+        {
+          const Chunker::Chunk & chunk = chunks[i];
+          if (sent.count(chunk.hash) > 0)
+            continue;
+
+          const ChunkIndex::Location *loc =
+            data->chunks->find(chunk.hash, *data->mtd);
+          if (loc != NULL && loc->length == chunk.length)
+            {
+              if (src_name != loc->filename)
+                {
+                  src.close();
+                  src.open(user_dir + loc->filename,
+                           std::ios::in | std::ios::binary);
+                  src_name = loc->filename;
+                }
+              src.clear();
+              src.seekg(loc->offset);
+              if (read_chunk(src, chunk, buff.data()))
+                {
+                  where[i] = loc;
+                  continue;
+                }
+              data->chunks->drop(chunk.hash);
+            }
+
+          sent[chunk.hash] = body;
+          body += chunk.length;
+          Write::var(i, asked);
+          asked_count++;
+        }
+
+      std::fstream scratch;
+      File::temp(scratch);
+      Write::i8(0, cmd);
+      Write::var(asked_count, cmd);
+      cmd.append(asked);
+      msg->set(cmd);
+      netmsg->reply_and_wait(msg, &scratch);
+
+      // The new file is built beside the old one and replaces it whole
+      std::string path = user_dir + filename;
+      std::string temp = user_dir + ".chunks-XXXXXX";
+      int file = mkstemp(&temp[0]);
+      try
+        {
+          if (file < 0)
+            throw "Failed to create the file";
+          fchmod(file, 0644);
+          close(file);
+
+          std::ofstream out(temp, std::ios::out | std::ios::binary |
+                            std::ios::trunc);
+          for (uint32_t i = 0; i < count; i++)
+            {
+              const Chunker::Chunk & chunk = chunks[i];
+              std::istream *in = &scratch;
+              if (where[i] == NULL)
+                {
+                  scratch.clear();
+                  scratch.seekg(sent[chunk.hash]);
+                }
+              else
+                {
+                  if (src_name != where[i]->filename)
+                    {
+                      src.close();
+                      src.open(user_dir + where[i]->filename,
+                               std::ios::in | std::ios::binary);
+                      src_name = where[i]->filename;
+                    }
+                  src.clear();
+                  src.seekg(where[i]->offset);
+                  in = &src;
+                }
+              if (!read_chunk(*in, chunk, buff.data()))
+                throw "A chunk doesn't match its hash";
+              out.write(buff.data(), chunk.length);
+            }
+          out.close();
+          if (!out || rename(temp.c_str(), path.c_str()) < 0)
+            throw "Failed to replace the file";
+        }
+      catch(const char * e)
+        {
+          if (file >= 0)
+            unlink(temp.c_str());
+          cmd.clear();
+          Write::i8(2, cmd);
+          msg->set(cmd);
+          netmsg->reply_only(msg);
+          global_log.message(std::string("Failed to push chunks of ") +
+                             filename + ": " + e, Log::WARNING);
+          return;
+        }
+
+      cmd.clear();
+      Write::i8(0, cmd);
+      msg->set(cmd);
+      netmsg->reply_only(msg);
+
+      global_log.message(std::string("Reused ") +
+                         std::to_string(count - asked_count) + " of " +
+                         std::to_string(count) + " chunks of " + filename,
+                         Log::DEBUG);
+      pushed(user_dir, netmsg, data, features, filename, modified, hash,
+             &chunks);
     }
   else if (cmd == CMD_DEL)
     {
@@ -252,6 +1216,8 @@ void exec_command(const std::string & user_dir, Message * msg,
 
       // Update the metadata
       data->mtd->delete_file(filename, modified);
+      data->journal->record(filename);
+      drop_sig(data, filename);
 
       // Reply Success
       std::string cmd;
@@ -265,117 +1231,211 @@ void exec_command(const std::string & user_dir, Message * msg,
       cmd.append(filename);
       Write::i64(modified, cmd);
       Write::i8(0, cmd);
-      for (auto it = data->handles.begin(), end = data->handles.end();
-           it != end; it++)
-        {
-          if (*it == netmsg)
-            continue;
-
-          try
-            {
-              Message *msg2 = (*it)->send_and_wait(cmd);
-              netmsg->destroy(msg2);
-            }
-          catch(const char * e)
-            {
-              global_log.message("Failed to push update to client",
-                                 Log::WARNING);
-            }
-          catch(const std::string & e)
-            {
-              global_log.message("Failed to push update to client",
-                                 Log::WARNING);
-            }
-        }
+      broadcast(netmsg, data, cmd);
       global_log.message(std::string("Deleted file ") + filename, Log::NOTICE);
     }
   else
     throw "Invalid command from client";
 }
 
-void client(std::string store_dir, Net * net, User * user)
+struct Session
+{
+  std::string user_dir, mtd_name;
+  UserData *data;
+  NetMsg *netmsg;
+  uint16_t features;
+};
+
+Session * session_open(Net * net, NetMsg * netmsg, User * user)
 {
   UserData * data = NULL;
-  NetMsg * netmsg = NULL;
-  std::string user_dir;
   size_t mtd_size;
   uint8_t * mtd_buff;
   bool mtd_exists = false;
 
+  Session * session = new Session;
+  session->netmsg = netmsg;
   try
     {
-      user_dir = handshake(net, user);
-      std::string mtd_name = user_dir + ".mtd";
-      netmsg = new NetMsg(net);
-      netmsg->start();
+      session->user_dir = handshake(net, user, session->features);
+      netmsg->set_features(session->features & NETMSG_FEATURES);
+      netmsg->set_batch(batch_bytes, batch_delay);
+      netmsg->set_timeout(msg_timeout);
+    }
+  catch(...)
+    {
+      delete session;
+      throw;
+    }
+  session->mtd_name = session->user_dir + ".mtd";
 
-      // Get the user data structure
-      udata_lock.lock();
-      if (udata.count(user_dir) == 0)
-        {
-          data = new UserData;
-          udata[user_dir] = data;
+  // Get the user data structure
+  udata_lock.lock();
+  if (udata.count(session->user_dir) == 0)
+    {
+      data = new UserData;
+      data->sigs_bytes = 0;
+      udata[session->user_dir] = data;
 
-          // Extract the metadata contents
-          try
-            {
-              mtd_size = filesize(mtd_name);
-              mtd_exists = true;
-            }
-          catch(const std::string & e) {}
+      // Extract the metadata contents
+      try
+        {
+          mtd_size = filesize(session->mtd_name);
+          mtd_exists = true;
+        }
+      catch(const std::string & e) {}
 
-          if (mtd_exists)
-            {
-              global_log.message(std::string("Deserializing: ") + mtd_name,
-                                 Log::NOTICE);
-              mtd_buff = new uint8_t[mtd_size];
-              std::ifstream fin(mtd_name, std::ios::in | std::ios::binary);
-              fin.read((char*)mtd_buff, mtd_size);
-              fin.close();
-              data->mtd = new Metadata(mtd_buff, mtd_size);
-              delete[] mtd_buff;
-            }
-          else
-            data->mtd = new Metadata();
+      if (mtd_exists)
+        {
+          global_log.message(std::string("Deserializing: ") +
+                             session->mtd_name, Log::NOTICE);
+          mtd_buff = new uint8_t[mtd_size];
+          std::ifstream fin(session->mtd_name,
+                            std::ios::in | std::ios::binary);
+          fin.read((char*)mtd_buff, mtd_size);
+          fin.close();
+          data->mtd = new Metadata(mtd_buff, mtd_size);
+          delete[] mtd_buff;
         }
       else
-        data = udata.at(user_dir);
-      data->lock.lock();
-      data->handles.insert(netmsg);
+        data->mtd = new Metadata();
+
+      // Where the chunks of the stored files are and what changed in them
+      // lately, kept beside the metadata
+      data->chunks = NULL;
+      try
+        {
+          data->chunks = new ChunkIndex(session->user_dir + ".chunks",
+                                        *data->mtd);
+          data->journal = new Journal(session->user_dir + ".journal",
+                                      journal_size);
+        }
+      catch(...)
+        {
+          udata.erase(session->user_dir);
+          delete data->chunks;
+          delete data->mtd;
+          delete data;
+          udata_lock.unlock();
+          delete session;
+          throw;
+        }
+    }
+  else
+    data = udata.at(session->user_dir);
+  data->lock.lock();
+  data->handles_lock.lock();
+  data->handles.insert(netmsg);
+  data->handles_lock.unlock();
+  data->lock.unlock();
+  udata_lock.unlock();
+  session->data = data;
+
+  // Make sure the data directory exists
+  fs::create_directory(fs::path(session->user_dir));
+
+  return session;
+}
+
+bool session_command(Session * session, Message * msg)
+{
+  UserData * data = session->data;
+  size_t mtd_size;
+  uint8_t * mtd_buff;
+
+  uint8_t *ret = (uint8_t*)msg->get().data(), cmd;
+  size_t ret_len = msg->get().length();
+  cmd = Read::i8(ret, ret_len);
+
+  // Exit the loop if the message is quit
+  if (cmd == CMD_QUIT)
+    {
+      session->netmsg->destroy(msg);
+      return false;
+    }
+
+  std::vector<std::pair<NetMsg *, std::string>> updates;
+  std::vector<std::pair<std::string, uint64_t>> unindexed;
+
+  // Lock the struct to prevent changes
+  data->lock.lock();
+  try
+    {
+      exec_command(session->user_dir + "/", msg, session->netmsg, data,
+                   session->features);
+    }
+  catch(...)
+    {
+      data->journal->flush();
+      updates.swap(data->updates);
+      unindexed.swap(data->unindexed);
       data->lock.unlock();
-      udata_lock.unlock();
+      send_updates(data, updates);
+      index_files(session->user_dir + "/", data, unindexed);
+      throw;
+    }
 
-      // Make sure the data directory exists
-      fs::create_directory(fs::path(user_dir));
+  // The journal goes out first, a change it holds which the metadata
+  // missed is only sent again
+  data->journal->flush();
 
-      while (true)
-        {
-          // Wait to process the message
-          Message *msg = netmsg->wait_new();
-          uint8_t *ret = (uint8_t*)msg->get().data(), cmd;
-          size_t ret_len = msg->get().length();
-          cmd = Read::i8(ret, ret_len);
+  // Save the metadata after each call, along with the hashes clients sent
+  mtd_buff = data->mtd->serialize(mtd_size, true);
+  std::ofstream fout(session->mtd_name, std::ios::out | std::ios::binary);
+  fout.write((char*)mtd_buff, mtd_size);
+  fout.close();
+  delete[] mtd_buff;
 
-          // Exit the loop if the message is quit
-          if (cmd == CMD_QUIT)
-            {
-              netmsg->destroy(msg);
-              break;
-            }
+  updates.swap(data->updates);
+  unindexed.swap(data->unindexed);
+  data->lock.unlock();
+  send_updates(data, updates);
+  index_files(session->user_dir + "/", data, unindexed);
 
-          // Lock the struct to prevent changes
-          data->lock.lock();
-          exec_command(user_dir + "/", msg, netmsg, data);
+  return true;
+}
 
-          // Save the metadata after each call
-          mtd_buff = data->mtd->serialize(mtd_size);
-          std::ofstream fout(mtd_name, std::ios::out | std::ios::binary);
-          fout.write((char*)mtd_buff, mtd_size);
-          fout.close();
-          delete[] mtd_buff;
+void session_close(Session * session)
+{
+  UserData * data = session->data;
 
-          data->lock.unlock();
-        }
+  udata_lock.lock();
+  data->lock.lock();
+
+  // Erase the handle to our current netmsg
+  data->handles_lock.lock();
+  data->handles.erase(session->netmsg);
+  data->handles_lock.unlock();
+  if (data->handles.size() == 0)
+    {
+      data->lock.unlock();
+
+      // Erase the data struct if all clients disconnect
+      delete data->journal;
+      delete data->chunks;
+      delete data->mtd;
+      delete data;
+      udata.erase(session->user_dir);
+    }
+  else
+    data->lock.unlock();
+  udata_lock.unlock();
+
+  delete session;
+}
+
+void client(std::string store_dir, Net * net, User * user)
+{
+  Session * session = NULL;
+  NetMsg * netmsg = new NetMsg(net);
+
+  try
+    {
+      session = session_open(net, netmsg, user);
+      netmsg->start();
+
+      // Process each command as it arrives
+      while (session_command(session, netmsg->wait_new()));
     }
   catch(const std::string & e)
     {
@@ -385,29 +1445,66 @@ void client(std::string store_dir, Net * net, User * user)
     {
       global_log.message(std::string("Client Failed: ") + e, 2);
     }
-
-  if(data != NULL)
+  catch(...)
     {
-      udata_lock.lock();
-      data->lock.lock();
+      global_log.message("Client Failed", 2);
+    }
 
-      // Erase the handle to our current netmsg
-      data->handles.erase(netmsg);
-      if (data->handles.size() == 0)
-        {
-          data->lock.unlock();
+  if (session != NULL)
+    session_close(session);
 
-          // Erase the data struct if all clients disconnect
-          delete data->mtd;
-          delete data;
-          udata.erase(user_dir);
-        }
-      else
-        data->lock.unlock();
-      udata_lock.unlock();
+  delete netmsg;
+  delete net;
+}
+
+void reactor_client(Reactor * reactor, Net * net, User * user)
+{
+  NetMsg * netmsg = new NetMsg(net, false);
+  Session * session = NULL;
+
+  try
+    {
+      // Don't let a stalled login hold its thread forever
+      net->set_timeout(HAND_TIMEOUT);
+      session = session_open(net, netmsg, user);
+      net->set_timeout(0);
+
+      // Sends are written inline on this socket, don't let a client which
+      // stops reading hold the writer for longer than a message may take
+      net->set_send_timeout((msg_timeout + 999) / 1000);
+
+      reactor->add(netmsg,
+                   [session](NetMsg * netmsg)
+                   {
+                     return session_command(session, netmsg->wait_new());
+                   },
+                   [net, session](NetMsg * netmsg)
+                   {
+                     session_close(session);
+                     netmsg->close();
+                     delete net;
+                   });
+      return;
+    }
+  catch(const std::string & e)
+    {
+      global_log.message(std::string("Client Failed: ") + e, 2);
     }
+  catch(const char * e)
+    {
+      global_log.message(std::string("Client Failed: ") + e, 2);
+    }
+  catch(...)
+    {
+      global_log.message("Client Failed", 2);
+    }
+
+  // The session was never handed to the reactor
+  if (session != NULL)
+    session_close(session);
 
   delete netmsg;
+  delete net;
 }
 
 int main(int argc, char * argv[])
@@ -417,6 +1514,7 @@ int main(int argc, char * argv[])
   std::string store_dir;
   bool daemonize = false;
   NetServer * server = NULL;
+  Reactor * reactor = NULL;
   User * user = NULL;
 
   // Catch errors in stderr until we have the log output setup
@@ -475,32 +1573,82 @@ int main(int argc, char * argv[])
         throw "Requires a directory to store data in";
       store_dir = conf.get_str("store_dir");
 
+      // Tune how frames are batched during bursts of messages
+      if (conf.exists("batch_bytes"))
+        batch_bytes = conf.get_int("batch_bytes");
+      if (conf.exists("batch_delay"))
+        batch_delay = conf.get_int("batch_delay");
+
+      // Give up on clients which stop answering
+      if (conf.exists("msg_timeout"))
+        msg_timeout = conf.get_int("msg_timeout");
+
+      // Remember enough changes that reconnecting clients rarely need all
+      // of the metadata
+      if (conf.exists("journal_size"))
+        journal_size = conf.get_int("journal_size");
+
+      // Bound the memory held by signatures of files clients patch
+      if (conf.exists("sig_cache_size"))
+        sig_cache_size = conf.get_int("sig_cache_size");
+
       global_log.message("Successfully started!", Log::NOTICE);
 
       // Setup the user login credentials
       user = new User(store_dir);
 
-      // Accept all client connections and spawn a thread for each
-      while (true)
+      // Multiplex all of the clients over epoll with a pool of workers
+      if (conf.exists("server_mode") &&
+          conf.get_str("server_mode") == "reactor")
         {
-          Net * net = server->accept();
-          std::thread c_thread(client, store_dir, net, user);
-          c_thread.detach();
+          size_t workers = DEFAULT_WORKERS;
+          if (conf.exists("worker_threads"))
+            workers = conf.get_int("worker_threads");
+          reactor = new Reactor(workers);
+          reactor->start();
+          global_log.message(std::string("Running reactor with ") +
+                             std::to_string(workers) + " workers",
+                             Log::NOTICE);
+
+          // Logins are read with blocking calls, so each gets a thread of
+          // its own until it is handed to the reactor. A client which
+          // never speaks would otherwise hold a worker for HAND_TIMEOUT
+          while (true)
+            {
+              Net * net = server->accept();
+              std::thread login(reactor_client, reactor, net, user);
+              login.detach();
+            }
         }
+
+      // Accept all client connections and spawn a thread for each
+      else if (!conf.exists("server_mode") ||
+               conf.get_str("server_mode") == "thread")
+        while (true)
+          {
+            Net * net = server->accept();
+            std::thread c_thread(client, store_dir, net, user);
+            c_thread.detach();
+          }
+      else
+        throw "Unrecognized server mode - " + conf.get_str("server_mode");
     }
   catch(const char * e)
     {
       global_log.message(e, 1);
+      delete reactor;
       delete server;
       return EXIT_FAILURE;
     }
   catch(const std::string & e)
     {
       global_log.message(e, 1);
+      delete reactor;
       delete server;
       return EXIT_FAILURE;
     }
 
+  delete reactor;
   delete server;
 
   return EXIT_SUCCESS;
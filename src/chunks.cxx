@@ -0,0 +1,302 @@
+/*
+  Content defined chunking and an index of where chunks are stored
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <cstring>
+
+#include "openssl/evp.h"
+
+#include "util.hxx"
+#include "chunks.hxx"
+
+// Boundaries are harder to find before the average size and easier after
+// it, which keeps most chunks near the average
+#define CHUNK_MASK_S 0xffffc00000000000ull
+#define CHUNK_MASK_L 0xfffc000000000000ull
+
+// Bytes of an index record ahead of its filename
+#define RECORD_HEAD (CHUNK_HASH + 24)
+
+// Longer filenames in the log can only be garbage
+#define NAME_MAX_LEN 65536
+
+// Records the log may hold beyond those still in use before it is
+// rewritten
+#define LOG_SLACK 1024
+
+/**
+ * The table of random values the rolling hash is made from, which has to
+ * be the same everywhere so every client cuts the same data the same way
+ */
+struct Gear
+{
+  uint64_t table[256];
+
+  Gear()
+  {
+    // SplitMix64 from a fixed seed
+    uint64_t seed = 0x6c696273796e63ull;
+    for (int i = 0; i < 256; i++)
+      {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        table[i] = z ^ (z >> 31);
+      }
+  }
+};
+
+size_t Chunker::cut(const uint8_t * data, size_t len)
+{
+  static const Gear gear;
+
+  if (len <= CHUNK_MIN)
+    return len;
+  size_t normal = len < CHUNK_AVG ? len : CHUNK_AVG;
+  size_t end = len < CHUNK_MAX ? len : CHUNK_MAX;
+
+  // The hash only covers the last 64 bytes since older ones are shifted
+  // out, so the bytes before the minimum are skipped
+  uint64_t fp = 0;
+  size_t i = CHUNK_MIN;
+  for (; i < normal; i++)
+    {
+      fp = (fp << 1) + gear.table[data[i]];
+      if (!(fp & CHUNK_MASK_S))
+        return i + 1;
+    }
+  for (; i < end; i++)
+    {
+      fp = (fp << 1) + gear.table[data[i]];
+      if (!(fp & CHUNK_MASK_L))
+        return i + 1;
+    }
+  return end;
+}
+
+std::string Chunker::hash(const uint8_t * data, size_t len)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+
+  EVP_Digest(data, len, md, &md_len, EVP_sha256(), NULL);
+  return std::string((char*)md, CHUNK_HASH);
+}
+
+std::vector<Chunker::Chunk> Chunker::split(std::istream & in)
+{
+  std::vector<Chunk> chunks;
+  std::vector<uint8_t> buff(2 * CHUNK_MAX);
+  size_t start = 0, end = 0;
+  uint64_t offset = 0;
+  bool more = true;
+
+  while (true)
+    {
+      // Keep a whole chunk's worth ahead of the cut unless the file ends
+      if (more && end - start < CHUNK_MAX)
+        {
+          memmove(buff.data(), buff.data() + start, end - start);
+          end -= start;
+          start = 0;
+
+          size_t want = buff.size() - end;
+          in.read((char*)buff.data() + end, want);
+          if (in.bad())
+            throw "Failed to read the file to split";
+          end += in.gcount();
+          more = (size_t)in.gcount() == want;
+        }
+      if (start == end)
+        break;
+
+      Chunk chunk;
+      chunk.offset = offset;
+      chunk.length = cut(buff.data() + start, end - start);
+      chunk.hash = hash(buff.data() + start, chunk.length);
+      chunks.push_back(chunk);
+      start += chunk.length;
+      offset += chunk.length;
+    }
+
+  return chunks;
+}
+
+ChunkReader::ChunkReader(std::istream & in, std::streampos start,
+                         const std::vector<Chunker::Chunk> & chunks)
+  : std::istream(NULL), buf(in, start, chunks)
+{
+  rdbuf(&buf);
+}
+
+ChunkReader::~ChunkReader()
+{
+}
+
+ChunkReader::Buf::Buf(std::istream & in, std::streampos start,
+                      const std::vector<Chunker::Chunk> & chunks)
+  : in(in), start(start), chunks(chunks), next(0)
+{
+}
+
+ChunkReader::Buf::int_type ChunkReader::Buf::underflow()
+{
+  if (next >= chunks.size())
+    return traits_type::eof();
+
+  // A chunk cut short by a file which shrank ends the stream early, so the
+  // reader finds out it is shorter than the length it was promised
+  const Chunker::Chunk & chunk = chunks[next++];
+  buff.resize(chunk.length);
+  in.clear();
+  in.seekg(start + (std::streamoff)chunk.offset);
+  in.read(buff.data(), chunk.length);
+  if ((size_t)in.gcount() != chunk.length)
+    {
+      next = chunks.size();
+      return traits_type::eof();
+    }
+
+  setg(buff.data(), buff.data(), buff.data() + buff.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+ChunkIndex::ChunkIndex(const std::string & path, const Metadata & mtd)
+  : path(path)
+{
+  size_t records = 0;
+  bool torn = false;
+
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  std::string head(RECORD_HEAD, '\0');
+  while (!torn && in.read(&head[0], RECORD_HEAD))
+    {
+      uint8_t *data = (uint8_t*)head.data() + CHUNK_HASH;
+      size_t size = RECORD_HEAD - CHUNK_HASH;
+      Location loc;
+      loc.offset = Read::i64(data, size);
+      loc.length = Read::i32(data, size);
+      loc.modified = Read::i64(data, size);
+      uint32_t name_len = Read::i32(data, size);
+      loc.filename.resize(name_len < NAME_MAX_LEN ? name_len : 0);
+      if (name_len >= NAME_MAX_LEN ||
+          !in.read(&loc.filename[0], loc.filename.length()))
+        {
+          torn = true;
+          break;
+        }
+      records++;
+
+      // Dropped chunks are recorded with no length
+      std::string hash(head, 0, CHUNK_HASH);
+      if (loc.length == 0)
+        chunks.erase(hash);
+      else
+        chunks[hash] = loc;
+    }
+  if (in.gcount() > 0)
+    torn = true;
+  in.close();
+
+  // Chunks of files which have changed since are no use
+  for (auto it = chunks.begin(); it != chunks.end(); )
+    if (find(it->first, mtd) == NULL)
+      it = chunks.erase(it);
+    else
+      it++;
+
+  // A record cut short by a crash would garble everything appended after
+  // it, so the log is rewritten from what was read
+  if (torn || records > 2 * chunks.size() + LOG_SLACK)
+    {
+      std::string tmp = path + ".new";
+      log.open(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+      for (auto it = chunks.begin(), end = chunks.end(); it != end; it++)
+        write(it->first, it->second);
+      log.close();
+      if (!log || rename(tmp.c_str(), path.c_str()) < 0)
+        throw "Failed to compact the chunk index";
+    }
+
+  log.open(path, std::ios::out | std::ios::binary | std::ios::app);
+  if (!log)
+    throw "Failed to open the chunk index";
+}
+
+ChunkIndex::~ChunkIndex()
+{
+  log.close();
+}
+
+const ChunkIndex::Location * ChunkIndex::find(const std::string & hash,
+                                              const Metadata & mtd) const
+{
+  auto it = chunks.find(hash);
+  if (it == chunks.end())
+    return NULL;
+
+  // The file has been replaced or deleted since the chunk was recorded
+  Metadata::Data data = mtd.get_file(it->second.filename);
+  if (data.deleted || data.modified != it->second.modified)
+    return NULL;
+  return &it->second;
+}
+
+void ChunkIndex::add(const std::string & hash, const Location & loc,
+                     const Metadata & mtd)
+{
+  if (find(hash, mtd) != NULL)
+    return;
+  chunks[hash] = loc;
+  write(hash, loc);
+}
+
+void ChunkIndex::drop(const std::string & hash)
+{
+  if (chunks.erase(hash) == 0)
+    return;
+  Location loc;
+  loc.offset = 0;
+  loc.length = 0;
+  loc.modified = 0;
+  write(hash, loc);
+}
+
+void ChunkIndex::flush()
+{
+  log.flush();
+}
+
+size_t ChunkIndex::size() const
+{
+  return chunks.size();
+}
+
+void ChunkIndex::write(const std::string & hash, const Location & loc)
+{
+  std::string rec(hash);
+  Write::i64(loc.offset, rec);
+  Write::i32(loc.length, rec);
+  Write::i64(loc.modified, rec);
+  Write::i32(loc.filename.length(), rec);
+  rec.append(loc.filename);
+  log.write(rec.data(), rec.length());
+}
@@ -0,0 +1,189 @@
+/*
+  Content defined chunking and an index of where chunks are stored
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CHUNKS_HXX__
+#define __CHUNKS_HXX__
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "metadata.hxx"
+
+// Bytes in the hash which names a chunk
+#define CHUNK_HASH 32
+
+// Bounds on the chunk sizes, the boundaries are placed to average about
+// CHUNK_AVG bytes
+#define CHUNK_MIN 16384
+#define CHUNK_AVG 65536
+#define CHUNK_MAX 262144
+
+/**
+ * Splits files at boundaries picked by their contents with FastCDC, so
+ * data inserted into a file only changes the chunks around it and data
+ * repeated in other files is split the same way there
+ */
+namespace Chunker
+{
+  struct Chunk
+  {
+    uint64_t offset;
+    uint32_t length;
+    std::string hash;
+  };
+
+  /**
+   * Finds where the chunk at the start of the data ends
+   * @param data The data, holding at least CHUNK_MAX bytes unless it runs
+   *             to the end of the file
+   * @param len The length of the data
+   * @return The length of the chunk
+   */
+  size_t cut(const uint8_t * data, size_t len);
+
+  /**
+   * @return The name of the chunk, its SHA-256
+   */
+  std::string hash(const uint8_t * data, size_t len);
+
+  /**
+   * Splits a file into chunks and names each of them
+   * @param in The file, read from its current position to its end
+   * @return The chunks in order
+   */
+  std::vector<Chunk> split(std::istream & in);
+};
+
+/**
+ * Reads chunks out of a file one after another, so the chunks a push
+ * needs are read as they are sent instead of being gathered up front
+ */
+class ChunkReader : public std::istream
+{
+public:
+  /**
+   * @param in The file, which is read with seeks and must stay valid while
+   *           the reader is used
+   * @param start Where the file starts in the stream
+   * @param chunks The chunks to read, in the order they are wanted
+   */
+  ChunkReader(std::istream & in, std::streampos start,
+              const std::vector<Chunker::Chunk> & chunks);
+  ~ChunkReader();
+
+private:
+  class Buf : public std::streambuf
+  {
+  public:
+    Buf(std::istream & in, std::streampos start,
+        const std::vector<Chunker::Chunk> & chunks);
+
+  protected:
+    int_type underflow();
+
+  private:
+    std::istream & in;
+    std::streampos start;
+    std::vector<Chunker::Chunk> chunks;
+    size_t next;
+    std::vector<char> buff;
+  };
+
+  Buf buf;
+};
+
+/**
+ * Finds chunks inside the stored files, so a chunk which is already on
+ * disk is never sent again. A location is only trusted while the file
+ * holds the version it was recorded for, and the index is kept in a log
+ * which is appended to as files are stored
+ */
+class ChunkIndex
+{
+public:
+  struct Location
+  {
+    std::string filename;
+    uint64_t offset;
+    uint32_t length;
+    uint64_t modified;
+  };
+
+  /**
+   * Loads the index from its log, which is compacted if most of it has
+   * been replaced
+   * @param path The log file, created if it doesn't exist
+   * @param mtd The metadata of the stored files, chunks of files which
+   *            have changed since they were recorded are forgotten
+   */
+  ChunkIndex(const std::string & path, const Metadata & mtd);
+  ~ChunkIndex();
+
+  /**
+   * Looks up where a chunk is stored
+   * @param hash The name of the chunk
+   * @param mtd The metadata of the stored files
+   * @return The location, or NULL if no current file holds the chunk
+   */
+  const Location * find(const std::string & hash, const Metadata & mtd) const;
+
+  /**
+   * Records where a chunk is stored, unless it is already known
+   * @param hash The name of the chunk
+   * @param loc Where the chunk is
+   * @param mtd The metadata of the stored files
+   */
+  void add(const std::string & hash, const Location & loc,
+           const Metadata & mtd);
+
+  /**
+   * Forgets a chunk whose location turned out to be wrong
+   * @param hash The name of the chunk
+   */
+  void drop(const std::string & hash);
+
+  /**
+   * Writes the records added so far out to the log
+   */
+  void flush();
+
+  /**
+   * @return The number of chunks in the index
+   */
+  size_t size() const;
+
+private:
+  std::string path;
+  std::unordered_map<std::string, Location> chunks;
+  std::ofstream log;
+
+  void write(const std::string & hash, const Location & loc);
+
+  ChunkIndex(const ChunkIndex &);
+  ChunkIndex & operator=(const ChunkIndex &);
+};
+
+#endif
@@ -22,26 +22,33 @@
 #include <iostream>
 #include <fstream>
 #include <functional>
+#include <set>
 #include <chrono>
+#include <vector>
 #include <sys/types.h>
 #include <sys/stat.h>
 #ifdef WIN32
 #  include <sys/utime.h>
 #  include <time.h>
+#  include <io.h>
 #else
 #  include <utime.h>
+#  include <unistd.h>
 #endif
 
 #include "client.hxx"
 #include "log.hxx"
 #include "util.hxx"
 
+// Added to the name of a file being pulled, the new copy is written beside
+// the old one and only takes its place once the whole pull has succeeded
+#define PULL_SUFFIX ".libsync-part"
+
 Client::Client(const Config & conf)
   : done(false), conf(conf), conn(NULL), crypt(NULL), meta(NULL),
+    remote(NULL), remote_epoch(0), remote_seq(0), hashes(NULL),
     file_thread(NULL), pull_thread(NULL), watch_thread(NULL)
 {
-  Metadata *remote = NULL;
-
   try
     {
       // Load the local metadata from the sync directory
@@ -50,36 +57,59 @@ Client::Client(const Config & conf)
       sync_dir = conf.get_str("sync_dir");
       meta = new Metadata(sync_dir);
 
+      // Hash the contents so files which match the server's copies aren't
+      // sent either way
+      hashes = new HashCache(conf.exists("hash_cache") ?
+                             conf.get_str("hash_cache") :
+                             sync_dir + ".hashes");
+      hash_threads = conf.exists("hash_threads") ?
+        conf.get_int("hash_threads") : std::thread::hardware_concurrency();
+      if (hash_threads < 1)
+        hash_threads = 1;
+      if (conf.exists("key"))
+        hash_key = conf.get_str("key");
+      hash_metadata();
+
       // Attempt to create the connection type specified in the config
       if (!conf.exists("conn") || conf.get_str("conn") == "sock")
         {
           if (!conf.exists("conn_host") || !conf.exists("conn_port") ||
               !conf.exists("conn_user") || !conf.exists("conn_pass"))
             throw "Socket Connector Missing Parameters";
+          SockConnector *sock;
           if (conf.exists("key"))
-            conn = new SockConnector(conf.get_str("conn_host"),
+            sock = new SockConnector(conf.get_str("conn_host"),
                                      conf.get_int("conn_port"),
                                      conf.get_str("conn_user"),
                                      conf.get_str("conn_pass"),
                                      conf.get_str("key"));
           else
-            conn = new SockConnector(conf.get_str("conn_host"),
+            sock = new SockConnector(conf.get_str("conn_host"),
                                      conf.get_int("conn_port"),
                                      conf.get_str("conn_user"),
                                      conf.get_str("conn_pass"));
+          conn = sock;
+
+          // Keep several commands in flight so a slow link isn't idle
+          // between them
+          if (conf.exists("conn_window"))
+            sock->set_window(conf.get_int("conn_window"));
         }
       else
         throw "Unrecognized connector type - " + conf.get_str("conn");
 
       // Get the remote metadata and perform a merge with local metadata
       global_log.message("Getting the remote metadata", Log::NOTICE);
-      remote = conn->get_metadata();
+      remote_cache = conf.exists("remote_cache") ?
+        conf.get_str("remote_cache") : sync_dir + ".remote";
+      fetch_remote();
       merge_metadata(*remote);
     }
   catch(const char * e)
     {
       global_log.message(e, 1);
       delete meta;
+      delete hashes;
       delete conn;
       delete remote;
       throw e;
@@ -88,11 +118,11 @@ Client::Client(const Config & conf)
     {
       global_log.message(e, 1);
       delete meta;
+      delete hashes;
       delete conn;
       delete remote;
       throw e;
     }
-  delete remote;
 
   global_log.message("Client successfully started!", Log::NOTICE);
 }
@@ -117,6 +147,19 @@ Client::~Client()
   delete watch_thread;
   delete meta;
   delete conn;
+
+  save_remote();
+  delete remote;
+
+  try
+    {
+      hashes->save();
+    }
+  catch(const char * e)
+    {
+      global_log.message(e, Log::WARNING);
+    }
+  delete hashes;
 }
 
 void Client::start()
@@ -130,64 +173,176 @@ void Client::start()
 
 void Client::merge_metadata(const Metadata & remote)
 {
-  Msg msg;
-
-  // Merge all of the local data into the remote data and push messages
-  for (auto it = meta->begin(), end = meta->end(); it != end; it++)
+  auto queue = [this](const std::string & filename, bool from_remote,
+                      const Metadata::Data & data)
     {
-      Metadata::Data rem = remote.get_file(it->first);
-
-      // Is the file at least better than the file on the server
-      if (it->second.modified <= rem.modified)
-        continue;
+      Msg msg;
+      msg.filename = filename;
+      msg.remote = from_remote;
+      msg.file_data = data;
 
-      // Parse the data into a message
-      msg.filename = it->first;
-      msg.remote = false;
-      msg.file_data = it->second;
-
-      global_log.message(std::string("Local Push: ") + it->first,
-                         Log::DEBUG);
+      global_log.message(std::string(from_remote ? "Remote Push: " :
+                                     "Local Push: ") + filename, Log::DEBUG);
 
       // Push the message onto the stack
       message_lock.lock();
       messages.push(msg);
       message_lock.unlock();
       message_cond.notify_all();
+    };
+
+  // Files only differ below directories whose digests differ, so the trees
+  // are walked from the root down skipping everything which matches
+  std::vector<std::string> dirs(1, "/");
+  while (!dirs.empty())
+    {
+      std::string dir = dirs.back();
+      dirs.pop_back();
+      if (meta->digest(dir) == remote.digest(dir))
+        continue;
+
+      // The entries of the directory on either side, each once
+      std::set<std::string> subdirs, files;
+      std::vector<Metadata::Child> children = meta->children(dir),
+        theirs = remote.children(dir);
+      children.insert(children.end(), theirs.begin(), theirs.end());
+      for (auto it = children.begin(), end = children.end(); it != end; it++)
+        (it->dir ? subdirs : files).insert(Metadata::join(dir, it->name));
+      dirs.insert(dirs.end(), subdirs.begin(), subdirs.end());
+
+      for (auto it = files.begin(), end = files.end(); it != end; it++)
+        {
+          Metadata::Data local = meta->get_file(*it);
+          Metadata::Data rem = remote.get_file(*it);
+          if (same_contents(local, rem))
+            continue;
+
+          // Whichever copy is newer wins
+          if (local.modified > rem.modified)
+            queue(*it, false, local);
+          else if (rem.modified > local.modified)
+            queue(*it, true, rem);
+        }
     }
+}
 
-  // Merge the remote data into the local data and pull messages
-  for (auto it = remote.begin(), end = remote.end(); it != end; it++)
+void Client::fetch_remote()
+{
+  // The copy from the last run, which is only as new as its cursor
+  try
     {
-      Metadata::Data local =  meta->get_file(it->first);
+      std::ifstream in(remote_cache, std::ios::in | std::ios::binary |
+                       std::ios::ate);
+      std::vector<uint8_t> buff(in ? (size_t)in.tellg() : 0);
+      in.seekg(0);
+      if (!in || !in.read((char*)buff.data(), buff.size()))
+        throw "Failed to read the remote metadata";
+      size_t size = buff.size();
+      uint8_t *data = buff.data();
+      size_t len = size;
+      remote_epoch = Read::i64(data, len);
+      remote_seq = Read::i64(data, len);
+      remote = new Metadata(data, len);
+    }
+  catch(...)
+    {
+      remote_epoch = remote_seq = 0;
+    }
 
-      // Is the file at least better than the local file
-      if (it->second.modified <= local.modified)
-        continue;
+  // Without one the local files stand in for it, since most of them are
+  // usually on the server already and only the rest need comparing
+  if (remote == NULL)
+    remote = new Metadata(*meta);
+
+  Metadata *fetched = conn->get_metadata(remote, remote_epoch, remote_seq);
+  if (fetched != remote)
+    {
+      delete remote;
+      remote = fetched;
+    }
+}
 
-      // Parse the data into a message
-      msg.filename = it->first;
-      msg.remote = true;
-      msg.file_data = it->second;
+void Client::save_remote()
+{
+  size_t size;
+  uint8_t *data = remote->serialize(size, true);
+  std::string head;
+  Write::i64(remote_epoch, head);
+  Write::i64(remote_seq, head);
+
+  // Written beside the old copy and moved over it, so a crash leaves one
+  // whole copy with the cursor it goes with
+  std::string tmp = remote_cache + ".new";
+  std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(head.data(), head.length());
+  out.write((char*)data, size);
+  out.close();
+  delete[] data;
+  if (!out || rename(tmp.c_str(), remote_cache.c_str()) < 0)
+    global_log.message("Failed to save the remote metadata", Log::WARNING);
+}
 
-      global_log.message(std::string("Remote Push: ") + it->first,
-                         Log::DEBUG);
+void Client::hash_metadata()
+{
+  std::vector<std::string> names, paths;
+  for (auto it = meta->begin(), end = meta->end(); it != end; it++)
+    if (!it->second.deleted)
+      {
+        names.push_back(it->first);
+        paths.push_back(sync_dir + it->first);
+      }
+
+  std::vector<std::string> found = hashes->hash(paths, hash_threads);
+  for (size_t i = 0; i < names.size(); i++)
+    if (!found[i].empty())
+      meta->set_hash(names[i], hash_key.empty() ? found[i] :
+                     Hasher::keyed(hash_key, found[i]));
 
-      // Push the message onto the stack
-      message_lock.lock();
-      messages.push(msg);
-      message_lock.unlock();
-      message_cond.notify_all();
+  try
+    {
+      hashes->save();
     }
+  catch(const char * e)
+    {
+      global_log.message(e, Log::WARNING);
+    }
+}
+
+std::string Client::hash_file(const std::string & full_name)
+{
+  std::string hash = hashes->hash(full_name);
+  if (hash.empty() || hash_key.empty())
+    return hash;
+  return Hasher::keyed(hash_key, hash);
+}
+
+bool Client::same_contents(const Metadata::Data & a, const Metadata::Data & b)
+{
+  return !a.deleted && !b.deleted && !a.hash.empty() && a.hash == b.hash;
 }
 
 void Client::file_master()
 {
+  std::deque<Pending> pending;
   Msg msg;
 
   message_lock.lock();
   while(!done)
     {
+      // Complete the commands which have finished, in the order they were
+      // sent. With nothing new to send the oldest one is waited on
+      while (!pending.empty() &&
+             ((pending.front().pulled.valid() ?
+               pending.front().pulled.wait_for(std::chrono::seconds(0)) :
+               pending.front().done.wait_for(std::chrono::seconds(0))) ==
+              std::future_status::ready || messages.empty()))
+        {
+          message_lock.unlock();
+          finish_event(pending.front());
+          pending.pop_front();
+          message_lock.lock();
+        }
+
       // Get the next message
       if (messages.empty())
         {
@@ -198,6 +353,13 @@ void Client::file_master()
       messages.pop();
       message_lock.unlock();
 
+      // Keep track of what the server holds
+      if (msg.remote && msg.file_data.deleted)
+        remote->delete_file(msg.filename, msg.file_data.modified);
+      else if (msg.remote)
+        remote->modify_file(msg.filename, msg.file_data.size,
+                            msg.file_data.modified, msg.file_data.hash);
+
       // Is this event old?
       Metadata::Data data = meta->get_file(msg.filename);
       if (msg.file_data.deleted == data.deleted &&
@@ -209,72 +371,231 @@ void Client::file_master()
           continue;
         }
 
-      // Parse the event
-      std::string full_name = sync_dir + msg.filename;
+      // Commands on the same file must not overtake each other, so any
+      // still in flight for it are finished first
+      for (auto it = pending.rbegin(), end = pending.rend(); it != end; it++)
+        if (it->msg.filename == msg.filename)
+          {
+            size_t count = pending.rend() - it;
+            for (size_t i = 0; i < count; i++)
+              {
+                finish_event(pending.front());
+                pending.pop_front();
+              }
+            break;
+          }
+
+      start_event(msg, pending);
+
+      // Relock for the next message
+      message_lock.lock();
+   }
+  message_lock.unlock();
+
+  // The connection is closed so whatever is left fails straight away
+  while (!pending.empty())
+    {
+      finish_event(pending.front());
+      pending.pop_front();
+    }
+}
+
+void Client::start_event(const Msg & msg, std::deque<Pending> & pending)
+{
+  std::string full_name = sync_dir + msg.filename;
+
+  if (msg.remote && msg.file_data.deleted)
+    {
+      // The file is remotely changed so disable local events on it
+      wd.disregard(full_name);
+      global_log.message(std::string("Remote Delete: ") + full_name,
+                         Log::NOTICE);
+      File::recursive_remove(full_name);
+      wd.regard(full_name);
+      global_log.message(std::string("Finished Processing: ") + full_name,
+                         Log::NOTICE);
+      return;
+    }
+
+  Pending p;
+  p.msg = msg;
+  p.full_name = full_name;
+  try
+    {
       if (msg.remote)
         {
-          // The file is remotely changed so disable local events on it
+          // A local copy which already matches doesn't need pulling
+          if (!msg.file_data.hash.empty() &&
+              hash_file(full_name) == msg.file_data.hash)
+            {
+              global_log.message(std::string("Unchanged: ") + full_name,
+                                 Log::NOTICE);
+              return;
+            }
+
+          // Local events stay disabled until the file is written
           wd.disregard(full_name);
+          global_log.message(std::string("Remote Modify: ") + full_name,
+                             Log::NOTICE);
+
+          // The old copy lets the connector pull only what changed, and it
+          // stays in place until the new one is known to be good
+          p.temp_name = full_name + PULL_SUFFIX;
+          wd.disregard(p.temp_name);
+          struct stat stats;
+          bool exists = stat(full_name.c_str(), &stats) == 0;
+          std::shared_ptr<std::ifstream> basis;
+          if (exists && stats.st_size > 0)
+            {
+              basis = std::make_shared<std::ifstream>
+                (full_name, std::ios::in | std::ios::binary);
+              if (!*basis)
+                basis.reset();
+            }
 
-          if (msg.file_data.deleted)
+          auto out = std::make_shared<std::ofstream>
+            (p.temp_name, std::ios::out | std::ios::binary | std::ios::trunc);
+          if (!*out)
+            throw std::string("Failed to create ") + p.temp_name;
+          p.stream = out;
+          if (exists)
+            chmod(p.temp_name.c_str(), stats.st_mode);
+          if (basis)
             {
-              global_log.message(std::string("Remote Delete: ") + full_name,
-                                 Log::NOTICE);
-              File::recursive_remove(full_name);
+              p.basis = basis;
+              p.pulled = conn->get_file_async(msg.filename, *out, *basis);
             }
           else
+            p.pulled = conn->get_file_async(msg.filename, *out);
+        }
+      else if (msg.file_data.deleted)
+        {
+          global_log.message(std::string("Local Delete: ") + full_name,
+                             Log::NOTICE);
+          p.done = conn->delete_file_async(msg.filename,
+                                           msg.file_data.modified);
+        }
+      else
+        {
+          struct stat stats;
+          if (stat(full_name.c_str(), &stats) < 0)
+            throw std::string("Failed to stat ") + full_name;
+          p.msg.file_data.size = stats.st_size;
+          p.msg.file_data.modified = stats.st_mtime;
+          p.msg.file_data.hash = hash_file(full_name);
+
+          // The hash has to describe the version announced with the push,
+          // otherwise the server would keep it for other contents
+          struct stat after;
+          if (stat(full_name.c_str(), &after) < 0 ||
+              after.st_ino != stats.st_ino ||
+              after.st_size != stats.st_size ||
+              after.st_mtime != stats.st_mtime)
+            p.msg.file_data.hash.clear();
+
+          // Saving or touching a file without changing it costs nothing
+          if (same_contents(p.msg.file_data, remote->get_file(msg.filename)))
             {
-              global_log.message(std::string("Remote Modify: ") + full_name,
+              global_log.message(std::string("Unchanged: ") + full_name,
                                  Log::NOTICE);
-              std::ofstream out(full_name, std::ios::out | std::ios::binary);
-              conn->get_file(msg.filename, msg.file_data.modified, out);
-              out.close();
-
-              struct utimbuf tim;
-              tim.actime = time(NULL);
-              tim.modtime = msg.file_data.modified;
-              utime(full_name.c_str(), &tim);
+              return;
             }
 
-          // Allow events again
-          wd.regard(full_name);
+          global_log.message(std::string("Local Modify: ") + full_name,
+                             Log::NOTICE);
+          auto in = std::make_shared<std::ifstream>
+            (full_name, std::ios::in | std::ios::binary);
+          p.stream = in;
+          p.done = conn->push_file_async(msg.filename, stats.st_mtime,
+                                         *in, stats.st_size,
+                                         p.msg.file_data.hash);
+        }
+    }
+  catch (const char * e)
+    {
+      global_log.message(e, Log::WARNING);
+      discard(p);
+      return;
+    }
+  catch (const std::string & e)
+    {
+      global_log.message(e, Log::WARNING);
+      discard(p);
+      return;
+    }
+
+  pending.push_back(std::move(p));
+}
+
+void Client::finish_event(Pending & p)
+{
+  try
+    {
+      if (p.pulled.valid())
+        {
+          uint64_t modified = p.pulled.get();
+          std::ofstream & out = dynamic_cast<std::ofstream&>(*p.stream);
+          out.close();
+          if (!out)
+            throw std::string("Failed to write ") + p.temp_name;
+
+          struct utimbuf tim;
+          tim.actime = time(NULL);
+          tim.modtime = modified;
+          utime(p.temp_name.c_str(), &tim);
+
+          // Only a complete and verified copy replaces the old one
+          if (rename(p.temp_name.c_str(), p.full_name.c_str()) < 0)
+            throw std::string("Failed to replace ") + p.full_name;
+          wd.regard(p.temp_name);
+          p.temp_name.clear();
         }
       else
-        if (msg.file_data.deleted)
-          {
-            global_log.message(std::string("Local Delete: ") + full_name,
-                               Log::NOTICE);
-            conn->delete_file(msg.filename, msg.file_data.modified);
-          }
-        else
-          {
-            global_log.message(std::string("Local Modify: ") + full_name,
-                               Log::NOTICE);
-            std::ifstream in(full_name, std::ios::in | std::ios::binary);
-            struct stat stats;
-            stat(full_name.c_str(), &stats);
-            try
-              {
-                conn->push_file(msg.filename, stats.st_mtime,
-                                in, stats.st_size);
-              }
-            catch (const char * e)
-              {
-                global_log.message(e, Log::WARNING);
-              }
-            catch (const std::string & e)
-              {
-                global_log.message(e, Log::WARNING);
-              }
-            in.close();
-          }
-      global_log.message(std::string("Finished Processing: ") + full_name,
-                         Log::NOTICE);
+        {
+          p.done.get();
 
-      // Relock for the next message
-      message_lock.lock();
-   }
-  message_lock.unlock();
+          // The server now holds our copy, unless it told us about a newer
+          // one in the meantime
+          const Metadata::Data & data = p.msg.file_data;
+          if (remote->get_file(p.msg.filename).modified <= data.modified)
+            {
+              if (data.deleted)
+                remote->delete_file(p.msg.filename, data.modified);
+              else
+                remote->modify_file(p.msg.filename, data.size, data.modified,
+                                    data.hash);
+            }
+        }
+    }
+  catch (const char * e)
+    {
+      global_log.message(e, Log::WARNING);
+    }
+  catch (const std::string & e)
+    {
+      global_log.message(e, Log::WARNING);
+    }
+  discard(p);
+  global_log.message(std::string("Finished Processing: ") + p.full_name,
+                     Log::NOTICE);
+}
+
+void Client::discard(Pending & p)
+{
+  p.stream.reset();
+  p.basis.reset();
+
+  // A pull which didn't finish leaves the old copy as it was
+  if (!p.temp_name.empty())
+    {
+      unlink(p.temp_name.c_str());
+      wd.regard(p.temp_name);
+      p.temp_name.clear();
+    }
+
+  // Allow events again
+  if (p.msg.remote)
+    wd.regard(p.full_name);
 }
 
 void Client::pull_master()
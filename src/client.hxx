@@ -27,12 +27,17 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <future>
+#include <memory>
+#include <ios>
 
 #include "connector_sock.hxx"
 #include "watchdog.hxx"
 #include "metadata.hxx"
 #include "config.hxx"
 #include "connector.hxx"
+#include "hasher.hxx"
 
 class Client
 {
@@ -55,12 +60,37 @@ private:
     Metadata::Data file_data;
   };
 
+  // A command sent to the server which hasn't finished yet, along with the
+  // file stream it reads from or writes to and the old copy of a pull. A
+  // pull writes to the scratch file until it has succeeded
+  struct Pending
+  {
+    Msg msg;
+    std::string full_name, temp_name;
+    std::shared_ptr<std::ios> stream, basis;
+    std::future<void> done;
+    std::future<uint64_t> pulled;
+  };
+
   bool done;
   std::string sync_dir;
   Config conf;
   Connector *conn;
   Crypt *crypt;
   Metadata *meta;
+
+  // What the server holds as far as we know, only used on the file thread
+  // once it has started. It is kept between runs along with the cursor it
+  // is up to date with, so only what changed since is fetched
+  Metadata *remote;
+  std::string remote_cache;
+  uint64_t remote_epoch, remote_seq;
+
+  // The hashes of the local files, and the key they are made with so the
+  // server can't match them against the contents of known files
+  HashCache *hashes;
+  std::string hash_key;
+  size_t hash_threads;
   Watchdog wd;
   std::queue<Msg> messages;
   std::mutex message_lock;
@@ -74,7 +104,57 @@ private:
    */
   void merge_metadata(const Metadata & remote);
 
+  /**
+   * Brings the copy of the remote metadata up to date, loading the one
+   * kept from the last run and fetching the changes since
+   */
+  void fetch_remote();
+
+  /**
+   * Keeps the copy of the remote metadata for the next run
+   */
+  void save_remote();
+
+  /**
+   * Fills in the hashes of the local files, hashing those which changed
+   * since they were last hashed in parallel
+   */
+  void hash_metadata();
+
+  /**
+   * @param full_name The local file
+   * @return The hash of the file as the server knows it, or an empty string
+   *         if it can't be read
+   */
+  std::string hash_file(const std::string & full_name);
+
+  /**
+   * Checks whether two copies of a file are known to hold the same contents
+   */
+  static bool same_contents(const Metadata::Data & a, const Metadata::Data & b);
+
   void file_master();
+
+  /**
+   * Sends the command for a file event, local deletes are done straight
+   * away and the rest are queued on the pending list
+   * @param msg The file event
+   * @param pending The commands in flight, in the order they were sent
+   */
+  void start_event(const Msg & msg, std::deque<Pending> & pending);
+
+  /**
+   * Waits for a command to finish and completes the file event
+   * @param p The finished command
+   */
+  void finish_event(Pending & p);
+
+  /**
+   * Lets go of the files of a command, removing the scratch file of a pull
+   * which didn't finish, and lets events on them through again
+   * @param p The command
+   */
+  void discard(Pending & p);
   void pull_master();
   void watch_master();
 };
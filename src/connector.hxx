@@ -25,6 +25,7 @@
 #include <string>
 #include <istream>
 #include <fstream>
+#include <future>
 #include "metadata.hxx"
 
 class Connector
@@ -33,6 +34,19 @@ public:
   virtual ~Connector() {}
   virtual void close() = 0;
   virtual Metadata * get_metadata() = 0;
+
+  /**
+   * Brings a copy of the metadata up to date, fetching only what changed
+   * since the cursor it is up to date with. When those changes are no
+   * longer known the copy is compared with the server's from the root of
+   * the tree down, and only without a copy is all of it fetched
+   * @param mtd The copy, or NULL if there isn't one
+   * @param epoch The epoch of the cursor, replaced with the new one
+   * @param seq The last change seen, replaced with the newest one
+   * @return The copy brought up to date, or a new one to replace it with
+   */
+  virtual Metadata * get_metadata(Metadata * mtd, uint64_t & epoch,
+                                  uint64_t & seq) = 0;
   virtual void push_file(const std::string & filename, uint64_t modified,
                  std::istream & data, size_t data_size) = 0;
   virtual void get_file(const std::string & filename, uint64_t & modified,
@@ -40,6 +54,34 @@ public:
   virtual void delete_file(const std::string & filename,
                            uint64_t modified) = 0;
   virtual std::pair<std::string, Metadata::Data> wait() = 0;
+
+  /**
+   * The asynchronous operations return as soon as the request is sent so
+   * many can be in flight at once, the streams must stay valid until the
+   * future is ready and errors are thrown from the future. A push may be
+   * given the hash of the contents, which lets the server skip it when its
+   * copy already holds them
+   */
+  virtual std::future<void> push_file_async(const std::string & filename,
+                                            uint64_t modified,
+                                            std::istream & data,
+                                            size_t data_size,
+                                            const std::string & hash =
+                                            std::string()) = 0;
+  virtual std::future<uint64_t> get_file_async(const std::string & filename,
+                                               std::ostream & data) = 0;
+
+  /**
+   * Pulls a file into data given the copy it replaces, which the connector
+   * may use so only the parts which changed are sent
+   * @param basis The old copy, which must stay valid until the future is
+   *              ready and can't be the same file as data
+   */
+  virtual std::future<uint64_t> get_file_async(const std::string & filename,
+                                               std::ostream & data,
+                                               std::istream & basis) = 0;
+  virtual std::future<void> delete_file_async(const std::string & filename,
+                                              uint64_t modified) = 0;
 };
 
 #endif
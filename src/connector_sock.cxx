@@ -19,13 +19,43 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <sstream>
+#include <thread>
+#include <unordered_set>
+
 #include "connector_sock.hxx"
+#include "chunks.hxx"
+#include "delta.hxx"
 #include "util.hxx"
 #include "log.hxx"
 
 #define HAND_LOGIN 0
 #define HAND_REG 1
+#define HAND_EXT 0x80
+
+// Set on the command along with HAND_EXT when a second byte of features
+// follows the first, servers which read it answer with a second byte too
+#define HAND_MORE 0x40
+
+// Sent with the NetMsg features, servers which understand the inline push
+// and pull commands echo it back
+#define HAND_INLINE 0x80
+
+// Sent alongside, servers which send and apply deltas echo it back
+#define HAND_DELTA 0x40
+
+// Sent alongside, servers which take files as lists of chunks echo it back
+#define HAND_CHUNKS 0x20
+
+// Sent alongside, servers which keep the hashes of files echo it back
+#define HAND_HASHES 0x10
+
+// Sent in the second byte, servers which keep a journal of the changes
+// echo it back
+#define HAND_JOURNAL 0x01
+
+// Sent in the second byte, servers which compare their tree with a copy of
+// the metadata echo it back
+#define HAND_TREE 0x02
 
 #define REG_EXISTS 1
 #define REG_CLOSED 2
@@ -37,14 +67,46 @@
 #define CMD_PUSH 2
 #define CMD_PULL 3
 #define CMD_DEL 4
+#define CMD_PUSH_INLINE 5
+#define CMD_PULL_INLINE 6
+#define CMD_SIG 7
+#define CMD_PUSH_DELTA 8
+#define CMD_PULL_DELTA 9
+#define CMD_PUSH_CHUNKS 10
+#define CMD_META_SINCE 11
+#define CMD_TREE 12
+
+// An inline pull of a large file is answered like CMD_PULL, the body only
+// follows once it is acknowledged
+#define PULL_STREAM 2
+
+// Largest body pushed in the same message as its header
+#define INLINE_MAX 65536
+
+// Answer to a delta push when the server's copy changed since it was signed
+#define DELTA_STALE 3
 
-#define BUFF 2048
+// Answer to a request for the metadata since a cursor which is too old, the
+// copy is compared with the server's tree instead
+#define META_TREE 2
+
+// Most directories listed in one request while comparing trees
+#define TREE_BATCH 1024
+
+// Smallest file sent as a delta, below this the extra round trips for the
+// signature cost more than the blocks they save
+#define DELTA_MIN 262144
+
+// Commands kept in flight at once unless the window is set
+#define WINDOW 16
 
 SockConnector::SockConnector(const std::string & host, uint16_t port,
                              const std::string & user, const std::string & pass,
                              bool reg)
   : closed(false), client(host, port), user(user), pass(pass),
-  net(NULL), netmsg(NULL), crypt(NULL)
+  net(NULL), netmsg(NULL), crypt(NULL), inline_cmds(false), delta_cmds(false),
+  chunk_cmds(false), hash_cmds(false), journal_cmds(false), tree_cmds(false),
+  window(WINDOW), in_flight(0), workers(0)
 {
   connect(reg);
 }
@@ -54,7 +116,21 @@ SockConnector::SockConnector(const std::string & host, uint16_t port,
                              const std::string & key,
                              bool reg)
   : closed(false), client(host, port), user(user), pass(pass),
-    net(NULL), netmsg(NULL), crypt(new Crypt(key))
+    net(NULL), netmsg(NULL), crypt(new Crypt(key)), inline_cmds(false),
+    delta_cmds(false), chunk_cmds(false), hash_cmds(false),
+    journal_cmds(false), tree_cmds(false), window(WINDOW), in_flight(0),
+    workers(0)
+{
+  connect(reg);
+}
+
+SockConnector::SockConnector(Net * net, const std::string & user,
+                             const std::string & pass, bool reg)
+  : closed(false), client(std::string(), 0), user(user), pass(pass),
+    net(net), netmsg(NULL), crypt(NULL), inline_cmds(false),
+    delta_cmds(false), chunk_cmds(false), hash_cmds(false),
+    journal_cmds(false), tree_cmds(false), window(WINDOW), in_flight(0),
+    workers(0)
 {
   connect(reg);
 }
@@ -62,10 +138,54 @@ SockConnector::SockConnector(const std::string & host, uint16_t port,
 SockConnector::~SockConnector()
 {
   close();
+
+  // Threads making deltas and lists of chunks still use the connection
+  std::unique_lock<std::mutex> lock(window_lock);
+  while (workers > 0)
+    window_cond.wait(lock);
+  lock.unlock();
+
   delete netmsg;
   delete net;
 }
 
+void SockConnector::set_window(size_t window)
+{
+  window_lock.lock();
+  this->window = window > 0 ? window : 1;
+  window_lock.unlock();
+  window_cond.notify_all();
+}
+
+/**
+ * Checks a pulled body once all of it has been written out
+ * @param dec The decrypting writer if the body is encrypted, or NULL
+ * @param out The stream the body was written to
+ */
+static void written(CryptWriter * dec, std::ostream * out)
+{
+  if (dec != NULL)
+    dec->finish();
+  else if (!*out)
+    throw "Failed to write file";
+}
+
+std::shared_ptr<SockConnector> SockConnector::hold()
+{
+  std::unique_lock<std::mutex> lock(window_lock);
+  while (in_flight >= window)
+    window_cond.wait(lock);
+  in_flight++;
+
+  return std::shared_ptr<SockConnector>(this, [](SockConnector * conn)
+    {
+      conn->window_lock.lock();
+      conn->in_flight--;
+      conn->window_lock.unlock();
+      conn->window_cond.notify_one();
+    });
+}
+
 void SockConnector::close()
 {
   if (!closed)
@@ -94,120 +214,728 @@ Metadata * SockConnector::get_metadata()
   return ret;
 }
 
-void SockConnector::push_file(const std::string & filename, uint64_t modified,
-                              std::istream & data, size_t data_size)
+Metadata * SockConnector::get_metadata(Metadata * mtd, uint64_t & epoch,
+                                       uint64_t & seq)
 {
-  // Send the command info
+  if (!journal_cmds)
+    {
+      epoch = seq = 0;
+      return get_metadata();
+    }
+
+  // Ask for the changes after the cursor, or for the root of the tree if
+  // there is a copy to compare with
   std::string cmd;
+  Write::i8(CMD_META_SINCE, cmd);
+  Write::i64(epoch, cmd);
+  Write::i64(seq, cmd);
+  Write::i8(mtd != NULL && tree_cmds, cmd);
+  Message *msg = netmsg->send_and_wait(cmd);
+  std::string reply = msg->get();
+  netmsg->destroy(msg);
 
-  Write::i8(CMD_PUSH, cmd);
-  Write::i64(modified, cmd);
-  Write::i32(filename.length(), cmd);
-  cmd.append(filename);
+  uint8_t *data = (uint8_t*)reply.data();
+  size_t data_len = reply.length();
+  uint8_t status = Read::i8(data, data_len);
+  epoch = Read::i64(data, data_len);
+  seq = Read::i64(data, data_len);
+  if (status == META_TREE && mtd != NULL)
+    {
+      size_t root_len = Read::i8(data, data_len);
+      if (data_len < root_len)
+        throw "Invalid tree digest";
+      reconcile(*mtd, std::string((char*)data, root_len));
+      return mtd;
+    }
 
-  Message * msg = netmsg->send_and_wait(cmd);
-  uint8_t *ret = (uint8_t*)msg->get().data();
-  size_t ret_len = msg->get().length();
-  if (Read::i8(ret, ret_len) != 0)
+  Metadata *changes = new Metadata(data, data_len);
+  if (status != 0 || mtd == NULL)
+    return changes;
+  for (auto it = changes->begin(), end = changes->end(); it != end; it++)
+    mtd->set_file(it->first, it->second);
+  delete changes;
+  return mtd;
+}
+
+void SockConnector::reconcile(Metadata & mtd, const std::string & root)
+{
+  std::vector<std::string> level;
+  if (mtd.digest("/") != root)
+    level.push_back("/");
+
+  size_t listed = 0;
+  while (!level.empty())
     {
-      netmsg->destroy(msg);
-      global_log.message(std::string("Server Skipped: ") + filename,
-                         Log::NOTICE);
-      return;
+      std::vector<std::string> next;
+      for (size_t start = 0; start < level.size(); start += TREE_BATCH)
+        {
+          size_t count = level.size() - start;
+          if (count > TREE_BATCH)
+            count = TREE_BATCH;
+          std::string cmd;
+          Write::i8(CMD_TREE, cmd);
+          Write::i32(count, cmd);
+          for (size_t i = start; i < start + count; i++)
+            {
+              Write::i32(level[i].length(), cmd);
+              cmd.append(level[i]);
+            }
+          Message *msg = netmsg->send_and_wait(cmd);
+          std::string reply = msg->get();
+          netmsg->destroy(msg);
+
+          uint8_t *data = (uint8_t*)reply.data();
+          size_t data_len = reply.length();
+          for (size_t i = start; i < start + count; i++)
+            {
+              const std::string & dir = level[i];
+              std::unordered_set<std::string> names;
+              for (uint32_t n = Read::i32(data, data_len); n > 0; n--)
+                {
+                  size_t name_len = Read::i32(data, data_len);
+                  if (data_len < name_len)
+                    throw "Invalid tree listing";
+                  std::string name((char*)data, name_len);
+                  data += name_len;
+                  data_len -= name_len;
+                  bool is_dir = Read::i8(data, data_len);
+                  size_t digest_len = Read::i8(data, data_len);
+                  if (data_len < digest_len)
+                    throw "Invalid tree listing";
+                  std::string digest((char*)data, digest_len);
+                  data += digest_len;
+                  data_len -= digest_len;
+
+                  std::string path = Metadata::join(dir, name);
+                  names.insert(name);
+                  if (is_dir)
+                    {
+                      // Only directories which differ are looked into
+                      if (mtd.digest(path) != digest)
+                        next.push_back(path);
+                      continue;
+                    }
+
+                  Metadata::Data fd;
+                  fd.modified = Read::i64(data, data_len);
+                  fd.deleted = Read::i8(data, data_len);
+                  fd.size = Read::i64(data, data_len);
+                  size_t hash_len = Read::i8(data, data_len);
+                  if (data_len < hash_len)
+                    throw "Invalid tree listing";
+                  fd.hash.assign((char*)data, hash_len);
+                  data += hash_len;
+                  data_len -= hash_len;
+                  mtd.set_file(path, fd);
+                }
+              listed++;
+
+              // What the server doesn't list isn't there
+              std::vector<Metadata::Child> ours = mtd.children(dir);
+              for (auto it = ours.begin(), end = ours.end(); it != end; it++)
+                if (names.count(it->name) == 0)
+                  mtd.erase(Metadata::join(dir, it->name));
+            }
+        }
+      level.swap(next);
     }
 
-  // Buffer the contents in memory
-  int64_t red;
-  char buff[BUFF];
-  std::stringstream ss;
-  std::cout << "Started Buffering" << std::endl;
-  if (crypt == NULL)
-    while((red = data.readsome(buff, BUFF)) > 0)
-      ss.write(buff, red);
-  else
+  global_log.message(std::string("Compared ") + std::to_string(listed) +
+                     " directories with the server", Log::NOTICE);
+}
+
+void SockConnector::push_file(const std::string & filename, uint64_t modified,
+                              std::istream & data, size_t data_size)
+{
+  push_file_async(filename, modified, data, data_size).get();
+}
+
+void SockConnector::get_file(const std::string & filename, uint64_t & modified,
+                             std::ostream & data)
+{
+  modified = get_file_async(filename, data).get();
+}
+
+void SockConnector::delete_file(const std::string & filename,
+                                uint64_t modified)
+{
+  delete_file_async(filename, modified).get();
+}
+
+std::future<void> SockConnector::push_file_async(const std::string & filename,
+                                                 uint64_t modified,
+                                                 std::istream & data,
+                                                 size_t data_size,
+                                                 const std::string & hash)
+{
+  auto push = std::make_shared<Push>();
+  push->filename = filename;
+  push->hash = hash;
+  push->modified = modified;
+  push->data = &data;
+  push->start = data.tellg();
+  push->size = data_size;
+  push->slot = hold();
+  std::future<void> pushed = push->done.get_future();
+
+  // Large files go as a delta against the server's copy, or without one
+  // as chunks which the server may already hold in other files. Every
+  // encryption of a file is different, so only plaintext has data to share
+  if ((delta_cmds || chunk_cmds) && crypt == NULL && data_size >= DELTA_MIN)
     {
-      // Write all of the data into the crypto stream
-      data_size = crypt->enc_len(data_size) + crypt->hash_len();
-      CryptStream *cs = crypt->ecstream();
-      while ((red = data.readsome(buff, BUFF)) > 0)
-          cs->write(buff, red);
-
-      // Write the encrypted data to the buffer
-      cs->write(NULL, 0);
-      while((red = cs->read(buff, BUFF)) > 0)
-        ss.write(buff, red);
-
-      delete cs;
+      if (delta_cmds)
+        push_delta(push);
+      else
+        push_chunks(push);
     }
+  else
+    push_whole(push);
 
-  std::cout << "Finished Buffering: " << ss.tellp()-ss.tellg() << std::endl;
+  return pushed;
+}
 
-  // Send the file contents
-  msg = netmsg->reply_and_wait(msg, &ss, data_size);
-  ret = (uint8_t*)msg->get().data();
-  ret_len = msg->get().length();
-  if (Read::i8(ret, ret_len) != 0)
+void SockConnector::push_whole(const std::shared_ptr<Push> & push)
+{
+  try
     {
-      netmsg->destroy(msg);
-      throw "Failed to push file";
+      std::shared_ptr<std::istream> ss;
+      std::istream *in = push->data;
+      size_t data_size = push->size;
+      in->clear();
+      in->seekg(push->start);
+
+      // Encrypted contents are encrypted as the writer reads them, so the
+      // file is never held in memory and starts going out straight away
+      if (crypt != NULL)
+        {
+          ss = std::make_shared<CryptReader>(crypt->ecstream(), *in,
+                                             data_size);
+          in = ss.get();
+          data_size = crypt->enc_len(data_size) + crypt->hash_len();
+        }
+
+      // Small files go in the same message as their header, the server only
+      // applies them if its copy is no newer so the push takes one round
+      // trip
+      if (inline_cmds && data_size <= INLINE_MAX)
+        {
+          std::string cmd;
+          Write::i8(CMD_PUSH_INLINE, cmd);
+          Write::i64(push->modified, cmd);
+          Write::i32(push->filename.length(), cmd);
+          cmd.append(push->filename);
+          write_hash(push->hash, cmd);
+          size_t head = cmd.length();
+          cmd.resize(head + data_size);
+          in->read(&cmd[head], data_size);
+          if ((size_t)in->gcount() != data_size)
+            throw "Failed to read file";
+
+          netmsg->send_async(cmd, [this, push](Message * msg)
+            {
+              try
+                {
+                  if (msg == NULL)
+                    throw "Connection closed";
+
+                  uint8_t *ret = (uint8_t*)msg->get().data();
+                  size_t ret_len = msg->get().length();
+                  uint8_t status = Read::i8(ret, ret_len);
+                  netmsg->destroy(msg);
+                  if (status == 1)
+                    global_log.message(std::string("Server Skipped: ") +
+                                       push->filename, Log::NOTICE);
+                  else if (status != 0)
+                    throw "Failed to push file";
+                  push->done.set_value();
+                }
+              catch(...)
+                {
+                  push->done.set_exception(std::current_exception());
+                }
+            });
+          return;
+        }
+
+      // Send the command info
+      std::string cmd;
+      Write::i8(CMD_PUSH, cmd);
+      Write::i64(push->modified, cmd);
+      Write::i32(push->filename.length(), cmd);
+      cmd.append(push->filename);
+      write_hash(push->hash, cmd);
+      Write::i64(data_size, cmd);
+
+      netmsg->send_async(cmd, [this, push, ss, in, data_size](Message * msg)
+        {
+          try
+            {
+              if (msg == NULL)
+                throw "Connection closed";
+
+              uint8_t *ret = (uint8_t*)msg->get().data();
+              size_t ret_len = msg->get().length();
+              if (Read::i8(ret, ret_len) != 0)
+                {
+                  netmsg->destroy(msg);
+                  global_log.message(std::string("Server Skipped: ") +
+                                     push->filename, Log::NOTICE);
+                  push->done.set_value();
+                  return;
+                }
+
+              // Send the file contents
+              netmsg->reply_async(msg, in, data_size, pushed(push, ss));
+            }
+          catch(...)
+            {
+              push->done.set_exception(std::current_exception());
+            }
+        });
+    }
+  catch(...)
+    {
+      push->done.set_exception(std::current_exception());
     }
-  netmsg->destroy(msg);
 }
 
-void SockConnector::get_file(const std::string & filename, uint64_t & modified,
-                             std::ostream & data)
+std::future<uint64_t> SockConnector::get_file_async(const std::string &
+                                                    filename,
+                                                    std::ostream & data)
 {
+  auto done = std::make_shared< std::promise<uint64_t> >();
+  auto slot = hold();
+  std::shared_ptr<CryptWriter> dec;
+  std::ostream *out = &data;
+
+  // The body is decrypted and written out as it arrives, so the download
+  // never sits in memory and the disk works alongside the network
+  if (crypt != NULL)
+    {
+      dec = std::make_shared<CryptWriter>(crypt->dcstream(), data);
+      out = dec.get();
+    }
+
   // Send the command info
   std::string cmd;
-  Write::i8(CMD_PULL, cmd);
+  Write::i8(inline_cmds ? CMD_PULL_INLINE : CMD_PULL, cmd);
   Write::i32(filename.length(), cmd);
   cmd.append(filename);
 
-  Message *msg = netmsg->send_and_wait(cmd);
-  uint8_t *ret = (uint8_t*)msg->get().data();
-  size_t ret_len = msg->get().length();
-  if (Read::i8(ret, ret_len) != 0)
+  netmsg->send_async(cmd, [this, done, slot, dec, out](Message * msg)
+    {
+      try
+        {
+          if (msg == NULL)
+            throw "Connection closed";
+
+          uint8_t *ret = (uint8_t*)msg->get().data();
+          size_t ret_len = msg->get().length();
+          uint8_t status = Read::i8(ret, ret_len);
+          if (status != 0 && status != PULL_STREAM)
+            {
+              netmsg->destroy(msg);
+              throw "Failed to retrieve file";
+            }
+
+          // Get the modification time
+          uint64_t modified = Read::i64(ret, ret_len);
+
+          // Small files come back in the reply to an inline pull
+          if (inline_cmds && status == 0)
+            {
+              out->write((char*)ret, ret_len);
+              netmsg->destroy(msg);
+              written(dec.get(), out);
+              done->set_value(modified);
+              return;
+            }
+
+          // Get the file contents
+          std::string cmd;
+          Write::i8(0, cmd);
+          msg->set(cmd);
+          netmsg->reply_async(msg, out, [this, done, slot, dec, out,
+                                         modified](Message * msg)
+            {
+              try
+                {
+                  if (msg == NULL)
+                    throw "Connection closed";
+
+                  std::string cmd;
+                  Write::i8(0, cmd);
+                  msg->set(cmd);
+                  netmsg->reply_only(msg);
+
+                  // The whole body has been written, so it can be checked
+                  written(dec.get(), out);
+                  done->set_value(modified);
+                }
+              catch(...)
+                {
+                  done->set_exception(std::current_exception());
+                }
+            });
+        }
+      catch(...)
+        {
+          done->set_exception(std::current_exception());
+        }
+    });
+
+  return done->get_future();
+}
+
+std::future<uint64_t> SockConnector::get_file_async(const std::string &
+                                                    filename,
+                                                    std::ostream & data,
+                                                    std::istream & basis)
+{
+  basis.seekg(0, std::ios::end);
+  std::streamoff len = basis.tellg();
+  basis.clear();
+  basis.seekg(0);
+  if (!delta_cmds || crypt != NULL || len < DELTA_MIN)
+    return get_file_async(filename, data);
+
+  // The server answers with a delta against the signature of our copy
+  std::string cmd;
+  Write::i8(CMD_PULL_DELTA, cmd);
+  Write::i32(filename.length(), cmd);
+  cmd.append(filename);
+  cmd.append(Delta::signature(basis, len));
+
+  auto done = std::make_shared< std::promise<uint64_t> >();
+  auto slot = hold();
+  auto patch = std::make_shared<DeltaWriter>(basis, data);
+
+  netmsg->send_async(cmd, [this, done, slot, patch](Message * msg)
+    {
+      try
+        {
+          if (msg == NULL)
+            throw "Connection closed";
+
+          uint8_t *ret = (uint8_t*)msg->get().data();
+          size_t ret_len = msg->get().length();
+          if (Read::i8(ret, ret_len) != 0)
+            {
+              netmsg->destroy(msg);
+              throw "Failed to retrieve file";
+            }
+          uint64_t modified = Read::i64(ret, ret_len);
+
+          // The file is rebuilt as the delta arrives
+          std::string cmd;
+          Write::i8(0, cmd);
+          msg->set(cmd);
+          netmsg->reply_async(msg, patch.get(), [this, done, slot, patch,
+                                                 modified](Message * msg)
+            {
+              try
+                {
+                  if (msg == NULL)
+                    throw "Connection closed";
+
+                  std::string cmd;
+                  Write::i8(0, cmd);
+                  msg->set(cmd);
+                  netmsg->reply_only(msg);
+
+                  patch->finish();
+                  done->set_value(modified);
+                }
+              catch(...)
+                {
+                  done->set_exception(std::current_exception());
+                }
+            });
+        }
+      catch(...)
+        {
+          done->set_exception(std::current_exception());
+        }
+    });
+
+  return done->get_future();
+}
+
+void SockConnector::push_delta(const std::shared_ptr<Push> & push)
+{
+  // Get the signature of the server's copy
+  std::string cmd;
+  Write::i8(CMD_SIG, cmd);
+  Write::i32(push->filename.length(), cmd);
+  cmd.append(push->filename);
+
+  netmsg->send_async(cmd, [this, push](Message * msg)
+    {
+      try
+        {
+          if (msg == NULL)
+            throw "Connection closed";
+
+          // Without a copy on the server there is nothing to make the delta
+          // against
+          uint8_t *ret = (uint8_t*)msg->get().data();
+          size_t ret_len = msg->get().length();
+          if (Read::i8(ret, ret_len) != 0)
+            {
+              netmsg->destroy(msg);
+              if (chunk_cmds)
+                push_chunks(push);
+              else
+                push_whole(push);
+              return;
+            }
+          uint64_t basis = Read::i64(ret, ret_len);
+          std::string sig((char*)ret, ret_len);
+          netmsg->destroy(msg);
+
+          // Making the delta reads the whole file, which would hold up the
+          // replies to every other command if it were done here
+          window_lock.lock();
+          workers++;
+          window_lock.unlock();
+          std::thread(&SockConnector::send_delta, this, push, basis,
+                      std::move(sig)).detach();
+        }
+      catch(...)
+        {
+          push->done.set_exception(std::current_exception());
+        }
+    });
+}
+
+void SockConnector::send_delta(std::shared_ptr<Push> push, uint64_t basis,
+                               std::string sig)
+{
+  try
+    {
+      // The delta is made up front since its length goes ahead of it
+      auto delta = std::make_shared<std::fstream>();
+      File::temp(*delta);
+      push->data->clear();
+      push->data->seekg(push->start);
+      uint64_t len = Delta::encode(sig, *push->data, *delta);
+      delta->seekg(0);
+
+      std::string cmd;
+      Write::i8(CMD_PUSH_DELTA, cmd);
+      Write::i64(push->modified, cmd);
+      Write::i64(basis, cmd);
+      Write::i32(push->filename.length(), cmd);
+      cmd.append(push->filename);
+      write_hash(push->hash, cmd);
+
+      netmsg->send_async(cmd, [this, push, delta, len](Message * msg)
+        {
+          try
+            {
+              if (msg == NULL)
+                throw "Connection closed";
+
+              uint8_t *ret = (uint8_t*)msg->get().data();
+              size_t ret_len = msg->get().length();
+              uint8_t status = Read::i8(ret, ret_len);
+
+              // The server's copy changed since it was signed
+              if (status == DELTA_STALE)
+                {
+                  netmsg->destroy(msg);
+                  if (chunk_cmds)
+                    push_chunks(push);
+                  else
+                    push_whole(push);
+                  return;
+                }
+              if (status != 0)
+                {
+                  netmsg->destroy(msg);
+                  global_log.message(std::string("Server Skipped: ") +
+                                     push->filename, Log::NOTICE);
+                  push->done.set_value();
+                  return;
+                }
+
+              // Send the delta
+              netmsg->reply_async(msg, delta.get(), len, pushed(push, delta));
+            }
+          catch(...)
+            {
+              push->done.set_exception(std::current_exception());
+            }
+        });
+    }
+  catch(...)
     {
-      netmsg->destroy(msg);
-      throw "Failed to retrieve file";
+      push->done.set_exception(std::current_exception());
     }
 
-  // Get the modification time
-  modified = Read::i64(ret, ret_len);
+  // Let go of the push first, its hold on the window uses the connector
+  // which may be gone once the count drops
+  push.reset();
+  window_lock.lock();
+  workers--;
+  window_lock.unlock();
+  window_cond.notify_all();
+}
 
-  // Get the file contents
-  std::stringstream ss;
-  cmd.clear();
-  Write::i8(0, cmd);
-  msg->set(cmd);
-  netmsg->reply_and_wait(msg, &ss);
-  msg->set(cmd);
-  netmsg->reply_only(msg);
+void SockConnector::push_chunks(const std::shared_ptr<Push> & push)
+{
+  // Splitting reads the whole file, so it is done off the caller and the
+  // listener alike
+  window_lock.lock();
+  workers++;
+  window_lock.unlock();
+  std::thread(&SockConnector::send_chunks, this, push).detach();
+}
 
-  // Buffer the contents in memory
-  int64_t red;
-  char buff[BUFF];
-  if (crypt == NULL)
-    while((red = ss.readsome(buff, BUFF)) > 0)
-      data.write(buff, red);
-  else
+void SockConnector::send_chunks(std::shared_ptr<Push> push)
+{
+  try
     {
-      // Write the file into the crypto stream
-      CryptStream *cs = crypt->dcstream();
-      while ((red = ss.readsome(buff, BUFF)) > 0)
-        cs->write(buff, red);
-      cs->write(NULL, 0);
-
-      // Write the decrypted file
-      while((red = cs->read(buff, BUFF)) > 0)
-        data.write(buff, red);
-      delete cs;
+      push->data->clear();
+      push->data->seekg(push->start);
+      auto chunks = std::make_shared< std::vector<Chunker::Chunk> >
+        (Chunker::split(*push->data));
+
+      // Send the list of chunks
+      std::string cmd;
+      Write::i8(CMD_PUSH_CHUNKS, cmd);
+      Write::i64(push->modified, cmd);
+      Write::i32(push->filename.length(), cmd);
+      cmd.append(push->filename);
+      write_hash(push->hash, cmd);
+      Write::i32(chunks->size(), cmd);
+      for (auto it = chunks->begin(), end = chunks->end(); it != end; it++)
+        {
+          Write::i32(it->length, cmd);
+          cmd.append(it->hash);
+        }
+
+      netmsg->send_async(cmd, [this, push, chunks](Message * msg)
+        {
+          try
+            {
+              if (msg == NULL)
+                throw "Connection closed";
+
+              uint8_t *ret = (uint8_t*)msg->get().data();
+              size_t ret_len = msg->get().length();
+              if (Read::i8(ret, ret_len) != 0)
+                {
+                  netmsg->destroy(msg);
+                  global_log.message(std::string("Server Skipped: ") +
+                                     push->filename, Log::NOTICE);
+                  push->done.set_value();
+                  return;
+                }
+
+              // The chunks the server lacks are read from the file in the
+              // order it asked for them as they are sent
+              std::vector<Chunker::Chunk> wanted;
+              uint64_t len = 0;
+              try
+                {
+                  for (uint64_t n = Read::var(ret, ret_len); n > 0; n--)
+                    {
+                      uint64_t index = Read::var(ret, ret_len);
+                      if (index >= chunks->size())
+                        throw "Server asked for a chunk which doesn't exist";
+                      wanted.push_back((*chunks)[index]);
+                      len += wanted.back().length;
+                    }
+                }
+              catch(...)
+                {
+                  // The server is still waiting on the chunks, an empty
+                  // body makes it give up on the push
+                  msg->set(std::string());
+                  netmsg->reply_async(msg, [this](Message * msg)
+                    {
+                      if (msg != NULL)
+                        netmsg->destroy(msg);
+                    });
+                  throw;
+                }
+
+              if (len > 0)
+                {
+                  auto body = std::make_shared<ChunkReader>(*push->data,
+                                                            push->start,
+                                                            wanted);
+                  netmsg->reply_async(msg, body.get(), len,
+                                      pushed(push, body));
+                }
+              else
+                {
+                  msg->set(std::string());
+                  netmsg->reply_async(msg, pushed(push, NULL));
+                }
+            }
+          catch(...)
+            {
+              push->done.set_exception(std::current_exception());
+            }
+        });
     }
+  catch(...)
+    {
+      push->done.set_exception(std::current_exception());
+    }
+
+  // Let go of the push first, its hold on the window uses the connector
+  // which may be gone once the count drops
+  push.reset();
+  window_lock.lock();
+  workers--;
+  window_lock.unlock();
+  window_cond.notify_all();
 }
 
-void SockConnector::delete_file(const std::string & filename,
-                                uint64_t modified)
+NetMsg::Callback SockConnector::pushed(const std::shared_ptr<Push> & push,
+                                       const std::shared_ptr<std::istream> &
+                                       body)
 {
+  return [this, push, body](Message * msg)
+    {
+      try
+        {
+          if (msg == NULL)
+            throw "Connection closed";
+
+          uint8_t *ret = (uint8_t*)msg->get().data();
+          size_t ret_len = msg->get().length();
+          uint8_t status = Read::i8(ret, ret_len);
+          netmsg->destroy(msg);
+          if (status != 0)
+            throw "Failed to push file";
+          push->done.set_value();
+        }
+      catch(...)
+        {
+          push->done.set_exception(std::current_exception());
+        }
+    };
+}
+
+void SockConnector::write_hash(const std::string & hash, std::string & cmd)
+{
+  if (!hash_cmds)
+    return;
+  Write::i8(hash.length(), cmd);
+  cmd.append(hash);
+}
+
+std::future<void> SockConnector::delete_file_async(const std::string &
+                                                   filename,
+                                                   uint64_t modified)
+{
+  auto done = std::make_shared< std::promise<void> >();
+  auto slot = hold();
+
   // Send the command info
   std::string cmd;
   Write::i8(CMD_DEL, cmd);
@@ -215,12 +943,28 @@ void SockConnector::delete_file(const std::string & filename,
   Write::i32(filename.length(), cmd);
   cmd.append(filename);
 
-  Message *msg = netmsg->send_and_wait(cmd);
-  uint8_t *ret = (uint8_t*)msg->get().data();
-  size_t ret_len = msg->get().length();
-  if (Read::i8(ret, ret_len) != 0)
-    throw "Server failed to delete file";
-  netmsg->destroy(msg);
+  netmsg->send_async(cmd, [this, done, slot](Message * msg)
+    {
+      try
+        {
+          if (msg == NULL)
+            throw "Connection closed";
+
+          uint8_t *ret = (uint8_t*)msg->get().data();
+          size_t ret_len = msg->get().length();
+          uint8_t status = Read::i8(ret, ret_len);
+          netmsg->destroy(msg);
+          if (status != 0)
+            throw "Server failed to delete file";
+          done->set_value();
+        }
+      catch(...)
+        {
+          done->set_exception(std::current_exception());
+        }
+    });
+
+  return done->get_future();
 }
 
 std::pair<std::string, Metadata::Data> SockConnector::wait()
@@ -242,6 +986,14 @@ std::pair<std::string, Metadata::Data> SockConnector::wait()
   mtd.modified = Read::i64(data, data_len);
   mtd.deleted = (bool)Read::i8(data, data_len);
 
+  // Servers which keep hashes send the new one after the flag
+  if (data_len > 0)
+    {
+      size_t hash_len = Read::i8(data, data_len);
+      if (hash_len <= data_len)
+        mtd.hash.assign((char*)data, hash_len);
+    }
+
   // Write a response saying we received the update
   std::string cmd;
   Write::i8(0, cmd);
@@ -253,7 +1005,8 @@ std::pair<std::string, Metadata::Data> SockConnector::wait()
 
 void SockConnector::connect(bool reg)
 {
-  net = client.connect();
+  if (net == NULL)
+    net = client.connect();
 
   // Check for compatible version
   int ver = net->read8();
@@ -264,11 +1017,15 @@ void SockConnector::connect(bool reg)
       throw "Incompatible Server Version";
     }
 
-  // Send login / register
+  // Send login / register along with the features we support
   if (reg)
-    net->write8(HAND_REG);
+    net->write8(HAND_REG | HAND_EXT | HAND_MORE);
   else
-    net->write8(HAND_LOGIN);
+    net->write8(HAND_LOGIN | HAND_EXT | HAND_MORE);
+  // Encrypted files never share chunks, so don't have the server index them
+  net->write8(NETMSG_FEATURES | HAND_INLINE | HAND_DELTA | HAND_HASHES |
+              (crypt == NULL ? HAND_CHUNKS : 0));
+  net->write8(HAND_JOURNAL | HAND_TREE);
 
   // Send credentials
   net->write16(user.length());
@@ -291,6 +1048,16 @@ void SockConnector::connect(bool reg)
         throw "Invalid Username or Password";
     }
 
+  // The server only answers with the features it agrees to use
+  uint8_t features = net->read8();
+  inline_cmds = features & HAND_INLINE;
+  delta_cmds = features & HAND_DELTA;
+  chunk_cmds = features & HAND_CHUNKS;
+  hash_cmds = features & HAND_HASHES;
+  uint8_t more = net->read8();
+  journal_cmds = more & HAND_JOURNAL;
+  tree_cmds = more & HAND_TREE;
   netmsg = new NetMsg(net);
+  netmsg->set_features(features & NETMSG_FEATURES);
   netmsg->start();
 }
@@ -22,8 +22,12 @@
 #ifndef __CONNECTOR_SOCKET_HXX__
 #define __CONNECTOR_SOCKET_HXX__
 
+#include <condition_variable>
 #include <cstdint>
+#include <future>
 #include <istream>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
 
@@ -43,10 +47,18 @@ public:
                 const std::string & user, const std::string & pass,
                 const std::string & key,
                 bool reg = false);
+
+  /**
+   * Logs in over a connection which is already open
+   * @param net The connection, which the connector takes over and deletes
+   */
+  SockConnector(Net * net, const std::string & user,
+                const std::string & pass, bool reg = false);
   ~SockConnector();
   void close();
 
   Metadata * get_metadata();
+  Metadata * get_metadata(Metadata * mtd, uint64_t & epoch, uint64_t & seq);
   void push_file(const std::string & filename, uint64_t modified,
                  std::istream & data, size_t data_size);
   void get_file(const std::string & filename, uint64_t & modified,
@@ -54,6 +66,26 @@ public:
   void delete_file(const std::string & filename, uint64_t modified);
   std::pair<std::string, Metadata::Data> wait();
 
+  std::future<void> push_file_async(const std::string & filename,
+                                    uint64_t modified, std::istream & data,
+                                    size_t data_size,
+                                    const std::string & hash = std::string());
+  std::future<uint64_t> get_file_async(const std::string & filename,
+                                       std::ostream & data);
+  std::future<uint64_t> get_file_async(const std::string & filename,
+                                       std::ostream & data,
+                                       std::istream & basis);
+  std::future<void> delete_file_async(const std::string & filename,
+                                      uint64_t modified);
+
+  /**
+   * Limits how many commands are in flight on the connection at once, the
+   * asynchronous operations block until one finishes once this many are
+   * waiting on the server, so they must not be started from the callbacks
+   * @param window The most commands in flight, at least 1
+   */
+  void set_window(size_t window);
+
 private:
   bool closed;
   NetClient client;
@@ -62,7 +94,119 @@ private:
   NetMsg * netmsg;
   Crypt * crypt;
 
+  // Set when the server takes pushes and answers pulls in one round trip
+  bool inline_cmds;
+
+  // Set when the server sends and applies deltas against its copies
+  bool delta_cmds;
+
+  // Set when the server takes files as lists of chunks
+  bool chunk_cmds;
+
+  // Set when pushes carry the hash of the file and the metadata and
+  // updates from the server carry the hashes of its files
+  bool hash_cmds;
+
+  // Set when the server sends only the metadata which changed since a
+  // cursor
+  bool journal_cmds;
+
+  // Set when the server compares its tree with a copy of the metadata
+  bool tree_cmds;
+
+  // Commands in flight and the most allowed at once, and the threads
+  // working out pushes which still use the connection
+  size_t window, in_flight, workers;
+  std::mutex window_lock;
+  std::condition_variable window_cond;
+
   void connect(bool reg = false);
+
+  /**
+   * A push in progress, which may go through more than one command before
+   * the server takes the file
+   */
+  struct Push
+  {
+    std::string filename, hash;
+    uint64_t modified;
+
+    // The file, which is read again from the start by each command
+    std::istream *data;
+    std::streampos start;
+    size_t size;
+
+    std::promise<void> done;
+    std::shared_ptr<SockConnector> slot;
+  };
+
+  /**
+   * Pushes the whole file, inline if it is small enough
+   * @param push The push, which is finished with the server's answer
+   */
+  void push_whole(const std::shared_ptr<Push> & push);
+
+  /**
+   * Pushes a file as a delta against the copy on the server, or as chunks
+   * or the whole file if the server has no copy to make it against. The
+   * signature is fetched and the delta made without waiting on either
+   * @param push The push
+   */
+  void push_delta(const std::shared_ptr<Push> & push);
+
+  /**
+   * Pushes a file as the list of its chunks, and then only the chunks the
+   * server can't find in any of its files. The file is split on a thread of
+   * its own
+   * @param push The push
+   */
+  void push_chunks(const std::shared_ptr<Push> & push);
+
+  /**
+   * Makes the delta against a signature and sends it, run on a thread of
+   * its own
+   */
+  void send_delta(std::shared_ptr<Push> push, uint64_t basis,
+                  std::string sig);
+
+  /**
+   * Splits the file and sends the list of chunks, run on a thread of its
+   * own
+   */
+  void send_chunks(std::shared_ptr<Push> push);
+
+  /**
+   * Makes the callback which finishes a push with the server's status once
+   * the body is sent
+   * @param push The push
+   * @param body The body, kept until the push is finished
+   */
+  NetMsg::Callback pushed(const std::shared_ptr<Push> & push,
+                          const std::shared_ptr<std::istream> & body);
+
+  /**
+   * Adds the hash of a pushed file after its filename, if the server takes
+   * hashes
+   * @param hash The hash, empty if it isn't known
+   * @param cmd The command being built
+   */
+  void write_hash(const std::string & hash, std::string & cmd);
+
+  /**
+   * Brings a copy of the metadata in line with the server's by comparing
+   * the digests of directories from the root down, a level at a time, so
+   * only the directories which differ are listed
+   * @param mtd The copy
+   * @param root The digest of the root of the server's tree
+   */
+  void reconcile(Metadata & mtd, const std::string & root);
+
+  /**
+   * Waits for room in the window and takes it for a command
+   * @return The hold on the room, which is given back once every copy of
+   *         it is gone along with the callbacks of the command
+   */
+  std::shared_ptr<SockConnector> hold();
 };
 
 #endif
@@ -34,6 +34,9 @@
 #include "util.hxx"
 #include "crypt.hxx"
 
+// Plaintext is encrypted this much at a time when a stream is read
+#define CRYPT_BUFF 65536
+
 CryptStream::CryptStream(bool dec, unsigned char *key, size_t key_len,
                          const EVP_CIPHER *c_func, const EVP_MD *h_func)
   : dec(dec), done(false), c_func(c_func), h_func(h_func),
@@ -59,7 +62,17 @@ CryptStream::~CryptStream()
 
 ssize_t CryptStream::read(char * buff, size_t size)
 {
-  return stream.readsome(buff, size);
+  ssize_t red = stream.readsome(buff, size);
+
+  // Nothing read is kept around, so a long stream only ever holds what was
+  // made from its latest writes
+  if (stream.tellg() == stream.tellp())
+    {
+      stream.str(std::string());
+      stream.clear();
+    }
+
+  return red;
 }
 
 #include <iostream>
@@ -148,6 +161,14 @@ ssize_t CryptStream::write(const char * buff, size_t size)
       stream.write((char*)out, out_len);
       delete [] in;
       delete [] out;
+
+      // Only the trailing HMAC is left, so the buffer starts over with it
+      // rather than keeping all of the ciphertext written so far
+      char tail[EVP_MAX_MD_SIZE];
+      in_len = decbuff.readsome(tail, sizeof(tail));
+      decbuff.str(std::string());
+      decbuff.clear();
+      decbuff.write(tail, in_len);
    }
   else
     {
@@ -195,6 +216,134 @@ ssize_t CryptStream::write(const char * buff, size_t size)
   return size;
 }
 
+CryptReader::CryptReader(CryptStream * cs, std::istream & in, uint64_t len)
+  : std::istream(NULL), buf(cs, in, len)
+{
+  rdbuf(&buf);
+}
+
+CryptReader::~CryptReader()
+{
+}
+
+CryptReader::Buf::Buf(CryptStream * cs, std::istream & in, uint64_t len)
+  : cs(cs), in(in), left(len), ended(false), plain(new char[CRYPT_BUFF]),
+    buff(new char[CRYPT_BUFF])
+{
+}
+
+CryptReader::Buf::~Buf()
+{
+  delete cs;
+  delete[] plain;
+  delete[] buff;
+}
+
+CryptReader::Buf::int_type CryptReader::Buf::underflow()
+{
+  ssize_t red;
+
+  // Ciphertext left over from the last refill goes out before any more
+  // plaintext is encrypted
+  while ((red = cs->read(buff, CRYPT_BUFF)) <= 0)
+    {
+      if (ended)
+        return traits_type::eof();
+
+      in.read(plain, left < CRYPT_BUFF ? left : CRYPT_BUFF);
+      if (in.gcount() > 0)
+        {
+          cs->write(plain, in.gcount());
+          left -= in.gcount();
+        }
+
+      // A short plaintext ends the ciphertext early, so the reader finds
+      // out it is shorter than the length it was promised
+      if (left == 0 || in.gcount() <= 0)
+        {
+          cs->write(NULL, 0);
+          ended = true;
+        }
+    }
+
+  setg(buff, buff, buff + red);
+  return traits_type::to_int_type(*gptr());
+}
+
+CryptWriter::CryptWriter(CryptStream * cs, std::ostream & out)
+  : std::ostream(NULL), buf(cs, out)
+{
+  rdbuf(&buf);
+}
+
+CryptWriter::~CryptWriter()
+{
+}
+
+void CryptWriter::finish()
+{
+  buf.finish();
+}
+
+CryptWriter::Buf::Buf(CryptStream * cs, std::ostream & out)
+  : cs(cs), out(out), failed(false), buff(new char[CRYPT_BUFF])
+{
+}
+
+CryptWriter::Buf::~Buf()
+{
+  delete cs;
+  delete[] buff;
+}
+
+void CryptWriter::Buf::finish()
+{
+  // Errors while writing were swallowed by the ostream, so they are only
+  // reported here
+  if (failed)
+    throw "Failed to decrypt the stream";
+  cs->write(NULL, 0);
+  pass();
+  if (!out)
+    throw "Failed to write the decrypted stream";
+}
+
+std::streamsize CryptWriter::Buf::xsputn(const char * s, std::streamsize n)
+{
+  if (failed)
+    return 0;
+
+  try
+    {
+      cs->write(s, n);
+      pass();
+    }
+  catch(...)
+    {
+      failed = true;
+      return 0;
+    }
+
+  return n;
+}
+
+CryptWriter::Buf::int_type CryptWriter::Buf::overflow(int_type c)
+{
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+
+  char ch = traits_type::to_char_type(c);
+  return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+void CryptWriter::Buf::pass()
+{
+  ssize_t red;
+
+  while ((red = cs->read(buff, CRYPT_BUFF)) > 0)
+    out.write(buff, red);
+}
+
 Crypt::Crypt(const std::string & key)
   : c_func(EVP_aes_256_cbc()), h_func(EVP_sha512())
 {
@@ -22,8 +22,11 @@
 #ifndef __CRYPT_HXX__
 #define __CRYPT_HXX__
 
-#include <sstream>
+#include <cstdint>
 #include <cstring>
+#include <istream>
+#include <ostream>
+#include <sstream>
 #include <string>
 
 #include "openssl/evp.h"
@@ -73,6 +76,87 @@ private:
   size_t key_len, iv_len;
 };
 
+/**
+ * Encrypts a plaintext stream as it is read, only a buffer of plaintext and
+ * the ciphertext made from it are held at once
+ */
+class CryptReader : public std::istream
+{
+public:
+  /**
+   * @param cs The encryption stream, which is deleted with the reader
+   * @param in The plaintext to encrypt
+   * @param len The length of the plaintext, no more than this is read
+   */
+  CryptReader(CryptStream * cs, std::istream & in, uint64_t len);
+  ~CryptReader();
+
+private:
+  class Buf : public std::streambuf
+  {
+  public:
+    Buf(CryptStream * cs, std::istream & in, uint64_t len);
+    ~Buf();
+
+  protected:
+    int_type underflow();
+
+  private:
+    CryptStream *cs;
+    std::istream & in;
+    uint64_t left;
+    bool ended;
+    char *plain, *buff;
+  };
+
+  Buf buf;
+};
+
+/**
+ * Decrypts a ciphertext stream as it is written, passing the plaintext on as
+ * soon as it is made so only a buffer of either is held at once
+ */
+class CryptWriter : public std::ostream
+{
+public:
+  /**
+   * @param cs The decryption stream, which is deleted with the writer
+   * @param out The stream the plaintext is written to
+   */
+  CryptWriter(CryptStream * cs, std::ostream & out);
+  ~CryptWriter();
+
+  /**
+   * Checks the HMAC once all of the ciphertext has been written. The
+   * plaintext has already been passed on, so it must be thrown away if
+   * this throws
+   */
+  void finish();
+
+private:
+  class Buf : public std::streambuf
+  {
+  public:
+    Buf(CryptStream * cs, std::ostream & out);
+    ~Buf();
+    void finish();
+
+  protected:
+    std::streamsize xsputn(const char * s, std::streamsize n);
+    int_type overflow(int_type c);
+
+  private:
+    CryptStream *cs;
+    std::ostream & out;
+    bool failed;
+    char *buff;
+
+    void pass();
+  };
+
+  Buf buf;
+};
+
 class Crypt
 {
 public:
@@ -0,0 +1,514 @@
+/*
+  Rolling checksum deltas between two versions of a file
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "util.hxx"
+#include "delta.hxx"
+
+// Bytes of the new file read at a time, also the longest literal run
+#define DELTA_BUFF 65536
+
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX 131072
+
+// Bytes of the strong hash kept for each block
+#define DELTA_STRONG 16
+
+// Bytes of the hash of the whole new file which ends the delta
+#define DELTA_SUM 32
+
+#define OP_LITERAL 0
+#define OP_COPY 1
+#define OP_END 2
+
+/**
+ * Writes the operations of a delta, merging references to consecutive
+ * blocks of the old file into one
+ */
+struct DeltaOps
+{
+  std::ostream & out;
+  uint64_t len, run_start, run_count;
+
+  DeltaOps(std::ostream & out)
+    : out(out), len(0), run_start(0), run_count(0) {}
+
+  void put(const char * data, size_t size)
+  {
+    out.write(data, size);
+    len += size;
+  }
+
+  void literal(const char * data, size_t size)
+  {
+    if (size == 0)
+      return;
+    flush();
+    std::string op;
+    Write::i8(OP_LITERAL, op);
+    Write::var(size, op);
+    put(op.data(), op.length());
+    put(data, size);
+  }
+
+  void copy(uint64_t index)
+  {
+    if (run_count > 0 && run_start + run_count == index)
+      {
+        run_count++;
+        return;
+      }
+    flush();
+    run_start = index;
+    run_count = 1;
+  }
+
+  void flush()
+  {
+    if (run_count == 0)
+      return;
+    std::string op;
+    Write::i8(OP_COPY, op);
+    Write::var(run_start, op);
+    Write::var(run_count, op);
+    put(op.data(), op.length());
+    run_count = 0;
+  }
+};
+
+/**
+ * Takes the strong hash of a block, a truncated SHA-256
+ * @param data The block
+ * @param len The length of the block
+ * @param hash Filled with DELTA_STRONG bytes of the hash
+ */
+static void strong(const uint8_t * data, size_t len, uint8_t * hash)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+
+  EVP_Digest(data, len, md, &md_len, EVP_sha256(), NULL);
+  memcpy(hash, md, DELTA_STRONG);
+}
+
+/**
+ * Checks whether a buffered operation is whole
+ * @param op The operation so far, starting with its type
+ * @param vars The number of variable length integers after the type
+ * @param extra The number of bytes after the integers
+ * @return True if all of the operation is there
+ */
+static bool whole(const std::string & op, size_t vars, size_t extra)
+{
+  size_t at = 1;
+  for (size_t i = 0; i < vars; i++)
+    {
+      size_t start = at;
+      while (at < op.length() && (op[at] & 0x80))
+        at++;
+      if (at - start >= 10)
+        throw "Variable length integer is too long";
+      if (at == op.length())
+        return false;
+      at++;
+    }
+  return op.length() >= at + extra;
+}
+
+uint32_t Delta::weak(const uint8_t * data, size_t len)
+{
+  uint32_t a = 0, b = 0;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      a += data[i];
+      b += (len - i) * data[i];
+    }
+  return (a & 0xffff) | b << 16;
+}
+
+uint32_t Delta::roll(uint32_t hash, uint8_t out, uint8_t in, size_t len)
+{
+  uint32_t a = hash & 0xffff, b = hash >> 16;
+
+  a = (a - out + in) & 0xffff;
+  b = (b - len * out + a) & 0xffff;
+  return a | b << 16;
+}
+
+uint32_t Delta::block_size(uint64_t len)
+{
+  uint64_t block = (uint64_t)std::sqrt((double)len);
+  block = (block + 7) & ~(uint64_t)7;
+  if (block < DELTA_BLOCK_MIN)
+    return DELTA_BLOCK_MIN;
+  if (block > DELTA_BLOCK_MAX)
+    return DELTA_BLOCK_MAX;
+  return block;
+}
+
+std::string Delta::signature(std::istream & in, uint64_t len)
+{
+  uint32_t block = block_size(len);
+  std::vector<uint8_t> buff(block);
+  uint8_t hash[DELTA_STRONG];
+  std::string sig;
+
+  Write::i32(block, sig);
+  Write::i64(len, sig);
+  for (uint64_t left = len; left > 0; )
+    {
+      size_t size = left < block ? left : block;
+      in.read((char*)buff.data(), size);
+      if ((size_t)in.gcount() != size)
+        throw "Failed to read the file to sign";
+
+      Write::i32(weak(buff.data(), size), sig);
+      strong(buff.data(), size, hash);
+      sig.append((char*)hash, DELTA_STRONG);
+      left -= size;
+    }
+
+  return sig;
+}
+
+uint64_t Delta::encode(const std::string & sig, std::istream & in,
+                       std::ostream & out)
+{
+  uint8_t *data = (uint8_t*)sig.data();
+  size_t size = sig.length();
+  uint32_t block = Read::i32(data, size);
+  uint64_t basis_len = Read::i64(data, size);
+  if (block == 0)
+    throw "Invalid delta signature";
+  uint64_t count = (basis_len + block - 1) / block;
+  if (size != count * (4 + DELTA_STRONG))
+    throw "Invalid delta signature";
+
+  // Only whole blocks are looked up as the hash rolls along, a short last
+  // block can only match the end of the new file
+  std::unordered_multimap<uint32_t, uint64_t> blocks;
+  blocks.reserve(count);
+  for (uint64_t i = 0; i < basis_len / block; i++)
+    blocks.emplace(be32toh(*(uint32_t*)(data + i * (4 + DELTA_STRONG))), i);
+
+  DeltaOps ops(out);
+  std::string head;
+  Write::i32(block, head);
+  ops.put(head.data(), head.length());
+
+  // The new file is buffered from the start of the pending literal run
+  // up to at least a block past the window
+  std::string buff;
+  size_t lit = 0, pos = 0;
+  uint64_t total = 0;
+  bool more = true;
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  auto fill = [&]()
+    {
+      while (more && buff.size() < pos + block)
+        {
+          if (lit >= DELTA_BUFF)
+            {
+              buff.erase(0, lit);
+              pos -= lit;
+              lit = 0;
+            }
+
+          size_t old = buff.size();
+          buff.resize(old + DELTA_BUFF);
+          in.read(&buff[old], DELTA_BUFF);
+          size_t red = in.gcount();
+          buff.resize(old + red);
+          if (in.bad())
+            throw "Failed to read the file to encode";
+          EVP_DigestUpdate(ctx, buff.data() + old, red);
+          total += red;
+          more = red == DELTA_BUFF;
+        }
+      return buff.size() >= pos + block;
+    };
+
+  try
+    {
+      uint8_t hash[DELTA_STRONG];
+      uint32_t rolling = 0;
+      bool fresh = true;
+
+      while (fill())
+        {
+          const uint8_t *win = (const uint8_t*)buff.data() + pos;
+          if (fresh)
+            {
+              rolling = weak(win, block);
+              fresh = false;
+            }
+
+          // The strong hash is only taken once the weak one matches
+          auto range = blocks.equal_range(rolling);
+          bool hashed = false, found = false;
+          uint64_t index = 0;
+          for (auto it = range.first; it != range.second && !found; it++)
+            {
+              if (!hashed)
+                {
+                  strong(win, block, hash);
+                  hashed = true;
+                }
+              index = it->second;
+              found = memcmp(data + index * (4 + DELTA_STRONG) + 4, hash,
+                             DELTA_STRONG) == 0;
+            }
+
+          if (found)
+            {
+              ops.literal(&buff[lit], pos - lit);
+              ops.copy(index);
+              pos += block;
+              lit = pos;
+              fresh = true;
+              continue;
+            }
+
+          // Long literal runs go out in pieces so they are never held whole
+          if (pos + 1 - lit >= DELTA_BUFF)
+            {
+              ops.literal(&buff[lit], pos + 1 - lit);
+              lit = pos + 1;
+            }
+
+          uint8_t gone = win[0];
+          pos++;
+          if (!fill())
+            break;
+          rolling = roll(rolling, gone, buff[pos + block - 1], block);
+        }
+
+      size_t tail = buff.size() - pos;
+      if (tail > 0 && tail == basis_len % block)
+        {
+          const uint8_t *last = data + (count - 1) * (4 + DELTA_STRONG);
+          const uint8_t *win = (const uint8_t*)buff.data() + pos;
+          strong(win, tail, hash);
+          if (be32toh(*(uint32_t*)last) == weak(win, tail) &&
+              memcmp(last + 4, hash, DELTA_STRONG) == 0)
+            {
+              ops.literal(&buff[lit], pos - lit);
+              ops.copy(count - 1);
+              lit = buff.size();
+            }
+        }
+      ops.literal(&buff[lit], buff.size() - lit);
+      ops.flush();
+
+      // The receiver checks what it built against the whole new file
+      unsigned char md[EVP_MAX_MD_SIZE];
+      unsigned int md_len;
+      EVP_DigestFinal_ex(ctx, md, &md_len);
+      std::string end;
+      Write::i8(OP_END, end);
+      Write::var(total, end);
+      end.append((char*)md, DELTA_SUM);
+      ops.put(end.data(), end.length());
+    }
+  catch(...)
+    {
+      EVP_MD_CTX_destroy(ctx);
+      throw;
+    }
+  EVP_MD_CTX_destroy(ctx);
+
+  if (!out)
+    throw "Failed to write the delta";
+  return ops.len;
+}
+
+DeltaWriter::DeltaWriter(std::istream & basis, std::ostream & out)
+  : std::ostream(NULL), buf(basis, out)
+{
+  rdbuf(&buf);
+}
+
+DeltaWriter::~DeltaWriter()
+{
+}
+
+void DeltaWriter::finish()
+{
+  buf.finish();
+}
+
+DeltaWriter::Buf::Buf(std::istream & basis, std::ostream & out)
+  : basis(basis), out(out), basis_len(0), written(0), literal(0), block(0),
+    ended(false), failed(false), ctx(EVP_MD_CTX_create()),
+    buff(new char[DELTA_BUFF])
+{
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+
+  basis.seekg(0, std::ios::end);
+  std::streamoff len = basis.tellg();
+  basis_len = len > 0 ? len : 0;
+  basis.clear();
+}
+
+DeltaWriter::Buf::~Buf()
+{
+  EVP_MD_CTX_destroy(ctx);
+  delete[] buff;
+}
+
+void DeltaWriter::Buf::finish()
+{
+  // Errors while writing were swallowed by the ostream, so they are only
+  // reported here
+  if (failed)
+    throw "Failed to apply the delta";
+  if (!ended)
+    throw "The delta was cut short";
+  if (!out)
+    throw "Failed to write the patched file";
+}
+
+std::streamsize DeltaWriter::Buf::xsputn(const char * s, std::streamsize n)
+{
+  if (failed)
+    return 0;
+
+  try
+    {
+      for (std::streamsize at = 0; at < n; )
+        {
+          // Literal runs go straight through rather than being gathered
+          if (literal > 0)
+            {
+              size_t size = literal < (uint64_t)(n - at) ? literal : n - at;
+              out.write(s + at, size);
+              EVP_DigestUpdate(ctx, s + at, size);
+              written += size;
+              literal -= size;
+              at += size;
+              continue;
+            }
+          if (ended)
+            throw "Data after the end of the delta";
+
+          pending.push_back(s[at++]);
+          parse();
+        }
+    }
+  catch(...)
+    {
+      failed = true;
+      return 0;
+    }
+
+  return n;
+}
+
+DeltaWriter::Buf::int_type DeltaWriter::Buf::overflow(int_type c)
+{
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+
+  char ch = traits_type::to_char_type(c);
+  return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+void DeltaWriter::Buf::parse()
+{
+  uint8_t *data = (uint8_t*)pending.data();
+  size_t size = pending.length();
+
+  // The delta starts with the block size of the old file
+  if (block == 0)
+    {
+      if (size < 4)
+        return;
+      block = Read::i32(data, size);
+      if (block == 0)
+        throw "Invalid delta block size";
+      pending.clear();
+      return;
+    }
+
+  uint8_t op = Read::i8(data, size);
+  if (op == OP_LITERAL)
+    {
+      if (!whole(pending, 1, 0))
+        return;
+      literal = Read::var(data, size);
+    }
+  else if (op == OP_COPY)
+    {
+      if (!whole(pending, 2, 0))
+        return;
+      uint64_t index = Read::var(data, size);
+      uint64_t count = Read::var(data, size);
+      copy(index, count);
+    }
+  else if (op == OP_END)
+    {
+      if (!whole(pending, 1, DELTA_SUM))
+        return;
+      uint64_t total = Read::var(data, size);
+      unsigned char md[EVP_MAX_MD_SIZE];
+      unsigned int md_len;
+      EVP_DigestFinal_ex(ctx, md, &md_len);
+      if (total != written || memcmp(md, data, DELTA_SUM) != 0)
+        throw "The patched file doesn't match the delta";
+      ended = true;
+    }
+  else
+    throw "Invalid delta operation";
+  pending.clear();
+}
+
+void DeltaWriter::Buf::copy(uint64_t index, uint64_t count)
+{
+  uint64_t blocks = (basis_len + block - 1) / block;
+  if (count == 0 || index >= blocks || count > blocks - index)
+    throw "Delta references blocks past the end of the old file";
+
+  uint64_t start = index * block;
+  uint64_t end = (index + count) * block;
+  if (end > basis_len)
+    end = basis_len;
+
+  basis.clear();
+  basis.seekg(start);
+  for (uint64_t left = end - start; left > 0; )
+    {
+      size_t size = left < DELTA_BUFF ? left : DELTA_BUFF;
+      basis.read(buff, size);
+      if ((size_t)basis.gcount() != size)
+        throw "Failed to read the old file";
+      out.write(buff, size);
+      EVP_DigestUpdate(ctx, buff, size);
+      written += size;
+      left -= size;
+    }
+}
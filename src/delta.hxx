@@ -0,0 +1,138 @@
+/*
+  Rolling checksum deltas between two versions of a file
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DELTA_HXX__
+#define __DELTA_HXX__
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "openssl/evp.h"
+
+/**
+ * The side holding the old version of a file sends the signature of its
+ * blocks, and the side holding the new version answers with a delta made
+ * of literal runs and references to those blocks, found at any offset
+ */
+namespace Delta
+{
+  /**
+   * Takes the weak hash of a block, which can be rolled along the data
+   * @param data The block
+   * @param len The length of the block
+   * @return The hash
+   */
+  uint32_t weak(const uint8_t * data, size_t len);
+
+  /**
+   * Moves a weak hash along by one byte
+   * @param hash The hash of the block starting at out
+   * @param out The byte leaving the block
+   * @param in The byte entering the block
+   * @param len The length of the block
+   * @return The hash of the block one byte on
+   */
+  uint32_t roll(uint32_t hash, uint8_t out, uint8_t in, size_t len);
+
+  /**
+   * Picks the block size for a file, growing with its square root so the
+   * signature and the chance of a match stay balanced
+   * @param len The length of the file
+   * @return The block size
+   */
+  uint32_t block_size(uint64_t len);
+
+  /**
+   * Takes the signature of a file, the weak and strong hash of each block
+   * @param in The file, read from its current position
+   * @param len The length of the file
+   * @return The serialized signature
+   */
+  std::string signature(std::istream & in, uint64_t len);
+
+  /**
+   * Writes the delta which turns the file the signature was taken of into
+   * the new file, reading the new file once and holding only a few blocks
+   * of it at a time
+   * @param sig The signature of the old file
+   * @param in The new file, read up to its end
+   * @param out The stream the delta is written to
+   * @return The length of the delta
+   */
+  uint64_t encode(const std::string & sig, std::istream & in,
+                  std::ostream & out);
+};
+
+/**
+ * Applies a delta as it is written, copying the blocks it references from
+ * the old file and passing the new file on straight away
+ */
+class DeltaWriter : public std::ostream
+{
+public:
+  /**
+   * @param basis The old file the delta was made against, which is read
+   *              with seeks so it can't be the output
+   * @param out The stream the new file is written to
+   */
+  DeltaWriter(std::istream & basis, std::ostream & out);
+  ~DeltaWriter();
+
+  /**
+   * Checks the new file against the hash at the end of the delta once all
+   * of the delta has been written. The file has already been passed on,
+   * so it must be thrown away if this throws
+   */
+  void finish();
+
+private:
+  class Buf : public std::streambuf
+  {
+  public:
+    Buf(std::istream & basis, std::ostream & out);
+    ~Buf();
+    void finish();
+
+  protected:
+    std::streamsize xsputn(const char * s, std::streamsize n);
+    int_type overflow(int_type c);
+
+  private:
+    std::istream & basis;
+    std::ostream & out;
+    uint64_t basis_len, written, literal;
+    uint32_t block;
+    bool ended, failed;
+    std::string pending;
+    EVP_MD_CTX *ctx;
+    char *buff;
+
+    void parse();
+    void copy(uint64_t index, uint64_t count);
+  };
+
+  Buf buf;
+};
+
+#endif
@@ -0,0 +1,236 @@
+/*
+  Content hashes of files and a cache of them
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <thread>
+
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+
+#include "util.hxx"
+#include "hasher.hxx"
+
+// Bytes read from a file at a time while hashing it
+#define HASH_BUFF 65536
+
+// Longer filenames in the cache can only be garbage
+#define NAME_MAX_LEN 65536
+
+std::string Hasher::file(const std::string & path)
+{
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in)
+    throw "Failed to open the file to hash";
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  char *buff = new char[HASH_BUFF];
+  while (in.read(buff, HASH_BUFF) || in.gcount() > 0)
+    EVP_DigestUpdate(ctx, buff, in.gcount());
+  delete [] buff;
+  bool failed = in.bad();
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_DigestFinal_ex(ctx, md, &md_len);
+  EVP_MD_CTX_destroy(ctx);
+  if (failed)
+    throw "Failed to read the file to hash";
+  return std::string((char*)md, HASH_LEN);
+}
+
+std::vector<std::string> Hasher::files(const std::vector<std::string> & paths,
+                                       size_t threads)
+{
+  std::vector<std::string> hashes(paths.size());
+  std::atomic<size_t> next(0);
+
+  // Each thread takes the next file as it finishes one, so a few large
+  // files don't hold up the rest
+  auto work = [&] ()
+    {
+      for (size_t i = next++; i < paths.size(); i = next++)
+        try
+          {
+            hashes[i] = file(paths[i]);
+          }
+        catch (const char * e)
+          {}
+    };
+
+  if (threads > paths.size())
+    threads = paths.size();
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads; i++)
+    pool.push_back(std::thread(work));
+  work();
+  for (auto it = pool.begin(); it != pool.end(); it++)
+    it->join();
+
+  return hashes;
+}
+
+std::string Hasher::keyed(const std::string & key, const std::string & hash)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+
+  HMAC(EVP_sha256(), key.data(), key.length(),
+       (const unsigned char*)hash.data(), hash.length(), md, &md_len);
+  return std::string((char*)md, HASH_LEN);
+}
+
+HashCache::HashCache(const std::string & path)
+  : path(path)
+{
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  std::string head(4, '\0');
+  while (in.read(&head[0], 4))
+    {
+      uint8_t *data = (uint8_t*)head.data();
+      size_t size = 4;
+      uint32_t name_len = Read::i32(data, size);
+      if (name_len >= NAME_MAX_LEN)
+        break;
+
+      // The name, then the inode, size and modification time, then the
+      // length of the hash and the hash
+      std::string rec(name_len + 25, '\0');
+      if (!in.read(&rec[0], rec.length()))
+        break;
+      data = (uint8_t*)rec.data() + name_len;
+      size = 25;
+      Entry entry;
+      entry.inode = Read::i64(data, size);
+      entry.size = Read::i64(data, size);
+      entry.modified = Read::i64(data, size);
+      entry.hash.resize(Read::i8(data, size));
+      if (!in.read(&entry.hash[0], entry.hash.length()))
+        break;
+      entries[rec.substr(0, name_len)] = entry;
+    }
+}
+
+std::string HashCache::hash(const std::string & path)
+{
+  return hash(std::vector<std::string>(1, path), 1)[0];
+}
+
+std::vector<std::string> HashCache::hash(const std::vector<std::string> & paths,
+                                         size_t threads)
+{
+  std::vector<std::string> hashes(paths.size()), missed;
+  std::vector<size_t> misses;
+  std::vector<Entry> stats;
+
+  for (size_t i = 0; i < paths.size(); i++)
+    {
+      Entry entry;
+      if (!stat_file(paths[i], entry))
+        {
+          entries.erase(paths[i]);
+          continue;
+        }
+
+      auto it = entries.find(paths[i]);
+      if (it != entries.end() && it->second.inode == entry.inode &&
+          it->second.size == entry.size &&
+          it->second.modified == entry.modified)
+        hashes[i] = it->second.hash;
+      else
+        {
+          misses.push_back(i);
+          missed.push_back(paths[i]);
+          stats.push_back(entry);
+        }
+    }
+
+  std::vector<std::string> found = Hasher::files(missed, threads);
+  for (size_t i = 0; i < misses.size(); i++)
+    {
+      if (found[i].empty())
+        continue;
+
+      // A file written while it was hashed may not match what was read,
+      // and a hash which vouches for the wrong contents would let a push
+      // be skipped, so none is given for it
+      Entry after;
+      if (!stat_file(missed[i], after) || after.inode != stats[i].inode ||
+          after.size != stats[i].size ||
+          after.modified != stats[i].modified)
+        continue;
+      hashes[misses[i]] = found[i];
+      stats[i].hash = found[i];
+      entries[missed[i]] = stats[i];
+    }
+
+  return hashes;
+}
+
+void HashCache::save()
+{
+  std::string tmp = path + ".new";
+  std::ofstream out(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+  for (auto it = entries.begin(); it != entries.end(); )
+    {
+      Entry entry;
+      if (!stat_file(it->first, entry))
+        {
+          it = entries.erase(it);
+          continue;
+        }
+
+      std::string rec;
+      Write::i32(it->first.length(), rec);
+      rec.append(it->first);
+      Write::i64(it->second.inode, rec);
+      Write::i64(it->second.size, rec);
+      Write::i64(it->second.modified, rec);
+      Write::i8(it->second.hash.length(), rec);
+      rec.append(it->second.hash);
+      out.write(rec.data(), rec.length());
+      it++;
+    }
+  out.close();
+  if (!out || rename(tmp.c_str(), path.c_str()) < 0)
+    throw "Failed to save the hash cache";
+}
+
+bool HashCache::stat_file(const std::string & path, Entry & entry)
+{
+  struct stat stats;
+  if (stat(path.c_str(), &stats) < 0 || !S_ISREG(stats.st_mode))
+    return false;
+  entry.inode = stats.st_ino;
+  entry.size = stats.st_size;
+#ifdef WIN32
+  entry.modified = (uint64_t)stats.st_mtime * 1000000000ull;
+#else
+  entry.modified = (uint64_t)stats.st_mtim.tv_sec * 1000000000ull +
+    stats.st_mtim.tv_nsec;
+#endif
+  return true;
+}
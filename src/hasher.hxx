@@ -0,0 +1,122 @@
+/*
+  Content hashes of files and a cache of them
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HASHER_HXX__
+#define __HASHER_HXX__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bytes in the hash of a file's contents
+#define HASH_LEN 32
+
+/**
+ * Hashes the contents of files with SHA-256, which OpenSSL runs on the
+ * SHA extensions or vector units of the CPU where it can
+ */
+namespace Hasher
+{
+  /**
+   * @param path The file to hash
+   * @return The hash of the contents of the file
+   * @throws An exception if the file can't be read
+   */
+  std::string file(const std::string & path);
+
+  /**
+   * Hashes many files at once, spread over a pool of threads
+   * @param paths The files to hash
+   * @param threads The most threads to use
+   * @return The hashes in the order of the paths, empty for files which
+   *         couldn't be read
+   */
+  std::vector<std::string> files(const std::vector<std::string> & paths,
+                                 size_t threads);
+
+  /**
+   * Keys a hash so that it only matches the hashes of other holders of the
+   * key, which keeps the server from confirming guesses at the contents of
+   * encrypted files
+   * @param key The key material
+   * @param hash The hash of the contents
+   * @return The keyed hash
+   */
+  std::string keyed(const std::string & key, const std::string & hash);
+};
+
+/**
+ * Remembers the hashes of files along with the inode, size and
+ * modification time they were taken at, so only the files which changed
+ * since are read again
+ */
+class HashCache
+{
+public:
+  /**
+   * @param path The file the cache is kept in, loaded if it exists
+   */
+  HashCache(const std::string & path);
+
+  /**
+   * Gets the hash of a file, from the cache if it hasn't changed
+   * @param path The file to hash
+   * @return The hash, or an empty string if the file can't be read or
+   *         changed while it was read
+   */
+  std::string hash(const std::string & path);
+
+  /**
+   * Gets the hashes of many files, hashing the ones which changed on a
+   * pool of threads
+   * @param paths The files to hash
+   * @param threads The most threads to use
+   * @return The hashes in the order of the paths, empty for files which
+   *         couldn't be read or changed while they were read
+   */
+  std::vector<std::string> hash(const std::vector<std::string> & paths,
+                                size_t threads);
+
+  /**
+   * Writes the cache out to its file, dropping files which are gone
+   */
+  void save();
+
+private:
+  struct Entry
+  {
+    uint64_t inode, size, modified;
+    std::string hash;
+  };
+
+  std::string path;
+  std::unordered_map<std::string, Entry> entries;
+
+  /**
+   * Fills the entry with the current state of the file
+   * @return False if the file doesn't exist
+   */
+  static bool stat_file(const std::string & path, Entry & entry);
+};
+
+#endif
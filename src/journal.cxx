@@ -0,0 +1,186 @@
+/*
+  A journal of the changes made to the stored files
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <random>
+#include <unordered_set>
+
+#include "util.hxx"
+#include "journal.hxx"
+
+// Bytes ahead of the first change, the epoch and the last change dropped
+#define JOURNAL_HEAD 16
+
+// Bytes of a change ahead of its filename
+#define RECORD_HEAD 12
+
+// Longer filenames in the log can only be garbage
+#define NAME_MAX_LEN 65536
+
+Journal::Journal(const std::string & path, size_t window)
+  : path(path), window(window), records(0), epoch_num(0), seq_num(0), base(0)
+{
+  bool torn = false;
+
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  std::string head(JOURNAL_HEAD, '\0');
+  if (in.read(&head[0], JOURNAL_HEAD))
+    {
+      uint8_t *data = (uint8_t*)head.data();
+      size_t size = JOURNAL_HEAD;
+      epoch_num = Read::i64(data, size);
+      base = seq_num = Read::i64(data, size);
+
+      head.resize(RECORD_HEAD);
+      while (in.read(&head[0], RECORD_HEAD))
+        {
+          data = (uint8_t*)head.data();
+          size = RECORD_HEAD;
+          uint64_t seq = Read::i64(data, size);
+          uint32_t name_len = Read::i32(data, size);
+          std::string filename(name_len < NAME_MAX_LEN ? name_len : 0, '\0');
+          if (name_len >= NAME_MAX_LEN || seq != seq_num + 1 ||
+              !in.read(&filename[0], filename.length()))
+            {
+              torn = true;
+              break;
+            }
+          records++;
+          seq_num = seq;
+          changes.push_back(std::make_pair(seq, filename));
+        }
+      if (in.gcount() > 0)
+        torn = true;
+    }
+  in.close();
+
+  // A journal which is new or whose head was lost starts a new epoch, so
+  // no client trusts the cursor it had
+  if (epoch_num == 0)
+    {
+      std::random_device rd;
+      while (epoch_num == 0)
+        epoch_num = (uint64_t)rd() << 32 | rd();
+      base = seq_num = 0;
+      changes.clear();
+      torn = true;
+    }
+
+  while (changes.size() > window)
+    {
+      base = changes.front().first;
+      changes.pop_front();
+    }
+
+  // A record cut short by a crash would garble everything appended after
+  // it, so the log is rewritten from what was read
+  if (torn || records > 2 * window)
+    compact();
+
+  log.open(path, std::ios::out | std::ios::binary | std::ios::app);
+  if (!log)
+    throw "Failed to open the journal";
+}
+
+Journal::~Journal()
+{
+  log.close();
+}
+
+uint64_t Journal::record(const std::string & filename)
+{
+  changes.push_back(std::make_pair(++seq_num, filename));
+  write(seq_num, filename);
+  records++;
+
+  while (changes.size() > window)
+    {
+      base = changes.front().first;
+      changes.pop_front();
+    }
+  if (records > 2 * window)
+    {
+      log.close();
+      compact();
+      log.open(path, std::ios::out | std::ios::binary | std::ios::app);
+      if (!log)
+        throw "Failed to open the journal";
+    }
+  return seq_num;
+}
+
+void Journal::flush()
+{
+  log.flush();
+}
+
+bool Journal::since(uint64_t epoch, uint64_t seq,
+                    std::vector<std::string> & changed) const
+{
+  changed.clear();
+  if (epoch != epoch_num || seq < base || seq > seq_num)
+    return false;
+
+  // Only the changes after the cursor are wanted, and a file which
+  // changed many times is listed once
+  std::unordered_set<std::string> seen;
+  auto it = changes.begin() + (seq - base);
+  for (auto end = changes.end(); it != end; it++)
+    if (seen.insert(it->second).second)
+      changed.push_back(it->second);
+  return true;
+}
+
+uint64_t Journal::epoch() const
+{
+  return epoch_num;
+}
+
+uint64_t Journal::seq() const
+{
+  return seq_num;
+}
+
+void Journal::write(uint64_t seq, const std::string & filename)
+{
+  std::string rec;
+  Write::i64(seq, rec);
+  Write::i32(filename.length(), rec);
+  rec.append(filename);
+  log.write(rec.data(), rec.length());
+}
+
+void Journal::compact()
+{
+  std::string tmp = path + ".new";
+  log.open(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+  std::string head;
+  Write::i64(epoch_num, head);
+  Write::i64(base, head);
+  log.write(head.data(), head.length());
+  for (auto it = changes.begin(), end = changes.end(); it != end; it++)
+    write(it->first, it->second);
+  log.close();
+  if (!log || rename(tmp.c_str(), path.c_str()) < 0)
+    throw "Failed to compact the journal";
+  records = changes.size();
+}
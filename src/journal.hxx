@@ -0,0 +1,100 @@
+/*
+  A journal of the changes made to the stored files
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __JOURNAL_HXX__
+#define __JOURNAL_HXX__
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Numbers every change made to the stored files and remembers the most
+ * recent ones, so a client which has seen everything up to some point is
+ * only sent what changed since. The journal is kept in a log which is
+ * appended to as files change
+ */
+class Journal
+{
+public:
+  /**
+   * Loads the journal from its log, which is compacted once it holds far
+   * more changes than are kept
+   * @param path The log file, created with a new epoch if it doesn't exist
+   * @param window The most changes kept, older ones need a full resync
+   */
+  Journal(const std::string & path, size_t window);
+  ~Journal();
+
+  /**
+   * Records a change to a file
+   * @param filename The file which changed
+   * @return The sequence number of the change
+   */
+  uint64_t record(const std::string & filename);
+
+  /**
+   * Writes the changes recorded so far out to the log
+   */
+  void flush();
+
+  /**
+   * Finds the files which changed after a cursor
+   * @param epoch The epoch the cursor was taken in
+   * @param seq The last change seen
+   * @param changed Filled with each file which changed once
+   * @return False if the changes after the cursor are no longer known,
+   *         since it is older than the window or from another journal
+   */
+  bool since(uint64_t epoch, uint64_t seq,
+             std::vector<std::string> & changed) const;
+
+  /**
+   * @return The epoch, which is picked at random when the journal is made
+   *         so cursors into an older one are never trusted
+   */
+  uint64_t epoch() const;
+
+  /**
+   * @return The sequence number of the last change
+   */
+  uint64_t seq() const;
+
+private:
+  std::string path;
+  size_t window, records;
+  uint64_t epoch_num, seq_num, base;
+  std::deque< std::pair<uint64_t, std::string> > changes;
+  std::ofstream log;
+
+  void write(uint64_t seq, const std::string & filename);
+  void compact();
+
+  Journal(const Journal &);
+  Journal & operator=(const Journal &);
+};
+
+#endif
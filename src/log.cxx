@@ -104,8 +104,17 @@ void Log::set_level(int level)
   mutex.unlock();
 }
 
+bool Log::enabled(int level) const
+{
+  return level <= this->level;
+}
+
 void Log::message(const std::string & message, int level)
 {
+  // Don't bother formatting messages which are filtered out
+  if (!enabled(level))
+    return;
+
   // Format the message string
   time_t rawtime;
   char date[DATE_SIZE];
@@ -119,25 +128,22 @@ void Log::message(const std::string & message, int level)
 
   mutex.lock();
 
-  if (level <= this->level)
+  // Print the formatted message to all of the output streams
+  global_mutex.lock();
+  for (auto out = outs.begin(); out != outs.end(); out++)
     {
-      // Print the formatted message to all of the output streams
-      global_mutex.lock();
-      for (auto out = outs.begin(); out != outs.end(); out++)
-        {
-          **out << output;
-          (*out)->flush();
-        }
-      global_mutex.unlock();
+      **out << output;
+      (*out)->flush();
+    }
+  global_mutex.unlock();
 
-      // Print the formatted message to all of the files
-      for (auto out = files.begin(); out!= files.end(); out++)
-        {
-          (*out)->mutex.lock();
-          *(*out)->file << output;
-          (*out)->file->flush();
-          (*out)->mutex.unlock();
-        }
+  // Print the formatted message to all of the files
+  for (auto out = files.begin(); out!= files.end(); out++)
+    {
+      (*out)->mutex.lock();
+      *(*out)->file << output;
+      (*out)->file->flush();
+      (*out)->mutex.unlock();
     }
 
   mutex.unlock();
@@ -145,6 +151,9 @@ void Log::message(const std::string & message, int level)
 
 void Log::message(const char * message, int level)
 {
+  if (!enabled(level))
+    return;
+
   this->message(std::string(message), level);
 }
 
@@ -172,6 +181,7 @@ void Log::clear()
 
 void Log::copy(const Log & other)
 {
+  level = other.level.load();
   for (auto file = other.files.begin(); file != other.files.end(); file++)
     {
       // Make sure the other logs know we have a handle
@@ -26,6 +26,7 @@
 #include <ostream>
 #include <fstream>
 #include <mutex>
+#include <atomic>
 
 /**
  * Synchronized Logfile handler
@@ -86,6 +87,14 @@ public:
    */
   void set_level(int level);
 
+  /**
+   * Checks whether a message would be written, so callers can skip
+   * building messages nobody will see
+   * @param level The importance level of the message
+   * @return True if messages of the level are written
+   */
+  bool enabled(int level) const;
+
   /**
    * Writes a message to all of the output streams
    * @param message The message to write
@@ -110,7 +119,7 @@ private:
 
   static std::mutex global_mutex;
 
-  int level;
+  std::atomic<int> level;
   std::vector<std::ostream *> outs;
   std::vector<File *> files;
   std::mutex mutex;
@@ -26,6 +26,8 @@
 #include <string>
 #include <cstring>
 
+#include "openssl/evp.h"
+
 #include "net.hxx"
 #include "metadata.hxx"
 #include "log.hxx"
@@ -39,6 +41,8 @@ Metadata::Metadata(uint8_t * data, size_t size)
 {
   // Get the size of the map
   size_t count = Read::i64(data, size);
+  bool hashes = count & MTD_HASHES;
+  count &= ~MTD_HASHES;
 
   while(count > 0)
     {
@@ -56,9 +60,19 @@ Metadata::Metadata(uint8_t * data, size_t size)
       d.modified = Read::i64(data, size);
       d.deleted = Read::i8(data, size);
       d.size = Read::i64(data, size);
+      if (hashes)
+        {
+          size_t hash_len = Read::i8(data, size);
+          if (size < hash_len)
+            throw "Metadata object too small to deserialize";
+          d.hash.append((char*)data, hash_len);
+          data += hash_len;
+          size -= hash_len;
+        }
 
       // Append the file to the metadata
       files[filename] = d;
+      update(filename);
 
       count--;
     }
@@ -75,23 +89,26 @@ void Metadata::build(const std::string & rootpath, const std::string & path)
   for (; it != end; it++)
     {
       std::string fn = it->path().string().substr(rootpath.length());
+      // Only files are synced, directories come along with them
       struct stat stats;
-      if (stat(it->path().string().c_str(), &stats) < 0)
+      if (stat(it->path().string().c_str(), &stats) < 0 ||
+          !S_ISREG(stats.st_mode))
         continue;
       Data d;
       d.modified = stats.st_mtime;
       d.deleted = false;
       d.size = stats.st_size;
       files[fn] = d;
+      update(fn);
     }
 }
 
-uint8_t * Metadata::serialize(size_t & size)
+uint8_t * Metadata::serialize(size_t & size, bool hashes)
 {
   std::string out;
 
-  // Append the size
-  size_t len = htobe64(files.size());
+  // Append the size, flagged when every entry carries its hash
+  size_t len = htobe64(files.size() | (hashes ? MTD_HASHES : 0));
   out.append((char*)&len, 8);
 
   for (auto it = files.begin(); it != files.end(); it++)
@@ -106,6 +123,11 @@ uint8_t * Metadata::serialize(size_t & size)
       out.append((char*)&mod, 8);
       out.append((char*)&it->second.deleted, 1);
       Write::i64(it->second.size, out);
+      if (hashes)
+        {
+          Write::i8(it->second.hash.length(), out);
+          out.append(it->second.hash);
+        }
     }
 
   // Copy the serialized bytes into the output buffer
@@ -136,21 +158,25 @@ Metadata::Data Metadata::get_file(const std::string & filename) const
 }
 
 void Metadata::new_file(const std::string & filename, size_t size,
-                        uint64_t modified)
+                        uint64_t modified, const std::string & hash)
 {
   files[filename].size = size;
   files[filename].modified = modified;
   files[filename].deleted = false;
+  files[filename].hash = hash;
+  update(filename);
 
   global_log.message(std::string("New File: ") + filename, Log::NOTICE);
 }
 
 void Metadata::modify_file(const std::string & filename, size_t size,
-                           uint64_t modified)
+                           uint64_t modified, const std::string & hash)
 {
   files[filename].size = size;
   files[filename].modified = modified;
   files[filename].deleted = false;
+  files[filename].hash = hash;
+  update(filename);
   global_log.message(std::string("Modified File: ") + filename, Log::NOTICE);
 }
 
@@ -158,5 +184,196 @@ void Metadata::delete_file(const std::string & filename, uint64_t modified)
 {
   files[filename].modified = modified;
   files[filename].deleted = true;
+  files[filename].hash.clear();
+  update(filename);
   global_log.message(std::string("Delete File: ") + filename, Log::NOTICE);
 }
+
+void Metadata::set_hash(const std::string & filename, const std::string & hash)
+{
+  if (files.count(filename) > 0)
+    files[filename].hash = hash;
+}
+
+void Metadata::set_file(const std::string & filename, const Data & data)
+{
+  files[filename] = data;
+  update(filename);
+}
+
+void Metadata::erase(const std::string & path)
+{
+  // Gather everything below the path before the tree is pruned
+  std::vector<std::string> names(1, path);
+  for (size_t i = 0; i < names.size(); i++)
+    {
+      const Node *node = find(names[i]);
+      if (node == NULL)
+        continue;
+      for (auto it = node->children.begin(), end = node->children.end();
+           it != end; it++)
+        names.push_back(join(names[i], it->first));
+    }
+
+  for (auto it = names.begin(), end = names.end(); it != end; it++)
+    if (files.erase(*it) > 0)
+      update(*it);
+}
+
+std::string Metadata::digest(const std::string & path) const
+{
+  const Node *node = find(path);
+  return node == NULL ? std::string() : digest(*node);
+}
+
+std::vector<Metadata::Child> Metadata::children(const std::string & path) const
+{
+  std::vector<Child> out;
+  const Node *node = find(path);
+  if (node == NULL)
+    return out;
+
+  for (auto it = node->children.begin(), end = node->children.end();
+       it != end; it++)
+    {
+      Child child;
+      child.name = it->first;
+      child.dir = !it->second.file;
+      child.digest = digest(it->second);
+      out.push_back(child);
+    }
+  return out;
+}
+
+std::string Metadata::join(const std::string & dir, const std::string & name)
+{
+  if (!dir.empty() && dir[dir.length() - 1] == '/')
+    return dir + name;
+  return dir + "/" + name;
+}
+
+/**
+ * Splits a path into its components, ignoring repeated slashes
+ */
+static std::vector<std::string> split_path(const std::string & path)
+{
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (start < path.length())
+    {
+      size_t end = path.find('/', start);
+      if (end == std::string::npos)
+        end = path.length();
+      if (end > start)
+        parts.push_back(path.substr(start, end - start));
+      start = end + 1;
+    }
+  return parts;
+}
+
+void Metadata::update(const std::string & filename)
+{
+  std::vector<std::string> parts = split_path(filename);
+  if (parts.empty())
+    return;
+
+  // Every directory on the way down has to work its digest out again
+  std::vector<Node *> path;
+  Node *node = &root;
+  for (size_t i = 0; i + 1 < parts.size(); i++)
+    {
+      node->dirty = true;
+      path.push_back(node);
+      node = &node->children[parts[i]];
+    }
+  node->dirty = true;
+  path.push_back(node);
+
+  auto it = files.find(filename);
+  if (it != files.end())
+    {
+      // Deleted files stay in the tree so they can be listed, but only
+      // files which exist count towards the digests
+      Node & leaf = node->children[parts.back()];
+      leaf.file = true;
+      leaf.digest.clear();
+      // The size is left out since the server stores encrypted files at
+      // their encrypted size, which would never match the client's
+      if (!it->second.deleted)
+        {
+          std::string rec;
+          Write::i64(it->second.modified, rec);
+          unsigned char md[EVP_MAX_MD_SIZE];
+          unsigned int md_len;
+          EVP_Digest(rec.data(), rec.length(), md, &md_len, EVP_sha256(),
+                     NULL);
+          leaf.digest.assign((char*)md, MTD_DIGEST);
+        }
+      return;
+    }
+
+  // The file is gone, along with any directories it leaves empty
+  auto leaf = node->children.find(parts.back());
+  if (leaf == node->children.end())
+    return;
+  leaf->second.file = false;
+  if (!leaf->second.children.empty())
+    return;
+  node->children.erase(leaf);
+  for (size_t i = parts.size() - 1; i > 0; i--)
+    {
+      Node *parent = path[i - 1];
+      auto child = parent->children.find(parts[i - 1]);
+      if (child->second.file || !child->second.children.empty())
+        break;
+      parent->children.erase(child);
+    }
+}
+
+const Metadata::Node * Metadata::find(const std::string & path) const
+{
+  const Node *node = &root;
+  std::vector<std::string> parts = split_path(path);
+  for (auto it = parts.begin(), end = parts.end(); it != end; it++)
+    {
+      auto child = node->children.find(*it);
+      if (child == node->children.end())
+        return NULL;
+      node = &child->second;
+    }
+  return node;
+}
+
+const std::string & Metadata::digest(const Node & node)
+{
+  if (node.file || !node.dirty)
+    return node.digest;
+
+  // The digest of a directory covers the name, kind and digest of each
+  // entry with something in it
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+  bool any = false;
+  for (auto it = node.children.begin(), end = node.children.end();
+       it != end; it++)
+    {
+      const std::string & child = digest(it->second);
+      if (child.empty())
+        continue;
+      any = true;
+      std::string rec;
+      Write::i8(it->second.file ? 0 : 1, rec);
+      Write::i32(it->first.length(), rec);
+      rec.append(it->first);
+      rec.append(child);
+      EVP_DigestUpdate(ctx, rec.data(), rec.length());
+    }
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_DigestFinal_ex(ctx, md, &md_len);
+  EVP_MD_CTX_destroy(ctx);
+  node.digest = any ? std::string((char*)md, MTD_DIGEST) : std::string();
+  node.dirty = false;
+  return node.digest;
+}
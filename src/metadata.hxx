@@ -23,8 +23,16 @@
 #define __METADATA_HXX__
 
 #include <cstdint>
+#include <map>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+// Set in the serialized count when every entry is followed by its hash
+#define MTD_HASHES (1ull << 63)
+
+// Bytes in the digest of a subtree
+#define MTD_DIGEST 32
 
 class Metadata
 {
@@ -34,24 +42,88 @@ public:
     uint64_t size;
     uint64_t modified;
     bool deleted;
+    std::string hash; // Empty when the contents haven't been hashed
+  };
+
+  // An entry of a directory in the tree of files
+  struct Child
+  {
+    std::string name;
+    bool dir;
+    std::string digest;
   };
 
   Metadata();
   Metadata(uint8_t * data, size_t size);
   Metadata(const std::string & path);
-  uint8_t * serialize(size_t & size);
+  uint8_t * serialize(size_t & size, bool hashes = false);
 
   std::unordered_map<std::string, Data>::const_iterator begin() const;
   std::unordered_map<std::string, Data>::const_iterator end() const;
   Data get_file(const std::string & filename) const;
 
-  void new_file(const std::string & filename, size_t size, uint64_t modified);
+  void new_file(const std::string & filename, size_t size, uint64_t modified,
+                const std::string & hash = std::string());
   void modify_file(const std::string & filename, size_t size,
-                   uint64_t modified);
+                   uint64_t modified, const std::string & hash = std::string());
+  void set_hash(const std::string & filename, const std::string & hash);
+  void set_file(const std::string & filename, const Data & data);
   void delete_file(const std::string & filename, uint64_t modified);
+
+  /**
+   * Forgets a file entirely, or everything below a directory
+   * @param path The file or directory
+   */
+  void erase(const std::string & path);
+
+  /**
+   * Gets the digest of a subtree, which covers the name and modification
+   * time of every file below it which isn't deleted. Two trees with the
+   * same digest hold the same files, so comparing digests from the root
+   * down finds their differences without looking at the rest
+   * @param path The directory, "/" for the root, or a file
+   * @return The digest, empty if no file below it exists
+   */
+  std::string digest(const std::string & path) const;
+
+  /**
+   * Lists a directory along with the digest of each entry, deleted files
+   * are listed with empty digests
+   * @param path The directory, "/" for the root
+   * @return The entries in the order of their names
+   */
+  std::vector<Child> children(const std::string & path) const;
+
+  /**
+   * @param dir A directory, "/" for the root
+   * @param name An entry in it
+   * @return The path of the entry
+   */
+  static std::string join(const std::string & dir, const std::string & name);
 private:
+  // A directory in the tree, or a file. Directories work out their digests
+  // when asked and are marked dirty whenever a file below them changes
+  struct Node
+  {
+    std::map<std::string, Node> children;
+    bool file;
+    mutable bool dirty;
+    mutable std::string digest;
+
+    Node() : file(false), dirty(false) {}
+  };
+
   std::unordered_map<std::string, Data> files;
+  Node root;
   void build(const std::string & rootpath, const std::string & path);
+
+  /**
+   * Brings the tree in line with the entry of a file
+   * @param filename The file which was changed or removed
+   */
+  void update(const std::string & filename);
+  const Node * find(const std::string & path) const;
+  static const std::string & digest(const Node & node);
 };
 
 #endif
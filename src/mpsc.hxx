@@ -0,0 +1,80 @@
+/*
+  Lock free queue with many producers and a single consumer
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __MPSC_HXX__
+#define __MPSC_HXX__
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Queues items which are linked through their own next pointer, so
+ * pushing never allocates, an item may only be queued once at a time
+ * Producers push onto a stack which the consumer takes whole and reverses
+ */
+template <class T>
+class Mpsc
+{
+public:
+  Mpsc() : head(NULL) {}
+
+  /**
+   * Adds an item to the back of the queue from any thread
+   * @param item The item to add, its next pointer is overwritten
+   */
+  void push(T * item)
+  {
+    T *old = head.load(std::memory_order_relaxed);
+    do
+      item->next = old;
+    while (!head.compare_exchange_weak(old, item));
+  }
+
+  /**
+   * Removes every item in the queue, only the consumer may call this
+   * @return The first item, linked to the rest in the order they were pushed
+   */
+  T *take()
+  {
+    T *item = head.exchange(NULL), *prev = NULL, *next;
+
+    // The stack is newest first so flip it around
+    while (item != NULL)
+      {
+        next = item->next;
+        item->next = prev;
+        prev = item;
+        item = next;
+      }
+
+    return prev;
+  }
+
+  bool empty() const
+  {
+    return head.load() == NULL;
+  }
+
+private:
+  std::atomic<T*> head;
+};
+
+#endif
@@ -37,14 +37,36 @@ static void start()
 #else
 #  include <unistd.h>
 #  include <sys/socket.h>
+#  include <sys/uio.h>
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <arpa/inet.h>
+#  include <sys/time.h>
+#  include <sys/ioctl.h>
+#  include <fcntl.h>
+#  ifdef __linux__
+#    include <sys/sendfile.h>
+#  endif
 static void start()
 {
 }
 #endif
 
+// Broken connections should throw rather than raise SIGPIPE
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#  define MSG_MORE 0
+#endif
+
+// The most buffers handed to a single sendmsg
+#define IOVS 64
+
+// Buffer size used to copy files where sendfile is unavailable
+#define BUFF 65536
+
 static int on = 0;
 static void global_start()
 {
@@ -60,8 +82,15 @@ static void global_start()
 #include "util.hxx"
 
 Net::Net(int sock, const std::string & host, uint16_t port) :
-  sock(sock), closed(false), host(host), port(port)
-{}
+  sock(sock), closed(false), host(host), port(port), staged_size(0)
+{
+  pipes[0] = pipes[1] = -1;
+
+  // Writes are already coalesced so Nagle only delays pipelined messages,
+  // this fails harmlessly on sockets which aren't TCP
+  int flag = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+}
 
 Net::~Net()
 {
@@ -84,13 +113,63 @@ void Net::close()
 
   local_close(sock);
   closed = true;
+
+#ifdef __linux__
+  if (pipes[0] >= 0)
+    {
+      ::close(pipes[0]);
+      ::close(pipes[1]);
+    }
+#endif
+}
+
+void Net::shutdown()
+{
+  if (closed)
+    return;
+
+#ifdef WIN32
+  ::shutdown(sock, SD_BOTH);
+#else
+  ::shutdown(sock, SHUT_RDWR);
+#endif
+}
+
+void Net::set_timeout(unsigned int secs)
+{
+#ifdef WIN32
+  DWORD tv = secs * 1000;
+#else
+  struct timeval tv;
+  tv.tv_sec = secs;
+  tv.tv_usec = 0;
+#endif
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+}
+
+void Net::set_send_timeout(unsigned int secs)
+{
+#ifdef WIN32
+  DWORD tv = secs * 1000;
+#else
+  struct timeval tv;
+  tv.tv_sec = secs;
+  tv.tv_usec = 0;
+#endif
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
 }
 
 void Net::write(const uint8_t * data, size_t size)
 {
   int64_t wrote;
+
+  // Keep the stream ordered with anything still buffered
+  if (!segments.empty())
+    flush();
+
   while (size > 0)
-    if ((wrote = send(sock, (const char *)data, size, 0)) >= 0)
+    if ((wrote = send(sock, (const char *)data, size, MSG_NOSIGNAL)) >= 0)
       {
         data += wrote;
         size -= wrote;
@@ -127,20 +206,243 @@ void Net::write64(uint64_t i)
   write((uint8_t*)&i, sizeof(i));
 }
 
+void Net::queue(const uint8_t * data, size_t size, bool copy)
+{
+  if (size == 0)
+    return;
+
+  staged_size += size;
+  if (copy)
+    {
+      // Copies are contiguous in the staging buffer so they share a segment
+      if (!segments.empty() && segments.back().data == NULL)
+        segments.back().size += size;
+      else
+        {
+          Segment seg = { NULL, staged.size(), size };
+          segments.push_back(seg);
+        }
+      staged.append((const char *)data, size);
+    }
+  else
+    {
+      Segment seg = { data, 0, size };
+      segments.push_back(seg);
+    }
+}
+
+void Net::flush(bool more)
+{
+  if (segments.empty())
+    return;
+
+#ifdef WIN32
+  std::vector<Segment> segs;
+  segs.swap(segments);
+  for (auto it = segs.begin(), end = segs.end(); it != end; it++)
+    write(it->data ? it->data : (uint8_t*)staged.data() + it->offset,
+          it->size);
+#else
+  struct iovec iov[IOVS];
+  struct msghdr hdr;
+  size_t seg = 0, skip = 0, left;
+  ssize_t wrote;
+  int count;
+
+  while (seg < segments.size())
+    {
+      // Gather the next run of segments into a single call
+      count = 0;
+      for (size_t i = seg; i < segments.size() && count < IOVS; i++, count++)
+        {
+          const uint8_t *base = segments[i].data;
+          if (base == NULL)
+            base = (const uint8_t *)staged.data() + segments[i].offset;
+          left = segments[i].size;
+          if (i == seg)
+            {
+              base += skip;
+              left -= skip;
+            }
+          iov[count].iov_base = (void *)base;
+          iov[count].iov_len = left;
+        }
+
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_iov = iov;
+      hdr.msg_iovlen = count;
+      if ((wrote = sendmsg(sock, &hdr,
+                           MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          clear_queue();
+          throw std::string("Write error during transmission: ") +
+            strerror(errno);
+        }
+
+      // Skip past everything the kernel accepted
+      while (wrote > 0)
+        {
+          left = segments[seg].size - skip;
+          if ((size_t)wrote >= left)
+            {
+              wrote -= left;
+              seg++;
+              skip = 0;
+            }
+          else
+            {
+              skip += wrote;
+              wrote = 0;
+            }
+        }
+    }
+#endif
+
+  clear_queue();
+}
+
+void Net::send_file(int fd, uint64_t size)
+{
+  // The header is held back until the file data follows it
+  flush(true);
+
+#ifdef __linux__
+  ssize_t sent;
+  while (size > 0)
+    {
+      if ((sent = sendfile(sock, fd, NULL, size < BUFF * 1024 ?
+                           size : BUFF * 1024)) < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN)
+            continue;
+          throw std::string("Sendfile error during transmission: ") +
+            strerror(errno);
+        }
+      if (sent == 0)
+        throw "File ended before its length";
+      size -= sent;
+    }
+#else
+  uint8_t buff[BUFF];
+  int64_t red;
+  while (size > 0)
+    {
+      if ((red = ::read(fd, buff, size < BUFF ? size : BUFF)) <= 0)
+        throw "File ended before its length";
+      write(buff, red);
+      size -= red;
+    }
+#endif
+}
+
+void Net::splice_to(int fd, uint64_t size)
+{
+#ifdef __linux__
+  ssize_t in, out;
+
+  // The pipe is only needed by connections which receive files
+  if (pipes[0] < 0 && pipe(pipes) < 0)
+    throw std::string("Failed to create pipe: ") + strerror(errno);
+
+  while (size > 0)
+    {
+      in = splice(sock, NULL, pipes[1], NULL, size < BUFF ? size : BUFF,
+                  SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (in < 0 && errno == EINTR)
+        continue;
+      if (in < 0)
+        throw std::string("Splice error during transmission: ") +
+          strerror(errno);
+      if (in == 0)
+        throw "Connection closed by remote host";
+      size -= in;
+
+      // Drain the pipe into the file
+      while (in > 0)
+        if ((out = splice(pipes[0], NULL, fd, NULL, in,
+                          SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+          in -= out;
+        else if (out < 0 && errno != EINTR)
+          throw std::string("Splice error writing file: ") + strerror(errno);
+    }
+#else
+  uint8_t buff[BUFF];
+  int64_t red, wrote;
+  while (size > 0)
+    {
+      red = size < BUFF ? size : BUFF;
+      read_all(buff, red);
+      for (int64_t off = 0; off < red; off += wrote)
+        if ((wrote = ::write(fd, buff + off, red - off)) < 0)
+          throw std::string("Failed to write file: ") + strerror(errno);
+      size -= red;
+    }
+#endif
+}
+
+size_t Net::available()
+{
+#ifdef WIN32
+  u_long avail = 0;
+  ioctlsocket(sock, FIONREAD, &avail);
+#else
+  int avail = 0;
+  ioctl(sock, FIONREAD, &avail);
+#endif
+  return avail;
+}
+
+size_t Net::queued() const
+{
+  return staged_size;
+}
+
+void Net::clear_queue()
+{
+  // The staging memory is kept around for the next batch
+  segments.clear();
+  staged.clear();
+  staged_size = 0;
+}
+
 int64_t Net::read(uint8_t * data, size_t size)
 {
   return recv(sock, (char *)data, size, 0);
 }
 
+int64_t Net::read_ready(uint8_t * data, size_t size)
+{
+#ifdef WIN32
+  u_long avail = 0;
+  ioctlsocket(sock, FIONREAD, &avail);
+  if (avail == 0)
+    return 0;
+  int64_t len = recv(sock, (char *)data, size, 0);
+#else
+  int64_t len = recv(sock, (char *)data, size, MSG_DONTWAIT);
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+#endif
+
+  // Orderly shutdowns and errors both end the connection
+  if (len <= 0)
+    return -1;
+  return len;
+}
+
 void Net::read_all(uint8_t * data, size_t size)
 {
   int64_t len = 0;
   while (size > 0)
-    if ((len = read(data, size)) >= 0)
+    if ((len = read(data, size)) > 0)
       {
         data += len;
         size -= len;
       }
+    else if (len == 0)
+      throw "Connection closed by remote host";
     else
       throw std::string("Read error during transmission: ") + strerror(errno);
 }
@@ -26,6 +26,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 class Net
 {
@@ -34,6 +35,14 @@ public:
   ~Net();
 
   void close();
+  void shutdown();
+  void set_timeout(unsigned int secs);
+
+  /**
+   * Limits how long a single write may block, leaving reads untouched
+   * @param secs Seconds to wait for the peer to make room, 0 for ever
+   */
+  void set_send_timeout(unsigned int secs);
 
   void write(const uint8_t * data, size_t size);
   void write(const std::string & data);
@@ -42,7 +51,49 @@ public:
   void write32(uint32_t i);
   void write64(uint64_t i);
 
+  /**
+   * Buffers data to be sent by the next flush
+   * @param data The data to send
+   * @param size The length of the data
+   * @param copy False if the data stays valid until the flush, so large
+   *             bodies are gathered straight from the caller's memory
+   */
+  void queue(const uint8_t * data, size_t size, bool copy = true);
+
+  /**
+   * Sends all of the queued data with as few system calls as possible
+   * @param more True if more data immediately follows the queued data
+   */
+  void flush(bool more = false);
+
+  /**
+   * Sends the contents of a file after any queued data, using sendfile
+   * where it is available so the data never enters user space
+   * @param fd The file to send from, starting at its current offset
+   * @param size The number of bytes to send
+   */
+  void send_file(int fd, uint64_t size);
+
+  /**
+   * @return The number of bytes waiting to be flushed
+   */
+  size_t queued() const;
+
+  /**
+   * Moves data from the socket into a file, using splice where it is
+   * available so the data never enters user space
+   * @param fd The file to write into at its current offset
+   * @param size The number of bytes to move, blocks until all have arrived
+   */
+  void splice_to(int fd, uint64_t size);
+
+  /**
+   * @return The number of bytes ready to be read without blocking
+   */
+  size_t available();
+
   int64_t read(uint8_t * data, size_t size);
+  int64_t read_ready(uint8_t * data, size_t size);
   void read_all(uint8_t * data, size_t size);
   uint8_t read8();
   uint16_t read16();
@@ -52,11 +103,24 @@ public:
   int get_fd() const;
 
 private:
+  struct Segment
+  {
+    const uint8_t * data;
+    size_t offset, size;
+  };
+
   int sock;
   bool closed;
 
   std::string host;
   uint16_t port;
+
+  std::string staged;
+  std::vector<Segment> segments;
+  size_t staged_size;
+  int pipes[2];
+
+  void clear_queue();
 };
 
 class NetServer
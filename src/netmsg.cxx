@@ -20,29 +20,173 @@
 */
 
 #include <functional>
+#include <algorithm>
+#include <cerrno>
 
 #include "netmsg.hxx"
 #include "log.hxx"
+#include "util.hxx"
 
-#define BUFF 2048
+#ifndef WIN32
+#  include <unistd.h>
+#endif
 
-NetMsg::NetMsg(Net * net)
-  : net(net), next_id(0), done(false)
-{}
+// Bodies smaller than this are copied into the send buffer
+#define COPY 2048
+
+// Buffered frames are flushed once they reach this size, while a burst keeps
+// the write queue full its frames are gathered for up to LINGER microseconds
+#define FLUSH 65536
+#define LINGER 200
+
+// Streamed bodies are read and sent in pieces of this size, which is also
+// the largest frame sent when bodies are chunked
+#define CHUNK 65536
+
+// Flags in the first byte of a frame header, credit frames carry the
+// credit in place of the body length
+#define FRAME_SERVER 0x01
+#define FRAME_MORE 0x02
+#define FRAME_CREDIT 0x04
+
+// Marks a message the sender will never look up again, so the receiver
+// doesn't have to track it either. Only sent to peers which chunk bodies,
+// older ones would read it as a reply
+#define FRAME_ONCE 0x08
+
+// The body of the frame is the varint length of the original data followed
+// by the data compressed with zlib
+#define FRAME_COMPRESSED 0x10
+
+// Bodies smaller than this are never compressed, and larger ones are only
+// sent compressed if they shrink by at least a sixteenth
+#define ZIP_MIN 128
+#define ZIP_LEVEL Z_DEFAULT_COMPRESSION
+
+// Bytes of a body which may be in flight before the receiver grants more
+// credit, which it does once a quarter of the window has been consumed
+#define WINDOW 1048576
+#define GRANT (WINDOW / 4)
+
+// Size of a frame header, compact headers carry the id and length as
+// variable length integers so they take from 3 up to HEAD_MAX bytes
+#define HEAD 17
+#define HEAD_MAX 21
+
+// The receive buffer of a threaded connection, reactor connections are
+// serviced by one thread so they keep a smaller buffer each
+#define RECV 262144
+#define RECV_REACTOR 16384
+
+// The most memory reserved up front for a body before it arrives
+#define RESERVE 1048576
+
+// Finished messages kept for reuse on each connection, and the largest body
+// buffer they hold on to
+#define POOL 64
+#define KEEP 65536
+
+// Slots in the tables of in flight messages, ids only spill out of them
+// while more than this many are outstanding. Reactor connections are far
+// more numerous so they keep fewer each
+#define SLOTS 4096
+#define SLOTS_REACTOR 256
+
+// No asynchronous request is waiting on a deadline
+#define NEVER UINT64_MAX
+
+// The steady clock in milliseconds, which deadlines are measured against
+static uint64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::chrono::steady_clock::time_point until(uint64_t deadline)
+{
+  return std::chrono::steady_clock::time_point(
+    std::chrono::milliseconds(deadline));
+}
+
+static void write_file(int fd, const uint8_t * data, size_t size)
+{
+  int64_t wrote;
+  while (size > 0)
+    if ((wrote = ::write(fd, data, size)) > 0)
+      {
+        data += wrote;
+        size -= wrote;
+      }
+    else if (wrote < 0 && errno != EINTR)
+      throw std::string("Failed to write message body: ") + strerror(errno);
+}
+
+NetMsg::NetMsg(Net * net, bool threaded)
+  : net(net), client_msgs(threaded ? SLOTS : SLOTS_REACTOR),
+    server_msgs(threaded ? SLOTS : SLOTS_REACTOR), next_id(0),
+    threaded(threaded), done(false), broken(false), idle(false), features(0),
+    batch_bytes(FLUSH), batch_delay(LINGER), timeout(0), next_expiry(NEVER),
+    new_head(NULL), new_tail(NULL), rbuf(NULL),
+    rsize(threaded ? RECV : RECV_REACTOR), rstart(0), rend(0), body_msg(NULL),
+    body_len(0), body_new(false), body_more(false), body_zip(false),
+    body_held(false), in_body(false), deflating(false), inflating(false),
+    drainers(0)
+{
+  pool.reserve(POOL);
+}
 
 NetMsg::~NetMsg()
 {
   close();
 
+  // Threads writing out asynchronous replies may still be finishing
+  std::unique_lock<std::mutex> lock(read_lock);
+  while (drainers > 0)
+    drain_cond.wait(lock);
+  lock.unlock();
+
+  // Unmapped messages are only referenced by the queues, which are walked
+  // before the mapped ones they link through are gone
+  Msg *msg, *next_msg;
+  for (msg = new_head; msg != NULL; msg = next_msg)
+    {
+      next_msg = msg->next_new;
+      if (!msg->mapped)
+        delete msg;
+    }
+  for (msg = write_queue.take(); msg != NULL; msg = next_msg)
+    {
+      next_msg = msg->next;
+      if (!msg->mapped)
+        delete msg;
+    }
+
   // Cleanup leftover messages
-  for (auto it = client_msgs.begin(), end = client_msgs.end(); it != end; it++)
-    delete it->second;
-  for (auto it = server_msgs.begin(), end = server_msgs.end(); it != end; it++)
-    delete it->second;
+  client_msgs.each([](Msg * msg) { delete msg; });
+  server_msgs.each([](Msg * msg) { delete msg; });
+  for (auto it = pool.begin(), end = pool.end(); it != end; it++)
+    delete *it;
+  reap();
+
+  Grant *grant, *next;
+  for (grant = grants.take(); grant != NULL; grant = next)
+    {
+      next = grant->next;
+      delete grant;
+    }
+
+  delete[] rbuf;
+  if (deflating)
+    deflateEnd(&deflater);
+  if (inflating)
+    inflateEnd(&inflater);
 }
 
 void NetMsg::start()
 {
+  if (!threaded)
+    return;
+
   listen = std::thread(std::bind(&NetMsg::listen_thread, this));
   writer = std::thread(std::bind(&NetMsg::writer_thread, this));
 }
@@ -51,14 +195,173 @@ void NetMsg::close()
 {
   if (!done)
     {
-      // Clean up all of the threads
+      // Clean up all of the threads, shutdown wakes the blocked reader
       done = true;
+      net->shutdown();
       net->close();
       write_cond.notify_all();
+      set_broken();
+
+      if (listen.joinable())
+        listen.join();
+      if (writer.joinable())
+        writer.join();
+    }
+}
+
+bool NetMsg::receive()
+{
+  uint64_t avail;
+
+  // File bodies are spliced straight from the socket as they arrive
+  if (in_body && body_msg != NULL && body_msg->out_fd >= 0 && !body_zip &&
+      rstart == rend && (avail = net->available()) > 0)
+    {
+      avail = std::min(avail, body_len);
+      net->splice_to(body_msg->out_fd, avail);
+      body_len -= avail;
+      touch(body_msg);
+    }
+
+  // Otherwise pull in whatever the socket has
+  else if (!fill(false))
+    {
+      set_broken();
+      return false;
+    }
+
+  // Parse as many frames as possible
+  parse();
+
+  return true;
+}
+
+void NetMsg::set_notify(const std::function<void()> & notify)
+{
+  this->notify = notify;
+}
+
+void NetMsg::set_grant_notify(const std::function<void()> & notify)
+{
+  grant_notify = notify;
+}
+
+void NetMsg::send_grants()
+{
+  if (grants.empty())
+    return;
+
+  net_lock.lock();
+  try
+    {
+      if (write_grants())
+        net->flush();
+    }
+  catch(...)
+    {
+      net_lock.unlock();
+      throw;
+    }
+  net_lock.unlock();
+}
+
+void NetMsg::set_features(uint8_t features)
+{
+  this->features = features & NETMSG_FEATURES;
+
+  // Credit is only ever granted between chunks, and only chunks are small
+  // enough to compress in one go
+  if (!(this->features & NETMSG_CHUNKED))
+    this->features &= ~(NETMSG_CREDIT | NETMSG_COMPRESS);
+}
+
+void NetMsg::set_batch(size_t bytes, uint64_t delay)
+{
+  batch_bytes = bytes;
+  batch_delay = delay;
+}
+
+void NetMsg::set_timeout(uint64_t timeout)
+{
+  this->timeout = timeout;
+}
+
+void NetMsg::expire()
+{
+  std::vector<Msg *> expired;
+  std::vector<Callback> callbacks;
+  uint64_t time, next = NEVER;
+
+  if (next_expiry == NEVER || (time = now()) < next_expiry)
+    return;
+
+  // Collect the asynchronous requests which have run out of time, and find
+  // the next deadline among the rest
+  msgs_lock.lock();
+  read_lock.lock();
+  bool stalled = false;
+  auto check = [&](Msg * msg)
+    {
+      if (msg->deadline == 0 || msg->expired || !msg->callback)
+        return;
+      if (msg->deadline > time)
+        next = std::min(next, msg->deadline.load());
+      else if (streamed(msg))
+        stalled = true;
+      else
+        expired.push_back(msg);
+    };
+  client_msgs.each(check);
+  server_msgs.each(check);
+  for (auto it = expired.begin(), end = expired.end(); it != end; it++)
+    {
+      callbacks.push_back(Callback());
+      callbacks.back().swap((*it)->callback);
+      abandon(*it);
+    }
+  next_expiry = next;
+  read_lock.unlock();
+  msgs_lock.unlock();
+  if (stalled)
+    stall();
+
+  // Nothing else will ever see the messages, so they are let go of here
+  for (size_t i = 0; i < expired.size(); i++)
+    {
+      global_log.message("NetMsg: Request timed out", Log::NOTICE);
+      callbacks[i](NULL);
+      destroy(expired[i]);
+    }
+}
+
+bool NetMsg::cancel(uint64_t id)
+{
+  Callback callback;
+  Msg *msg = NULL;
 
-      listen.join();
-      writer.join();
+  msgs_lock.lock();
+  read_lock.lock();
+  Msg *found = client_msgs.find(id);
+  if (found != NULL && found->callback)
+    {
+      msg = found;
+      callback.swap(msg->callback);
+      abandon(msg);
     }
+  read_lock.unlock();
+  msgs_lock.unlock();
+
+  if (msg == NULL)
+    return false;
+
+  callback(NULL);
+  destroy(msg);
+  return true;
+}
+
+int NetMsg::get_fd() const
+{
+  return net->get_fd();
 }
 
 void NetMsg::send_only(const std::string & data)
@@ -68,31 +371,63 @@ void NetMsg::send_only(const std::string & data)
 
 Message *NetMsg::send_and_wait(const std::string & data)
 {
-  Msg *msg = send(data, false);
+  return send_and_wait(data, timeout);
+}
+
+Message *NetMsg::send_and_wait(const std::string & data, uint64_t timeout)
+{
+  Msg *msg = send(data, false, Callback(), timeout);
   global_log.message("Waiting on Message Response", Log::NOTICE);
   wait(msg);
 
   return msg;
 }
 
+uint64_t NetMsg::send_async(const std::string & data,
+                            const Callback & callback)
+{
+  return send_async(data, callback, timeout);
+}
+
+uint64_t NetMsg::send_async(const std::string & data,
+                            const Callback & callback, uint64_t timeout)
+{
+  // The message may be freed as soon as the callback runs, so the id is
+  // taken before it is sent
+  uint64_t id;
+  check_broken(send(data, false, callback, timeout, &id));
+  return id;
+}
+
+std::future<Message *> NetMsg::send_async(const std::string & data)
+{
+  auto promise = std::make_shared< std::promise<Message *> >();
+  send_async(data, fulfil(promise));
+  return promise->get_future();
+}
+
 Message *NetMsg::wait_new()
 {
   Msg *msg;
-  uint64_t id;
 
   global_log.message("Waiting for New Message", Log::NOTICE);
 
   read_lock.lock();
-  while(read_new.empty())
-    read_cond.wait(read_lock);
-  id = read_new.front();
-  read_new.pop();
+  while(new_head == NULL)
+    {
+      if (broken)
+        {
+          read_lock.unlock();
+          throw "Connection closed";
+        }
+      read_cond.wait(read_lock);
+    }
+  msg = new_head;
+  new_head = msg->next_new;
+  if (new_head == NULL)
+    new_tail = NULL;
   read_lock.unlock();
 
-  msgs_lock.lock();
-  msg = server_msgs.at(id);
-  msgs_lock.unlock();
-
   global_log.message("Processed New Message", Log::NOTICE);
 
   return msg;
@@ -102,19 +437,68 @@ Message *NetMsg::reply_and_wait(Message *message)
 {
   Msg *msg = (Msg*)message;
 
-  send(msg);
+  send(msg, timeout);
   wait(msg);
 
   return msg;
 }
 
+void NetMsg::reply_async(Message *message, const Callback & callback)
+{
+  Msg *msg = (Msg*)message;
+  msg->callback = callback;
+
+  send(msg, timeout);
+  check_broken(msg);
+}
+
+std::future<Message *> NetMsg::reply_async(Message *message)
+{
+  auto promise = std::make_shared< std::promise<Message *> >();
+  reply_async(message, fulfil(promise));
+  return promise->get_future();
+}
+
+void NetMsg::reply_async(Message *message, std::istream * in, size_t len,
+                         const Callback & callback)
+{
+  Msg *msg = (Msg*)message;
+  msg->in = in;
+  msg->in_len = len;
+  msg->callback = callback;
+
+  send(msg, timeout);
+  check_broken(msg);
+}
+
 Message *NetMsg::reply_and_wait(Message *message, std::istream * in, size_t len)
 {
   Msg *msg = (Msg*)message;
   msg->in = in;
   msg->in_len = len;
 
-  send(msg);
+  send(msg, timeout);
+  wait(msg);
+
+  return msg;
+}
+
+void NetMsg::reply_and_wait(Message *message, int fd)
+{
+  Msg *msg = (Msg*)message;
+  msg->out_fd = fd;
+
+  send(msg, timeout);
+  wait(msg);
+}
+
+Message *NetMsg::reply_and_wait(Message *message, int fd, size_t len)
+{
+  Msg *msg = (Msg*)message;
+  msg->in_fd = fd;
+  msg->in_len = len;
+
+  send(msg, timeout);
   wait(msg);
 
   return msg;
@@ -124,9 +508,54 @@ void NetMsg::reply_and_wait(Message *message, std::ostream * out)
 {
   Msg *msg = (Msg*)message;
   msg->out = out;
+  msg->drained = (features & NETMSG_CREDIT) != 0;
 
-  send(msg);
-  wait(msg);
+  send(msg, timeout);
+  if (msg->drained)
+    drain(msg, out);
+  else
+    wait(msg);
+}
+
+void NetMsg::reply_async(Message *message, std::ostream * out,
+                         const Callback & callback)
+{
+  Msg *msg = (Msg*)message;
+  msg->out = out;
+  if (!threaded || !(features & NETMSG_CREDIT))
+    {
+      msg->callback = callback;
+      send(msg, timeout);
+      check_broken(msg);
+      return;
+    }
+
+  // The body is written out on a thread of its own, so a slow stream holds
+  // up neither the listener nor the other replies, and the remote end only
+  // gets credit for what has been written
+  msg->drained = true;
+  read_lock.lock();
+  drainers++;
+  read_lock.unlock();
+  send(msg, timeout);
+  std::thread([this, msg, out, callback]()
+    {
+      Msg *written = msg;
+      try
+        {
+          drain(msg, out);
+        }
+      catch(...)
+        {
+          written = NULL;
+        }
+      callback(written);
+
+      read_lock.lock();
+      drainers--;
+      drain_cond.notify_all();
+      read_lock.unlock();
+    }).detach();
 }
 
 void NetMsg::reply_only(Message *message)
@@ -141,10 +570,10 @@ void NetMsg::destroy(Message *message)
 {
   Msg *msg = (Msg*)message;
   msgs_lock.lock();
-  if (msg->server)
-    server_msgs.erase(msg->id);
-  else
-    client_msgs.erase(msg->id);
+  if (msg->mapped && !msg->expired)
+    (msg->server ? server_msgs : client_msgs).erase(msg->id);
+  if (--msg->refs == 0)
+    release(msg);
   msgs_lock.unlock();
 }
 
@@ -160,236 +589,1145 @@ void NetMsg::Msg::set(const std::string & msg)
 
 void NetMsg::writer_thread()
 {
-  Msg *msg;
-  std::pair<uint64_t, bool> id;
-
-  write_lock.lock();
-  while (!done)
-    {
-      // Get messages which need writing, or wait for new ones
-      if (!write_queue.empty())
-        {
-          id = write_queue.front();
-          write_queue.pop();
-          write_lock.unlock();
-        }
-      else
-        {
-          write_cond.wait(write_lock);
-          continue;
-        }
-
-     // Get the message data from the id
-      msgs_lock.lock();
-      if (id.second)
-        msg = server_msgs.at(id.first);
-      else
-        msg = client_msgs.at(id.first);
-      msgs_lock.unlock();
-
-      // Process the message and send to the server
-      net->write8(!msg->server);
-      global_log.message(std::string("Sent message: ") +
-                         std::to_string(id.first), Log::NOTICE);
-      net->write64(msg->id);
-      if (msg->in == NULL)
-        {
-          net->write64(msg->msg.length());
-          net->write((uint8_t*)msg->msg.data(), msg->msg.length());
-        }
-      else
-        {
-          net->write64(msg->in_len);
-          uint64_t len = msg->in_len, writen;
-          uint8_t buff[BUFF];
-          while (len > 0)
-            {
-              writen = BUFF > len ? len : BUFF;
-              writen = msg->in->readsome((char*)buff, BUFF);
-              net->write(buff, writen);
-              len -= writen;
-            }
-          msg->in = NULL;
-        }
-
-      // Delete the message if needed
-      if (msg->del)
-        {
-          destroy(msg);
-          delete msg;
-        }
-
-      // Relock to process write queue
-      write_lock.lock();
-    }
-  write_lock.unlock();
-}
+  std::vector<Msg *> batch, bulk, sent, held;
+  Msg *msg, *next_msg;
+  std::chrono::steady_clock::time_point deadline;
+  bool batching = false, granted;
 
-void NetMsg::listen_thread()
-{
   try
     {
-      bool server, ne;
-      uint64_t id, len, red;
-      uint8_t buff[BUFF];
-      Msg *msg;
-
-      global_log.message("Listening for net events", Log::NOTICE);
-      while(true)
+      while (!done)
         {
-          // Get the message meta data
-          server = (bool)net->read8();
-          id = net->read64();
-          len = net->read64();
-          ne = false;
-
-          global_log.message(std::string("Listen thread got message: ") +
-                             std::to_string(id), Log::NOTICE);
-          global_log.message(std::string("Message Len: ") + std::to_string(len),
-                             Log::NOTICE);
-
-          // The message was initiated from the server
-          if (server)
+          // Asynchronous requests are failed once they run out of time
+          expire();
+
+          // Only sleep once there is nothing left to write, senders check
+          // idle so they only wake the writer when it needs it. A new
+          // deadline always comes with a message, so it is never missed
+          if (write_queue.empty() && grants.empty() && bulk.empty())
             {
-              if (server_msgs.count(id) > 0)
-                {
-                  msgs_lock.lock();
-                  msg = server_msgs[id];
-                  msgs_lock.unlock();
-                }
-              else
+              write_lock.lock();
+              idle = true;
+              if (write_queue.empty() && grants.empty() && !done)
                 {
-                  msg = new Msg;
-                  msg->del = false;
-                  msg->server = true;
-                  msg->out = NULL;
-                  msg->in = NULL;
-                  msg->id = id;
-                  msgs_lock.lock();
-                  server_msgs[id] = msg;
-                  msgs_lock.unlock();
-                  ne = true;
+                  uint64_t expiry = next_expiry;
+                  if (expiry == NEVER)
+                    write_cond.wait(write_lock);
+                  else
+                    write_cond.wait_until(write_lock, until(expiry));
                 }
+              idle = false;
+              write_lock.unlock();
+              continue;
             }
 
-          // The messages was initiated from the client
-          else
+          // Credit goes first so the remote senders are kept busy
+          granted = write_grants();
+
+          // Take every message which needs writing
+          for (msg = write_queue.take(); msg != NULL; msg = next_msg)
             {
-              if (client_msgs.count(id) > 0)
-                {
-                  msgs_lock.lock();
-                  msg = client_msgs[id];
-                  msgs_lock.unlock();
-                }
-              else
-                {
-                  global_log.message("NetMsg: Invalid Packet", Log::WARNING);
-                  while(len > 0)
-                    {
-                      red = BUFF > len ? len : BUFF;
-                      net->read_all(buff, red);
-                      len -= red;
-                    }
-                  continue;
-                }
+              next_msg = msg->next;
+              batch.push_back(msg);
             }
 
-          // Process the message
-          msg->msg.clear();
-          if (msg->out != NULL)
+          // The first frames in the buffer start the clock on the batch
+          if (!batching)
             {
-              while(len > 0)
-                {
-                  red = BUFF > len ? len : BUFF;
-                  net->read_all(buff, red);
-                  msg->out->write((char*)buff, red);
-                  len -= red;
-                }
-              msg->out = NULL;
+              batching = true;
+              deadline = std::chrono::steady_clock::now() +
+                std::chrono::microseconds(batch_delay);
             }
-          else
+
+          // Large bodies get one chunk per pass after the new frames so
+          // they never hold up the rest of the traffic
+          batch.insert(batch.end(), bulk.begin(), bulk.end());
+          bulk.clear();
+
+          // Coalesce the frames into as few sends as possible
+          for (auto it = batch.begin(), end = batch.end(); it != end; it++)
             {
-              while(len > 0)
-                {
-                  red = BUFF > len ? len : BUFF;
-                  net->read_all(buff, red);
-                  msg->msg.append((char*)buff, red);
-                  len -= red;
-                }
-            }
+              // Bodies without credit wait until the remote end grants more
+              if (!has_credit(*it))
+                continue;
 
-          // Inform the waiting threads of an update
-          read_lock.lock();
-          if (ne)
-            read_new.push(id);
-          else if (server)
-            server_read_done.insert(id);
-          else
-            client_read_done.insert(id);
-          global_log.message(std::to_string(ne),
-                             Log::DEBUG);
-          read_lock.unlock();
-          read_cond.notify_all();
+              // Once its last frame is out the remote end may answer and
+              // the message be reused, so nothing is read from it after
+              // unless the writer holds it
+              bool del = (*it)->del, hold = (*it)->held;
+              if (!write_msg(*it))
+                bulk.push_back(*it);
+              else if (del)
+                sent.push_back(*it);
+              else if (hold)
+                held.push_back(*it);
+              if (net->queued() >= batch_bytes)
+                net->flush();
+            }
+          batch.clear();
 
-          global_log.message("Finished Reading", Log::DEBUG);
+          // While a burst keeps the queue full its frames go out together,
+          // until the buffer fills or the batch gets too old. Nothing ever
+          // waits for more to arrive, and credit is never held back
+          if (!granted && !write_queue.empty() &&
+              net->queued() < batch_bytes &&
+              std::chrono::steady_clock::now() < deadline)
+            continue;
+          batching = false;
+          flush(sent, held);
         }
     }
   catch(const char * e)
-    {}
+    {
+      global_log.message(std::string("NetMsg: ") + e, Log::WARNING);
+      set_broken();
+    }
   catch(const std::string & e)
-    {}
+    {
+      global_log.message(std::string("NetMsg: ") + e, Log::WARNING);
+      set_broken();
+    }
 }
 
-NetMsg::Msg *NetMsg::send(const std::string & data, bool del)
+void NetMsg::flush(std::vector<Msg *> & sent, std::vector<Msg *> & held)
 {
-  // Create the message structure
-  Msg *msg = new Msg;
-
-  msgs_lock.lock();
-  msg->server = false;
-  msg->del = del;
-  msg->id = next_id++;
-  msg->msg = data;
-  msg->out = NULL;
-  msg->in = NULL;
-  client_msgs[msg->id] = msg;
-  msgs_lock.unlock();
-
-  send(msg);
+  net->flush();
 
-  return msg;
+  // Messages can only be freed once their bodies are sent
+  for (auto it = sent.begin(), end = sent.end(); it != end; it++)
+    destroy(*it);
+  sent.clear();
+  for (auto it = held.begin(), end = held.end(); it != end; it++)
+    drop(*it);
+  held.clear();
 }
 
-void NetMsg::send(Msg * msg)
+bool NetMsg::write_msg(Msg * msg)
 {
-  write_lock.lock();
-  write_queue.push(std::pair<uint64_t, bool>(msg->id, msg->server));
-  write_lock.unlock();
-  write_cond.notify_all();
-}
+  uint8_t buff[CHUNK];
+  uint64_t len, offset = msg->sent;
+  std::istream *in = msg->in;
+  int in_fd = msg->in_fd;
+  bool more = false;
 
-void NetMsg::wait(Msg * msg)
-{
-  read_lock.lock();
-  if (msg->server)
+  // Work out how much of the body goes in this frame
+  if (in == NULL && in_fd < 0)
+    len = msg->msg.length() - offset;
+  else
+    len = msg->in_len - offset;
+  if ((features & NETMSG_CHUNKED) && len > CHUNK)
     {
-      while(server_read_done.count(msg->id) == 0)
+      len = CHUNK;
+      more = true;
+    }
+
+  // Never send more than the remote end has room for
+  if (features & NETMSG_CREDIT)
+    {
+      write_lock.lock();
+      if (len > msg->credit)
         {
-          global_log.message(std::string("Waiting: ") +
-                             std::to_string(msg->id), Log::DEBUG);
-          read_cond.wait(read_lock);
+          len = msg->credit;
+          more = true;
         }
-      server_read_done.erase(msg->id);
+      msg->credit -= len;
+      write_lock.unlock();
     }
+
+  uint8_t flags = (msg->server ? 0 : FRAME_SERVER) | (more ? FRAME_MORE : 0);
+  if (!msg->mapped && (features & NETMSG_CHUNKED))
+    flags |= FRAME_ONCE;
+
+  // Compress the frame unless the body has already shown it doesn't shrink,
+  // the chunk is gathered from streams and files so it can be compressed
+  const uint8_t *data = NULL;
+  if ((features & NETMSG_COMPRESS) && len >= ZIP_MIN && !msg->plain)
+    {
+      if (in == NULL && in_fd < 0)
+        data = (uint8_t*)msg->msg.data() + offset;
+      else
+        {
+          read_body(in, in_fd, buff, len);
+          data = buff;
+        }
+
+      if (zip(data, len))
+        flags |= FRAME_COMPRESSED;
+      else
+        msg->plain = true;
+    }
+
+  // Queue the frame header, small bodies are copied in after it
+  write_head(flags, msg->id,
+             (flags & FRAME_COMPRESSED) ? zip_out.length() : len);
+  touch(msg);
+  if (global_log.enabled(Log::NOTICE))
+    global_log.message(std::string("Sent message: ") +
+                       std::to_string(msg->id), Log::NOTICE);
+
+  // The message is finished with before the last of it goes out, as the
+  // reply can arrive and the message be reused as soon as it does
+  if (more)
+    msg->sent += len;
+  else
+    {
+      msg->sent = 0;
+      msg->in = NULL;
+      msg->in_fd = -1;
+    }
+
+  if (flags & FRAME_COMPRESSED)
+    net->queue((uint8_t*)zip_out.data(), zip_out.length());
+  else if (in == NULL && in_fd < 0)
+    net->queue((uint8_t*)msg->msg.data() + offset, len, len < COPY);
+
+  // Chunks which were read to be compressed are sent as they are
+  else if (data != NULL)
+    net->queue(data, len);
+
+  // Files go straight from the page cache to the socket
+  else if (in_fd >= 0)
+    net->send_file(in_fd, len);
+
+  // Stream the body out, the first chunk goes in the same send as the header
+  else
+    {
+      uint64_t left = len;
+      int64_t red;
+      while (left > 0)
+        {
+          in->read((char*)buff, left < CHUNK ? left : CHUNK);
+          if ((red = in->gcount()) <= 0)
+            throw "Message stream ended before its length";
+          net->queue(buff, red, false);
+          net->flush();
+          left -= red;
+        }
+    }
+
+  return !more;
+}
+
+void NetMsg::read_body(std::istream * in, int in_fd, uint8_t * buff,
+                       uint64_t len)
+{
+  int64_t red;
+
+  while (len > 0)
+    {
+      if (in != NULL)
+        {
+          in->read((char*)buff, len);
+          red = in->gcount();
+        }
+      else if ((red = ::read(in_fd, buff, len)) < 0 && errno == EINTR)
+        continue;
+      if (red <= 0)
+        throw "Message stream ended before its length";
+      buff += red;
+      len -= red;
+    }
+}
+
+bool NetMsg::zip(const uint8_t * data, uint64_t len)
+{
+  size_t head = 0;
+
+  if (!deflating)
+    {
+      memset(&deflater, 0, sizeof(deflater));
+      if (deflateInit(&deflater, ZIP_LEVEL) != Z_OK)
+        throw "Failed to start compression";
+      deflating = true;
+    }
+  else
+    deflateReset(&deflater);
+
+  // The original length goes first so the receiver can size its buffer
+  zip_out.resize(10 + deflateBound(&deflater, len));
+  Write::var(len, (uint8_t*)&zip_out[0], head);
+  deflater.next_in = (Bytef*)data;
+  deflater.avail_in = len;
+  deflater.next_out = (Bytef*)&zip_out[head];
+  deflater.avail_out = zip_out.length() - head;
+  if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+    return false;
+  zip_out.resize(zip_out.length() - deflater.avail_out);
+
+  return zip_out.length() <= len - len / 16;
+}
+
+void NetMsg::unzip(Msg * msg)
+{
+  uint8_t *data = (uint8_t*)zip_in.data();
+  size_t size = zip_in.length();
+  uint64_t len = Read::var(data, size);
+  if (len > CHUNK)
+    throw "Compressed frame is too large";
+
+  if (!inflating)
+    {
+      memset(&inflater, 0, sizeof(inflater));
+      if (inflateInit(&inflater) != Z_OK)
+        throw "Failed to start decompression";
+      inflating = true;
+    }
+  else
+    inflateReset(&inflater);
+
+  unzipped.resize(len);
+  inflater.next_in = data;
+  inflater.avail_in = size;
+  inflater.next_out = (Bytef*)&unzipped[0];
+  inflater.avail_out = len;
+  if (inflate(&inflater, Z_FINISH) != Z_STREAM_END || inflater.avail_out > 0)
+    throw "Failed to decompress frame";
+
+  deliver(msg, (uint8_t*)unzipped.data(), len);
+  if (body_more && !msg->drained && (features & NETMSG_CREDIT))
+    msg->consumed += len;
+}
+
+void NetMsg::deliver(Msg * msg, const uint8_t * data, size_t len)
+{
+  touch(msg);
+  if (msg->out_fd >= 0)
+    write_file(msg->out_fd, data, len);
+  else if (msg->drained)
+    {
+      read_lock.lock();
+      msg->pending.append((char*)data, len);
+      msg->cond.notify_one();
+      read_lock.unlock();
+    }
+  else if (msg->out != NULL)
+    msg->out->write((char*)data, len);
+  else
+    msg->msg.append((char*)data, len);
+}
+
+bool NetMsg::write_grants()
+{
+  Grant *grant, *next;
+  bool any = false;
+
+  for (grant = grants.take(); grant != NULL; grant = next)
+    {
+      next = grant->next;
+      try
+        {
+          write_grant(*grant);
+        }
+      catch(...)
+        {
+          // The rest are dropped along with the connection
+          for (; grant != NULL; grant = next)
+            {
+              next = grant->next;
+              delete grant;
+            }
+          throw;
+        }
+      delete grant;
+      any = true;
+    }
+  return any;
+}
+
+void NetMsg::write_grant(const Grant & grant)
+{
+  write_head((grant.server ? 0 : FRAME_SERVER) | FRAME_CREDIT, grant.id,
+             grant.credit);
+}
+
+void NetMsg::write_head(uint8_t flags, uint64_t id, uint64_t len)
+{
+  uint8_t head[HEAD_MAX];
+  size_t head_len = 0;
+
+  Write::i8(flags, head, head_len);
+  if (features & NETMSG_COMPACT)
+    {
+      Write::var(id, head, head_len);
+      Write::var(len, head, head_len);
+    }
+  else
+    {
+      Write::i64(id, head, head_len);
+      Write::i64(len, head, head_len);
+    }
+  net->queue(head, head_len);
+}
+
+bool NetMsg::read_head(uint8_t & flags, uint64_t & id, uint64_t & len)
+{
+  uint8_t *head = rbuf + rstart;
+  size_t head_len = rend - rstart, i = 1;
+
+  if (!(features & NETMSG_COMPACT))
+    {
+      if (head_len < HEAD)
+        return false;
+    }
+
+  // Wait until both integers have arrived before decoding them
+  else
+    for (int ends = 0; ends < 2; i++)
+      {
+        if (i >= head_len)
+          return false;
+        if (i >= HEAD_MAX)
+          throw "Invalid frame header";
+        if (!(head[i] & 0x80))
+          ends++;
+      }
+
+  flags = Read::i8(head, head_len);
+  if (features & NETMSG_COMPACT)
+    {
+      id = Read::var(head, head_len);
+      len = Read::var(head, head_len);
+    }
+  else
+    {
+      id = Read::i64(head, head_len);
+      len = Read::i64(head, head_len);
+    }
+  rstart = head - rbuf;
+  return true;
+}
+
+bool NetMsg::has_credit(Msg * msg)
+{
+  bool ret;
+
+  if (!(features & NETMSG_CREDIT))
+    return true;
+
+  write_lock.lock();
+  ret = msg->credit > 0;
+  if (!ret)
+    msg->parked = true;
+  write_lock.unlock();
+
+  return ret;
+}
+
+void NetMsg::grant(Msg * msg, uint64_t credit)
+{
+  Grant *grant = new Grant;
+  grant->id = msg->id;
+  grant->server = msg->server;
+  grant->credit = credit;
+
+  grants.push(grant);
+
+  // Without a writer thread this may be the reactor's poller, which would
+  // stall every connection if it blocked on a client which stopped reading
+  if (!threaded)
+    {
+      if (grant_notify)
+        grant_notify();
+      else
+        send_grants();
+      return;
+    }
+  wake();
+}
+
+void NetMsg::add_credit(bool server, uint64_t id, uint64_t credit)
+{
+  msgs_lock.lock();
+  Msg *msg = (server ? server_msgs : client_msgs).find(id);
+  if (msg != NULL)
+    {
+      bool parked;
+      touch(msg);
+      write_lock.lock();
+      msg->credit += credit;
+      parked = msg->parked;
+      msg->parked = false;
+      write_lock.unlock();
+
+      // Give a parked message back to the writer, or wake the sender
+      if (parked)
+        {
+          write_queue.push(msg);
+          wake();
+        }
+      else if (!threaded)
+        write_cond.notify_all();
+    }
+  msgs_lock.unlock();
+}
+
+void NetMsg::drain(Msg * msg, std::ostream * out)
+{
+  std::unique_lock<std::mutex> lock(read_lock);
+  std::string data;
+  uint64_t consumed = 0;
+  bool finished;
+
+  while (true)
+    {
+      finished = msg->ready;
+      if (!msg->pending.empty())
+        {
+          // Write outside of the lock so the listener keeps going
+          data.swap(msg->pending);
+          lock.unlock();
+          out->write(data.data(), data.length());
+          consumed += data.length();
+          data.clear();
+          touch(msg);
+
+          // Let the remote end send more now there is room for it
+          if (!finished && consumed >= GRANT)
+            {
+              grant(msg, consumed);
+              consumed = 0;
+            }
+          lock.lock();
+        }
+      else if (finished)
+        break;
+      else if (broken)
+        throw "Connection closed";
+      else if (msg->deadline == 0)
+        msg->cond.wait(lock);
+      else if (msg->cond.wait_until(lock, until(msg->deadline)) ==
+               std::cv_status::timeout && msg->pending.empty() &&
+               !msg->ready)
+        time_out(msg, lock);
+    }
+  msg->ready = false;
+}
+
+void NetMsg::listen_thread()
+{
+  try
+    {
+      global_log.message("Listening for net events", Log::NOTICE);
+      while (fill(true))
+        parse();
+    }
+  catch(const char * e)
+    {}
+  catch(const std::string & e)
+    {}
+
+  set_broken();
+}
+
+bool NetMsg::fill(bool block)
+{
+  if (rbuf == NULL)
+    rbuf = new uint8_t[rsize];
+
+  // Keep the unparsed bytes at the front so headers are contiguous
+  if (rstart == rend)
+    rstart = rend = 0;
+  else if (rstart > 0 && rsize - rend < rsize / 4)
+    {
+      memmove(rbuf, rbuf + rstart, rend - rstart);
+      rend -= rstart;
+      rstart = 0;
+    }
+
+  int64_t red;
+  if (block)
+    red = net->read(rbuf + rend, rsize - rend);
+  else if ((red = net->read_ready(rbuf + rend, rsize - rend)) == 0)
+    return true;
+  if (red <= 0)
+    return false;
+
+  rend += red;
+  return true;
+}
+
+void NetMsg::parse()
+{
+  uint64_t n;
+
+  // Nothing found without the lock is held onto between calls
+  reap();
+
+  while (true)
+    {
+      // Decode the frame header straight out of the buffer
+      if (!in_body)
+        {
+          uint8_t flags;
+          uint64_t id;
+          if (!read_head(flags, id, body_len))
+            return;
+
+          if (flags & FRAME_CREDIT)
+            {
+              add_credit(flags & FRAME_SERVER, id, body_len);
+              body_len = 0;
+              continue;
+            }
+
+          body_msg = begin_frame(flags & FRAME_SERVER, id, flags & FRAME_ONCE,
+                                 flags & FRAME_MORE, body_new);
+          body_more = flags & FRAME_MORE;
+          body_zip = flags & FRAME_COMPRESSED;
+          in_body = true;
+          zip_in.clear();
+
+          // Bodies the listener writes out are consumed as they arrive,
+          // those drained by the waiting thread are counted by it.
+          // Compressed frames are counted once they are unpacked
+          if (body_msg != NULL && body_more && !body_msg->drained &&
+              !body_zip && (features & NETMSG_CREDIT))
+            body_msg->consumed += body_len;
+
+          // Size the body up front so it is rarely regrown
+          if (body_msg != NULL && !body_msg->partial &&
+              body_msg->out == NULL && body_msg->out_fd < 0)
+            body_msg->msg.reserve(std::min(body_len, (uint64_t)RESERVE));
+        }
+
+      // Hand the buffered body bytes to the message, invalid ones are dropped
+      n = std::min(body_len, (uint64_t)(rend - rstart));
+      if (body_msg != NULL && n > 0 && body_zip)
+        zip_in.append((char*)rbuf + rstart, n);
+      else if (body_msg != NULL && n > 0)
+        deliver(body_msg, rbuf + rstart, n);
+      rstart += n;
+      body_len -= n;
+
+      // The rest of a file body skips the receive buffer entirely, the
+      // reactor splices it as it arrives in receive() instead
+      if (body_len > 0 && threaded && body_msg != NULL &&
+          body_msg->out_fd >= 0 && !body_zip)
+        {
+          net->splice_to(body_msg->out_fd, body_len);
+          body_len = 0;
+        }
+
+      if (body_len > 0)
+        return;
+
+      // Compressed frames can only be unpacked once all of them is here
+      if (body_msg != NULL && body_zip)
+        unzip(body_msg);
+
+      // Only the last chunk of a body completes the message
+      if (body_msg != NULL)
+        {
+          body_msg->partial = body_more;
+          body_msg->partial_new = body_new;
+          if (!body_more)
+            finish_frame(body_msg, body_new);
+          else if (body_msg->consumed >= GRANT)
+            {
+              grant(body_msg, body_msg->consumed);
+              body_msg->consumed = 0;
+            }
+        }
+      if (body_held)
+        drop(body_msg);
+      body_msg = NULL;
+      body_held = false;
+      in_body = false;
+    }
+}
+
+NetMsg::Msg *NetMsg::begin_frame(bool server, uint64_t id, bool once,
+                                 bool more, bool & ne)
+{
+  Msg *msg = NULL;
+
+  if (global_log.enabled(Log::NOTICE))
+    global_log.message(std::string("Got message: ") + std::to_string(id),
+                       Log::NOTICE);
+
+  ne = false;
+  body_held = false;
+
+  // Replies to our requests and the later frames of the remote end's
+  // messages are found without the lock. Their owner can't let go of them
+  // until they arrive, unless they may expire so they are pinned below
+  if (!once)
+    {
+      Slots<Msg> & msgs = server ? server_msgs : client_msgs;
+      msg = msgs.find(id);
+      if (msg != NULL && !msg->held.load(std::memory_order_relaxed) &&
+          msgs.find(id) == msg)
+        return resume(msg, ne);
+      msg = NULL;
+    }
+
+  msgs_lock.lock();
+
+  // One way messages are never looked up again so they aren't tracked
+  if (server && once)
+    {
+      msg = alloc();
+      msg->server = true;
+      msg->id = id;
+      msg->mapped = false;
+      ne = true;
+    }
+
+  // The message was initiated from the server
+  else if (server)
+    {
+      Msg *found = server_msgs.find(id);
+
+      // Nobody is waiting for the reply anymore so it is skipped, and the
+      // message is let go of once the last of it has arrived
+      if (found != NULL && found->expired)
+        {
+          if (!more)
+            {
+              server_msgs.erase(id);
+              found->mapped = false;
+              if (--found->refs == 0)
+                release(found);
+            }
+        }
+      else if (found != NULL)
+        msg = found;
+      else
+        {
+          msg = alloc();
+          msg->server = true;
+          msg->id = id;
+          server_msgs.insert(id, msg);
+          msg->indexed = true;
+          ne = true;
+        }
+    }
+
+  // The messages was initiated from the client
+  else
+    {
+      msg = client_msgs.find(id);
+      if (msg == NULL && id < next_id)
+        global_log.message("NetMsg: Dropped late reply", Log::NOTICE);
+      else if (msg == NULL)
+        global_log.message("NetMsg: Invalid Packet", Log::WARNING);
+    }
+
+  // A message which can expire is kept alive until its frame is finished
+  body_held = msg != NULL && msg->held;
+  if (body_held)
+    msg->refs++;
+
+  msgs_lock.unlock();
+
+  return msg == NULL ? NULL : resume(msg, ne);
+}
+
+NetMsg::Msg *NetMsg::resume(Msg * msg, bool & ne)
+{
+  // Chunks after the first are appended to the body
+  if (msg->partial)
+    ne = msg->partial_new;
   else
     {
-      while(client_read_done.count(msg->id) == 0)
+      msg->msg.clear();
+      msg->consumed = 0;
+    }
+  return msg;
+}
+
+void NetMsg::finish_frame(Msg * msg, bool ne)
+{
+  msg->out = NULL;
+  msg->out_fd = -1;
+  msg->drained = false;
+
+  // Only the thread waiting on the message is woken, it is notified under
+  // the lock as the message may be freed as soon as the waiter sees it
+  Callback callback;
+  read_lock.lock();
+  if (ne)
+    {
+      msg->next_new = NULL;
+      if (new_tail == NULL)
+        new_head = msg;
+      else
+        new_tail->next_new = msg;
+      new_tail = msg;
+    }
+  else if (msg->callback)
+    callback.swap(msg->callback);
+  else
+    {
+      msg->ready = true;
+      msg->cond.notify_one();
+    }
+  if (!ne)
+    msg->deadline = 0;
+  read_lock.unlock();
+  if (ne)
+    read_cond.notify_one();
+  if (callback)
+    callback(msg);
+
+  if (ne && notify)
+    notify();
+}
+
+void NetMsg::set_broken()
+{
+  std::vector<Callback> callbacks;
+
+  // Wake every thread waiting on a message and collect the callbacks
+  msgs_lock.lock();
+  read_lock.lock();
+  broken = true;
+  auto fail = [&](Msg * msg)
+    {
+      msg->cond.notify_all();
+      if (msg->callback)
         {
-          global_log.message(std::string("Waiting: ") +
-                             std::to_string(msg->id), Log::DEBUG);
-          read_cond.wait(read_lock);
+          callbacks.push_back(Callback());
+          callbacks.back().swap(msg->callback);
+        }
+    };
+  client_msgs.each(fail);
+  server_msgs.each(fail);
+  read_lock.unlock();
+  msgs_lock.unlock();
+  read_cond.notify_all();
+
+  // The replies are never coming
+  for (auto it = callbacks.begin(), end = callbacks.end(); it != end; it++)
+    (*it)(NULL);
+
+  // Wake any senders waiting on credit
+  write_lock.lock();
+  write_lock.unlock();
+  write_cond.notify_all();
+}
+
+NetMsg::Msg *NetMsg::send(const std::string & data, bool del,
+                          const Callback & callback, uint64_t timeout,
+                          uint64_t * id)
+{
+  // Create the message structure, one way messages which fit in a single
+  // frame never receive credit so nothing needs to find them by id
+  msgs_lock.lock();
+  Msg *msg = alloc();
+  msg->server = false;
+  msg->del = del;
+  msg->id = next_id++;
+  msg->mapped = !del ||
+    ((features & NETMSG_CHUNKED) && data.length() > CHUNK);
+  if (msg->mapped)
+    {
+      client_msgs.insert(msg->id, msg);
+      msg->indexed = true;
+    }
+  msg->callback = callback;
+  if (id != NULL)
+    *id = msg->id;
+  msgs_lock.unlock();
+
+  // The body reuses the buffer of the pooled message
+  msg->msg.assign(data);
+
+  send(msg, timeout);
+
+  return msg;
+}
+
+void NetMsg::send(Msg * msg, uint64_t timeout)
+{
+  // Requests which may be given up on are held while they are sent, so
+  // they outlive their owner if it stops waiting. Deadlines are cleared as
+  // replies arrive, so only a held message ever has one
+  bool held = timeout > 0 || msg->callback;
+  msg->held.store(held, std::memory_order_relaxed);
+  if (held)
+    {
+      msgs_lock.lock();
+      msg->refs++;
+      msg->deadline = timeout > 0 ? now() + timeout : 0;
+      if (msg->callback && msg->deadline > 0 && msg->deadline < next_expiry)
+        next_expiry = msg->deadline.load();
+      msgs_lock.unlock();
+    }
+
+  // Without a writer thread the sender writes the frame itself, the lock
+  // is dropped between chunks so other senders can get a word in
+  if (!threaded)
+    {
+      bool finished, del = msg->del;
+      msg->credit = WINDOW;
+      do
+        {
+          // Wait for the remote end to make room for more of the body
+          if (features & NETMSG_CREDIT)
+            {
+              write_lock.lock();
+              while (msg->credit == 0 && !broken)
+                if (msg->deadline == 0)
+                  write_cond.wait(write_lock);
+                else if (write_cond.wait_until(write_lock,
+                                               until(msg->deadline)) ==
+                         std::cv_status::timeout && msg->credit == 0 &&
+                         now() >= msg->deadline)
+                  {
+                    write_lock.unlock();
+                    stall();
+                    write_lock.lock();
+                  }
+              write_lock.unlock();
+              if (broken)
+                throw "Connection closed";
+            }
+
+          net_lock.lock();
+          try
+            {
+              // Credit waiting to go out rides along with the frame
+              write_grants();
+              finished = write_msg(msg);
+              net->flush();
+            }
+          catch(...)
+            {
+              // The frame may be cut short, nothing after it can be read
+              // so let the reactor close the connection
+              net->shutdown();
+              net_lock.unlock();
+              throw;
+            }
+          net_lock.unlock();
         }
-      client_read_done.erase(msg->id);
+      while (!finished);
+
+      if (del)
+        destroy(msg);
+      else if (held)
+        drop(msg);
+      return;
+    }
+
+  msg->credit = WINDOW;
+  msg->parked = false;
+  write_queue.push(msg);
+  wake();
+}
+
+NetMsg::Msg *NetMsg::alloc()
+{
+  Msg *msg;
+
+  if (pool.empty())
+    msg = new Msg;
+  else
+    {
+      msg = pool.back();
+      pool.pop_back();
+    }
+
+  msg->del = false;
+  msg->out = NULL;
+  msg->drained = false;
+  msg->in = NULL;
+  msg->in_fd = -1;
+  msg->out_fd = -1;
+  msg->sent = 0;
+  msg->partial = false;
+  msg->credit = 0;
+  msg->consumed = 0;
+  msg->parked = false;
+  msg->ready = false;
+  msg->mapped = true;
+  msg->plain = false;
+  msg->deadline = 0;
+  msg->expired = false;
+  msg->held.store(false, std::memory_order_relaxed);
+  msg->indexed = false;
+  msg->refs = 1;
+  return msg;
+}
+
+void NetMsg::release(Msg * msg)
+{
+  // The listener may still be looking at a message which was in a table,
+  // so it is only deleted once the listener is between frames
+  if (pool.size() >= POOL && msg->indexed)
+    {
+      graveyard.push(msg);
+      return;
+    }
+  else if (pool.size() >= POOL)
+    {
+      delete msg;
+      return;
+    }
+
+  // Keep the body buffers unless they grew too large to hang on to
+  msg->callback = nullptr;
+  if (msg->msg.capacity() > KEEP)
+    std::string().swap(msg->msg);
+  else
+    msg->msg.clear();
+  if (msg->pending.capacity() > KEEP)
+    std::string().swap(msg->pending);
+  else
+    msg->pending.clear();
+  pool.push_back(msg);
+}
+
+void NetMsg::reap()
+{
+  Msg *msg, *next_msg;
+
+  // Skips the exchange on every parse while nothing was let go of
+  if (graveyard.empty())
+    return;
+  for (msg = graveyard.take(); msg != NULL; msg = next_msg)
+    {
+      next_msg = msg->next;
+      delete msg;
     }
+}
+
+void NetMsg::wake()
+{
+  // Taking the lock means the writer is either waiting or yet to recheck
+  // the queues, so the notify can't be lost
+  if (idle)
+    {
+      write_lock.lock();
+      write_lock.unlock();
+      write_cond.notify_one();
+    }
+}
+
+void NetMsg::check_broken(Msg * msg)
+{
+  Callback callback;
+
+  read_lock.lock();
+  if (broken)
+    callback.swap(msg->callback);
   read_lock.unlock();
+
+  if (callback)
+    callback(NULL);
+}
+
+NetMsg::Callback NetMsg::fulfil(const std::shared_ptr< std::promise<Message *> > &
+                                promise)
+{
+  return [promise](Message * msg)
+    {
+      if (msg == NULL)
+        promise->set_exception(std::make_exception_ptr("Connection closed"));
+      else
+        promise->set_value(msg);
+    };
+}
+
+void NetMsg::wait(Msg * msg)
+{
+  std::unique_lock<std::mutex> lock(read_lock);
+  while (!msg->ready)
+    {
+      if (broken)
+        throw "Connection closed";
+      if (msg->deadline == 0)
+        msg->cond.wait(lock);
+      else if (msg->cond.wait_until(lock, until(msg->deadline)) ==
+               std::cv_status::timeout && !msg->ready)
+        time_out(msg, lock);
+    }
+  msg->ready = false;
+}
+
+void NetMsg::time_out(Msg * msg, std::unique_lock<std::mutex> & lock)
+{
+  // The msgs lock comes first, so the reply may slip in meanwhile. Bodies
+  // push the deadline back as they move, so it may have passed only
+  // before the last chunk
+  lock.unlock();
+  msgs_lock.lock();
+  lock.lock();
+  bool late = !msg->ready && !broken && now() >= msg->deadline;
+
+  // Streams and files belong to the caller, who may let go of them as soon
+  // as this throws, so a stalled body takes the connection down instead
+  bool body = streamed(msg);
+  if (late && !body)
+    abandon(msg);
+  lock.unlock();
+  msgs_lock.unlock();
+  if (late && body)
+    stall();
+  if (!late || body)
+    {
+      lock.lock();
+      return;
+    }
+
+  global_log.message("NetMsg: Request timed out", Log::NOTICE);
+  destroy(msg);
+  throw "Message timed out";
+}
+
+bool NetMsg::streamed(const Msg * msg)
+{
+  return msg->in != NULL || msg->in_fd >= 0 || msg->out != NULL ||
+    msg->out_fd >= 0 || msg->drained;
+}
+
+void NetMsg::stall()
+{
+  global_log.message("NetMsg: Body stalled, closing the connection",
+                     Log::NOTICE);
+  net->shutdown();
+  set_broken();
+}
+
+void NetMsg::touch(Msg * msg)
+{
+  uint64_t deadline = msg->deadline;
+  if (deadline != 0)
+    msg->deadline.compare_exchange_strong(deadline, now() + timeout);
+}
+
+void NetMsg::abandon(Msg * msg)
+{
+  msg->expired = true;
+  msg->cond.notify_all();
+
+  if (!msg->server)
+    {
+      if (msg->mapped)
+        client_msgs.erase(msg->id);
+      msg->mapped = false;
+    }
+
+  // The remote end's ids are never reused, so its message stays in the map
+  // until the late reply turns up or the connection goes away
+  else if (msg->mapped)
+    msg->refs++;
+
+  // A body parked waiting on credit is never picked up by the writer again
+  write_lock.lock();
+  if (msg->parked && msg->held)
+    {
+      msg->parked = false;
+      msg->refs--;
+    }
+  write_lock.unlock();
+}
+
+void NetMsg::drop(Msg * msg)
+{
+  msgs_lock.lock();
+  if (--msg->refs == 0)
+    release(msg);
+  msgs_lock.unlock();
 }
@@ -23,15 +23,32 @@
 #define __NETMSG_HXX__
 
 #include <cstdint>
-#include <unordered_map>
-#include <unordered_set>
+#include <functional>
 #include <iostream>
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <atomic>
+#include <vector>
 #include <condition_variable>
+#include <future>
+#include <memory>
+#include <chrono>
+#include <zlib.h>
 
 #include "net.hxx"
+#include "mpsc.hxx"
+#include "slots.hxx"
+
+// Optional wire features which both ends agree on during the handshake,
+// compact frames replace the fixed 64 bit header fields with varints and
+// compressed frames carry bodies which shrink through zlib
+#define NETMSG_CHUNKED 0x01
+#define NETMSG_CREDIT 0x02
+#define NETMSG_COMPACT 0x04
+#define NETMSG_COMPRESS 0x08
+#define NETMSG_FEATURES (NETMSG_CHUNKED | NETMSG_CREDIT | NETMSG_COMPACT | \
+                         NETMSG_COMPRESS)
 
 class Message
 {
@@ -44,14 +61,102 @@ public:
 class NetMsg
 {
 public:
+  /**
+   * Receives the reply to an asynchronous message, or NULL if the connection
+   * closed, the deadline passed or the request was cancelled before it
+   * arrived. It runs on the thread receiving from the connection or the one
+   * noticing the deadline, so it must never wait on another reply itself
+   */
+  typedef std::function<void(Message *)> Callback;
+
   /**
    * Creates a new net listener and data processor
+   * @param net The connection to carry the messages over
+   * @param threaded False if a Reactor drives the connection instead of
+   *                 dedicated listen and writer threads
    */
-  NetMsg(Net * net);
+  NetMsg(Net * net, bool threaded = true);
   ~NetMsg();
   void start();
   void close();
 
+  /**
+   * Reads whatever data is ready on the connection without blocking and
+   * processes it, only used when the NetMsg is not threaded
+   * @return False if the connection has been closed by the remote end
+   */
+  bool receive();
+
+  /**
+   * Sets a callback which is run every time a new message arrives
+   * @param notify The callback, which is run on the receiving thread
+   */
+  void set_notify(const std::function<void()> & notify);
+
+  /**
+   * Sets a callback which is run when credit is waiting to be granted,
+   * only used when the NetMsg is not threaded. Frames may be parsed on a
+   * thread which must never block on the socket, so the callback has to
+   * arrange for send_grants() to be called from one which may
+   * @param notify The callback, without one the credit is sent straight
+   *               away by the thread which granted it
+   */
+  void set_grant_notify(const std::function<void()> & notify);
+
+  /**
+   * Writes out the credit waiting to be granted, blocking while the remote
+   * end isn't reading. Only used when the NetMsg is not threaded
+   */
+  void send_grants();
+
+  /**
+   * Enables the wire features the remote end has agreed to understand,
+   * must be called before any messages are sent
+   * @param features A mask of the NETMSG_* features
+   */
+  void set_features(uint8_t features);
+
+  /**
+   * Limits how the writer thread batches frames during a burst of messages,
+   * while more keep arriving their frames are gathered into one send until
+   * the buffer fills or the delay runs out. The writer never waits for more
+   * messages, so a lone one is always sent straight away
+   * @param bytes The most bytes buffered before they are sent
+   * @param delay The most microseconds a frame is held back, 0 disables it
+   */
+  void set_batch(size_t bytes, uint64_t delay);
+
+  /**
+   * Limits how long requests wait for their replies, once the deadline
+   * passes the request is forgotten and a late reply is dropped. Bodies
+   * sent from or received into streams and files push the deadline back
+   * with every chunk, and since those belong to the caller they can't be
+   * given up on while NetMsg is still using them, so a body which stops
+   * moving closes the connection instead
+   * @param timeout The most milliseconds to wait, 0 waits forever
+   */
+  void set_timeout(uint64_t timeout);
+
+  /**
+   * Fails every asynchronous request whose deadline has passed, threaded
+   * connections do this from the writer thread while a Reactor does it
+   * for the connections it drives
+   */
+  void expire();
+
+  /**
+   * Gives up on an asynchronous request, its callback is run with NULL
+   * straight away and a late reply is dropped
+   * @param id The id returned when the request was sent
+   * @return False if the reply has already arrived
+   */
+  bool cancel(uint64_t id);
+
+  /**
+   * @return The socket carrying the messages
+   */
+  int get_fd() const;
+
   /**
    * Sends the string data as the message without expecting a reply
    * @param data The message data to send to the server
@@ -65,6 +170,40 @@ public:
    */
   Message *send_and_wait(const std::string & data);
 
+  /**
+   * Sends the string data to the server and waits for a string reply,
+   * throwing if it doesn't arrive in time
+   * @param data The message data to send to the server
+   * @param timeout The most milliseconds to wait, 0 waits forever
+   * @return The message received back from the server
+   */
+  Message *send_and_wait(const std::string & data, uint64_t timeout);
+
+  /**
+   * Sends the string data to the server without waiting for the reply
+   * @param data The message data to send to the server
+   * @param callback Called with the message received back from the server
+   * @return The id of the request, which can be used to cancel it
+   */
+  uint64_t send_async(const std::string & data, const Callback & callback);
+
+  /**
+   * Sends the string data to the server without waiting for the reply
+   * @param data The message data to send to the server
+   * @param callback Called with the message received back from the server
+   * @param timeout The most milliseconds to wait, 0 waits forever
+   * @return The id of the request, which can be used to cancel it
+   */
+  uint64_t send_async(const std::string & data, const Callback & callback,
+                      uint64_t timeout);
+
+  /**
+   * Sends the string data to the server without waiting for the reply
+   * @param data The message data to send to the server
+   * @return The message received back from the server
+   */
+  std::future<Message *> send_async(const std::string & data);
+
   /**
    * Waits for new messages to arrive from the server
    * @return The message data from the server
@@ -78,6 +217,32 @@ public:
    */
   Message *reply_and_wait(Message *message);
 
+  /**
+   * Send a reply message to the server without waiting for the response
+   * @param message The message to send
+   * @param callback Called with the received reply
+   */
+  void reply_async(Message *message, const Callback & callback);
+
+  /**
+   * Send a reply message to the server without waiting for the response
+   * @param message The message to send
+   * @return The received reply
+   */
+  std::future<Message *> reply_async(Message *message);
+
+  /**
+   * Send a reply message to the server using the input stream as data,
+   * without waiting for the response
+   * @param message The received message carrying the message id
+   * @param in The input stream to receive the data from, which must stay
+   *           valid until the callback runs
+   * @param len The length of the data to receive from the stream
+   * @param callback Called with the received reply
+   */
+  void reply_async(Message *message, std::istream * in, size_t len,
+                   const Callback & callback);
+
   /**
    * Send a reply message to the server using the input stream as data
    * @param message The received message carrying the message id
@@ -87,13 +252,45 @@ public:
    */
   Message *reply_and_wait(Message *message, std::istream * in, size_t len);
 
+  /**
+   * Send a reply message to the server using the contents of a file as data,
+   * which is handed to the socket by the kernel without user space copies
+   * @param message The received message carrying the message id
+   * @param fd The open file to send from, starting at its current offset
+   * @param len The length of the data to send from the file
+   * @return The received reply
+   */
+  Message *reply_and_wait(Message *message, int fd, size_t len);
+
   /**
    * Send a reply message to the server and write the response to the out stream
+   * With credit flow control the response is written by the calling thread,
+   * so a slow stream only holds back its own message
    * @param message The data to send the server as an acknowledgement
    * @param out The output stream to write the response
    */
   void reply_and_wait(Message *message, std::ostream * out);
 
+  /**
+   * Send a reply message to the server without waiting for the response,
+   * which is written to the out stream as it arrives. With credit the
+   * writes happen on a thread of their own, which also runs the callback
+   * @param message The data to send the server as an acknowledgement
+   * @param out The output stream to write the response, which must stay
+   *            valid until the callback runs
+   * @param callback Called with the reply once all of it is written
+   */
+  void reply_async(Message *message, std::ostream * out,
+                   const Callback & callback);
+
+  /**
+   * Send a reply message to the server and write the response to a file,
+   * which is moved from the socket by the kernel without user space copies
+   * @param message The data to send the server as an acknowledgement
+   * @param fd The open file to write into at its current offset
+   */
+  void reply_and_wait(Message *message, int fd);
+
   /**
    * Send a reply to the message and close the message handle
    * @param message The message data to send to the server
@@ -118,27 +315,306 @@ private:
     std::string msg;
     std::ostream *out;
     std::istream *in;
+    int in_fd, out_fd;
     size_t in_len;
+
+    // Progress of a body which is sent or received in chunks, plain is set
+    // once a chunk fails to compress so the rest aren't tried
+    uint64_t sent;
+    bool partial, partial_new, plain;
+
+    // Bytes the remote end will still accept, and bytes received since
+    // the last grant of more credit
+    uint64_t credit, consumed;
+    bool parked;
+
+    // Received chunks waiting to be written to the out stream, drained is
+    // set when the waiting thread writes them rather than the listener
+    std::string pending;
+    bool drained;
+
+    // Set once the reply has arrived, only its waiter is woken
+    bool ready;
+    std::condition_variable cond;
+
+    // Runs instead of waking a waiter for asynchronous messages
+    Callback callback;
+
+    // False for one way messages which are never looked up by id, so
+    // they skip the message maps entirely
+    bool mapped;
+
+    // When the reply is given up on in steady clock milliseconds, or 0 to
+    // wait forever. Each chunk of a body pushes it back, so bodies only
+    // time out once they stop moving. Expired messages are never handed
+    // back to their owner
+    std::atomic<uint64_t> deadline;
+    bool expired;
+
+    // Messages which can expire are held by their owner, by whoever is
+    // sending them and by the listener while a frame of them is arriving,
+    // so they are only freed once none of them needs it anymore. Counted
+    // under the msgs lock, the listener checks held without it
+    std::atomic<bool> held;
+    unsigned refs;
+
+    // Set once the message has been in a table, the listener may still be
+    // looking at it after it is taken out
+    bool indexed;
+
+    // Links the message into the write queue, and into read_new once it
+    // has arrived
+    Msg *next, *next_new;
+  };
+
+  struct Grant
+  {
+    uint64_t id;
+    bool server;
+    uint64_t credit;
+    Grant *next;
   };
 
   Net * net;
-  std::unordered_map<uint64_t, Msg*> client_msgs, server_msgs;
+  // Messages in flight by id, ours and those the remote end started.
+  // They are changed under the msgs lock, while the listener looks up
+  // most frames without it
+  Slots<Msg> client_msgs, server_msgs;
   uint64_t next_id;
-  bool done;
+  bool threaded, done, broken;
+  std::atomic<bool> idle;
+  uint8_t features;
+  std::atomic<size_t> batch_bytes;
+  std::atomic<uint64_t> batch_delay;
+  uint64_t timeout;
+
+  // The earliest deadline of an asynchronous request, it is only ever
+  // lowered outside of expire() so a sweep may turn up nothing
+  std::atomic<uint64_t> next_expiry;
   std::thread listen;
   std::thread writer;
-  std::mutex msgs_lock, write_lock, read_lock;
+  std::mutex msgs_lock, write_lock, read_lock, net_lock;
   std::condition_variable_any write_cond, read_cond;
-  std::queue< std::pair<uint64_t, bool> > write_queue;
-  std::unordered_set<uint64_t> client_read_done, server_read_done;
-  std::queue<uint64_t> read_new;
+  Mpsc<Msg> write_queue;
+  Mpsc<Grant> grants;
+  Msg *new_head, *new_tail;
+  std::function<void()> notify, grant_notify;
+
+  // Finished messages kept for reuse, along with their body buffers, and
+  // those waiting for the listener to stop looking before they are freed
+  std::vector<Msg*> pool;
+  Mpsc<Msg> graveyard;
+
+  // Received bytes are parsed in place from the buffer between rstart and
+  // rend, body_msg is the frame whose body is still arriving
+  uint8_t *rbuf;
+  size_t rsize, rstart, rend;
+  Msg *body_msg;
+  uint64_t body_len;
+  bool body_new, body_more, body_zip, body_held, in_body;
+
+  // Compression state, frames are compressed independently so chunks of
+  // different messages can still be interleaved
+  z_stream deflater, inflater;
+  bool deflating, inflating;
+  std::string zip_out, zip_in, unzipped;
+
+  // Threads writing out the bodies of asynchronous replies, counted under
+  // the read lock
+  size_t drainers;
+  std::condition_variable drain_cond;
 
   void writer_thread();
   void listen_thread();
 
-  Msg *send(const std::string & data, bool del);
-  void send(Msg * msg);
+  /**
+   * Sends the buffered frames and frees the messages which are done
+   * @param sent The finished messages to free
+   * @param held The finished messages the writer holds a reference to
+   */
+  void flush(std::vector<Msg *> & sent, std::vector<Msg *> & held);
+
+  /**
+   * Queues the next frame of the message on the connection, bodies are
+   * split into chunks when the remote end supports it
+   * @param msg The message to write
+   * @return True if the whole body has been written
+   */
+  bool write_msg(Msg * msg);
+  void write_grant(const Grant & grant);
+
+  /**
+   * Queues every grant of credit which is waiting
+   * @return True if there were any
+   */
+  bool write_grants();
+
+  /**
+   * Reads the next part of a stream or file body into the buffer
+   */
+  void read_body(std::istream * in, int in_fd, uint8_t * buff, uint64_t len);
+
+  /**
+   * Compresses a frame body into zip_out
+   * @return False if the data doesn't shrink enough to be worth it
+   */
+  bool zip(const uint8_t * data, uint64_t len);
+
+  /**
+   * Unpacks the compressed frame in zip_in into the message
+   */
+  void unzip(Msg * msg);
+
+  /**
+   * Hands received body data to wherever the message is being written
+   */
+  void deliver(Msg * msg, const uint8_t * data, size_t len);
+
+  /**
+   * Queues a frame header in the format agreed with the remote end
+   */
+  void write_head(uint8_t flags, uint64_t id, uint64_t len);
+
+  /**
+   * Decodes the frame header at the start of the receive buffer
+   * @return False if the whole header hasn't arrived yet
+   */
+  bool read_head(uint8_t & flags, uint64_t & id, uint64_t & len);
+
+  /**
+   * Wakes the writer thread if it has gone idle
+   */
+  void wake();
+
+  /**
+   * Checks whether the message may send more of its body, the writer parks
+   * the message until credit arrives if not
+   * @return True if the next chunk can be sent
+   */
+  bool has_credit(Msg * msg);
+
+  /**
+   * Allows the remote end to send more of the body of a message
+   * @param msg The message being received
+   * @param credit The number of bytes consumed since the last grant
+   */
+  void grant(Msg * msg, uint64_t credit);
+  void add_credit(bool server, uint64_t id, uint64_t credit);
+
+  /**
+   * Writes the chunks of a message to the out stream as they arrive
+   * @param msg The message being received
+   * @param out The stream to write the body to
+   */
+  void drain(Msg * msg, std::ostream * out);
+
+  /**
+   * Reads as much as the socket has into the receive buffer
+   * @param block Whether to wait for data to arrive
+   * @return False if the connection was closed
+   */
+  bool fill(bool block);
+
+  /**
+   * Processes every complete header and all buffered body data
+   */
+  void parse();
+
+  /**
+   * Takes a reset message from the pool, or allocates one if it is empty
+   * Must be called with the msgs lock held
+   */
+  Msg *alloc();
+
+  /**
+   * Returns a message to the pool once nothing refers to it anymore
+   * Must be called with the msgs lock held
+   */
+  void release(Msg * msg);
+
+  /**
+   * Frees the messages the pool had no room for, only called by the
+   * listener between frames
+   */
+  void reap();
+
+  Msg *begin_frame(bool server, uint64_t id, bool once, bool more, bool & ne);
+
+  /**
+   * Picks the message up where its last frame left off
+   */
+  Msg *resume(Msg * msg, bool & ne);
+  void finish_frame(Msg * msg, bool ne);
+  void set_broken();
+
+  Msg *send(const std::string & data, bool del,
+           const Callback & callback = Callback(), uint64_t timeout = 0,
+           uint64_t * id = NULL);
+
+  /**
+   * Hands the message to the writer, or writes it straight away
+   * @param timeout The most milliseconds to wait for the reply, 0 waits
+   *                forever or for messages which expect no reply
+   */
+  void send(Msg * msg, uint64_t timeout = 0);
+
+  /**
+   * Waits for the reply to a message, if its deadline passes the message
+   * is destroyed before throwing
+   */
   void wait(Msg * msg);
+
+  /**
+   * Gives up on a message whose deadline has passed, destroying it before
+   * throwing, unless its reply arrived or its deadline moved meanwhile
+   * @param msg The message
+   * @param lock The held read lock, which is held again on return
+   */
+  void time_out(Msg * msg, std::unique_lock<std::mutex> & lock);
+
+  /**
+   * @return True if the body of the message is sent from or received into
+   *         a stream or file of the caller's
+   */
+  static bool streamed(const Msg * msg);
+
+  /**
+   * Shuts the connection down after a body stopped moving, so everything
+   * waiting on it fails and the threads using the body's stream or file
+   * stop before its owner lets go of it
+   */
+  void stall();
+
+  /**
+   * Pushes back the deadline of a message whose body is moving
+   * @param msg The message
+   */
+  void touch(Msg * msg);
+
+  /**
+   * Gives up on the reply to a message and wakes anything waiting on it,
+   * late replies to our requests no longer find it while those to the
+   * remote end's leave it in place so they aren't mistaken for new ones
+   * Must be called with the msgs and read locks held
+   */
+  void abandon(Msg * msg);
+
+  /**
+   * Lets go of a reference to the message, freeing it if it was the last
+   */
+  void drop(Msg * msg);
+
+  /**
+   * Fails the callback of a message straight away if the connection has
+   * already closed, as nothing else would ever run it
+   */
+  void check_broken(Msg * msg);
+
+  /**
+   * @return A callback which fulfils the promise
+   */
+  static Callback fulfil(const std::shared_ptr< std::promise<Message *> > &
+                         promise);
 };
 
 #endif
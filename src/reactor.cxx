@@ -0,0 +1,390 @@
+/*
+  Event driven connection handler backed by a bounded worker pool
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <functional>
+#include <string>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#  include <unistd.h>
+#  include <sys/epoll.h>
+#  include <sys/socket.h>
+#endif
+
+#include "reactor.hxx"
+#include "log.hxx"
+
+#define EVENTS 64
+
+// How often in milliseconds the connections are checked for asynchronous
+// requests which have run out of time
+#define TICK 100
+
+Reactor::Reactor(size_t workers)
+  : done(false), epoll(-1), workers(workers)
+{
+#ifdef __linux__
+  if ((epoll = epoll_create1(0)) == -1)
+    throw std::string("Failed to create epoll: ") + strerror(errno);
+
+  // The pipe wakes the poller up when the reactor is closed
+  if (pipe(wake) == -1)
+    {
+      ::close(epoll);
+      throw std::string("Failed to create pipe: ") + strerror(errno);
+    }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll, EPOLL_CTL_ADD, wake[0], &ev);
+#else
+  throw "The reactor is only supported on linux";
+#endif
+}
+
+Reactor::~Reactor()
+{
+  close();
+}
+
+void Reactor::start()
+{
+  poller = std::thread(std::bind(&Reactor::poll_thread, this));
+  for (size_t i = 0; i < workers; i++)
+    pool.push_back(std::thread(std::bind(&Reactor::worker_thread, this)));
+}
+
+void Reactor::close()
+{
+#ifdef __linux__
+  if (done)
+    return;
+
+  // Stop the poller and workers
+  lock.lock();
+  done = true;
+  lock.unlock();
+  cond.notify_all();
+  char c = 0;
+  if (write(wake[1], &c, 1) < 0)
+    global_log.message("Reactor failed to wake poller", Log::WARNING);
+  if (poller.joinable())
+    poller.join();
+
+  // Break any commands still waiting on the network
+  lock.lock();
+  for (auto it = conns.begin(), end = conns.end(); it != end; it++)
+    (*it)->netmsg->close();
+  lock.unlock();
+
+  for (auto it = pool.begin(), end = pool.end(); it != end; it++)
+    it->join();
+  pool.clear();
+
+  // Clean up the leftover connections
+  for (auto it = conns.begin(), end = conns.end(); it != end; it++)
+    {
+      (*it)->closer((*it)->netmsg);
+      delete (*it)->netmsg;
+      delete *it;
+    }
+  conns.clear();
+
+  ::close(epoll);
+  ::close(wake[0]);
+  ::close(wake[1]);
+#endif
+}
+
+void Reactor::add(NetMsg * netmsg, const Handler & handler,
+                  const Closer & closer)
+{
+#ifdef __linux__
+  Conn *conn = new Conn;
+  conn->netmsg = netmsg;
+  conn->fd = netmsg->get_fd();
+  conn->handler = handler;
+  conn->closer = closer;
+  conn->pending = 0;
+  conn->running = false;
+  conn->closed = false;
+  conn->grants = false;
+  conn->granting = false;
+
+  // Every new message is queued as a command for the workers
+  netmsg->set_notify([this, conn]()
+    {
+      lock.lock();
+      conn->pending++;
+      schedule(conn);
+      lock.unlock();
+    });
+
+  // Credit goes out on a worker, the poller never writes to the socket
+  netmsg->set_grant_notify([this, conn]()
+    {
+      lock.lock();
+      conn->grants = true;
+      if (!conn->granting && !conn->closed)
+        {
+          conn->granting = true;
+          jobs.push(std::bind(&Reactor::grant, this, conn));
+          cond.notify_one();
+        }
+      lock.unlock();
+    });
+
+  lock.lock();
+  conns.insert(conn);
+  lock.unlock();
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = conn;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    {
+      lock.lock();
+      conns.erase(conn);
+      lock.unlock();
+      delete conn;
+      throw std::string("Failed to watch connection: ") + strerror(errno);
+    }
+#endif
+}
+
+void Reactor::submit(const std::function<void()> & job)
+{
+  lock.lock();
+  jobs.push(job);
+  lock.unlock();
+  cond.notify_one();
+}
+
+void Reactor::poll_thread()
+{
+#ifdef __linux__
+  struct epoll_event events[EVENTS];
+  int ready;
+  bool alive;
+  auto sweep = std::chrono::steady_clock::now();
+
+  while (!done)
+    {
+      if ((ready = epoll_wait(epoll, events, EVENTS, TICK)) == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          global_log.message(std::string("Reactor failed to poll: ") +
+                             strerror(errno), Log::ERROR);
+          break;
+        }
+
+      for (int i = 0; i < ready; i++)
+        {
+          Conn *conn = (Conn*)events[i].data.ptr;
+          if (conn == NULL)
+            continue;
+
+          // Parse the frames which are ready
+          try
+            {
+              alive = conn->netmsg->receive();
+            }
+          catch(const char * e)
+            {
+              alive = false;
+            }
+          catch(const std::string & e)
+            {
+              alive = false;
+            }
+          catch(...)
+            {
+              alive = false;
+            }
+          if (alive)
+            continue;
+
+          // Let the workers clean up after the last command finishes
+          epoll_ctl(epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+          lock.lock();
+          conn->closed = true;
+          schedule(conn);
+          lock.unlock();
+        }
+
+      // Non-threaded connections have no writer to notice their deadlines,
+      // connections are only freed under the lock so they can't go away
+      if (std::chrono::steady_clock::now() < sweep)
+        continue;
+      sweep = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(TICK);
+      lock.lock();
+      for (auto it = conns.begin(), end = conns.end(); it != end; it++)
+        (*it)->netmsg->expire();
+      lock.unlock();
+    }
+#endif
+}
+
+void Reactor::worker_thread()
+{
+  std::function<void()> job;
+
+  lock.lock();
+  while (true)
+    {
+      if (!jobs.empty())
+        {
+          job = jobs.front();
+          jobs.pop();
+          lock.unlock();
+
+          job();
+
+          lock.lock();
+        }
+      else if (done)
+        break;
+      else
+        cond.wait(lock);
+    }
+  lock.unlock();
+}
+
+void Reactor::schedule(Conn * conn)
+{
+  if (conn->running)
+    return;
+
+  conn->running = true;
+  jobs.push(std::bind(&Reactor::run, this, conn));
+  cond.notify_one();
+}
+
+void Reactor::run(Conn * conn)
+{
+  bool keep;
+
+  lock.lock();
+  while (true)
+    {
+      // The connection is gone so tear it down, unless credit is still
+      // being sent in which case that worker does
+      if (conn->closed)
+        {
+          conn->running = false;
+          if (conn->granting)
+            lock.unlock();
+          else
+            remove(conn);
+          return;
+        }
+
+      if (conn->pending == 0)
+        {
+          conn->running = false;
+          lock.unlock();
+          return;
+        }
+      conn->pending--;
+      lock.unlock();
+
+      // Run the command outside of the lock
+      try
+        {
+          keep = conn->handler(conn->netmsg);
+        }
+      catch(const char * e)
+        {
+          global_log.message(std::string("Command Failed: ") + e,
+                             Log::WARNING);
+          keep = false;
+        }
+      catch(const std::string & e)
+        {
+          global_log.message(std::string("Command Failed: ") + e,
+                             Log::WARNING);
+          keep = false;
+        }
+      catch(...)
+        {
+          // Anything else, like running out of memory, still only costs
+          // this connection rather than the worker
+          global_log.message("Command Failed", Log::WARNING);
+          keep = false;
+        }
+
+      // Shutting down the socket lets the poller notice the close
+#ifdef __linux__
+      if (!keep)
+        ::shutdown(conn->fd, SHUT_RDWR);
+#endif
+
+      lock.lock();
+    }
+}
+
+void Reactor::grant(Conn * conn)
+{
+  lock.lock();
+  while (conn->grants && !conn->closed)
+    {
+      conn->grants = false;
+      lock.unlock();
+
+      try
+        {
+          conn->netmsg->send_grants();
+        }
+      catch(...)
+        {
+          // Shutting down the socket lets the poller notice the close
+#ifdef __linux__
+          ::shutdown(conn->fd, SHUT_RDWR);
+#endif
+        }
+
+      lock.lock();
+    }
+  conn->granting = false;
+
+  // The last command may have finished while the credit went out
+  if (conn->closed && !conn->running)
+    remove(conn);
+  else
+    lock.unlock();
+}
+
+void Reactor::remove(Conn * conn)
+{
+  conns.erase(conn);
+  lock.unlock();
+
+  conn->closer(conn->netmsg);
+  delete conn->netmsg;
+  delete conn;
+}
@@ -0,0 +1,127 @@
+/*
+  Event driven connection handler backed by a bounded worker pool
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __REACTOR_HXX__
+#define __REACTOR_HXX__
+
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <unordered_set>
+
+#include "netmsg.hxx"
+
+/**
+ * Multiplexes many non-threaded NetMsg connections over a single epoll
+ * thread, the frames are parsed as data arrives and the received commands
+ * are run on a fixed number of worker threads
+ */
+class Reactor
+{
+public:
+  /**
+   * Called with a new message waiting on the connection
+   * @return False if the connection should be closed
+   */
+  typedef std::function<bool(NetMsg *)> Handler;
+
+  /**
+   * Called once after the connection has closed and no commands are running
+   */
+  typedef std::function<void(NetMsg *)> Closer;
+
+  /**
+   * Creates a new reactor
+   * @param workers The number of threads which run commands
+   */
+  Reactor(size_t workers);
+  ~Reactor();
+
+  void start();
+  void close();
+
+  /**
+   * Starts watching a connection for messages, the commands on a single
+   * connection are always run in the order they arrive and never concurrently
+   * @param netmsg A non-threaded NetMsg, the reactor takes ownership of it
+   * @param handler Runs each new message on a worker thread
+   * @param closer Cleans up the connection, NetMsg is deleted afterwards
+   */
+  void add(NetMsg * netmsg, const Handler & handler, const Closer & closer);
+
+  /**
+   * Runs a job on one of the worker threads
+   * @param job The job to run
+   */
+  void submit(const std::function<void()> & job);
+
+private:
+  struct Conn
+  {
+    NetMsg *netmsg;
+    int fd;
+    Handler handler;
+    Closer closer;
+    size_t pending;
+    bool running, closed;
+
+    // Set while credit waits to be sent and while a worker sends it
+    bool grants, granting;
+  };
+
+  bool done;
+  int epoll, wake[2];
+  size_t workers;
+  std::thread poller;
+  std::vector<std::thread> pool;
+  std::mutex lock;
+  std::condition_variable_any cond;
+  std::queue< std::function<void()> > jobs;
+  std::unordered_set<Conn *> conns;
+
+  void poll_thread();
+  void worker_thread();
+
+  /**
+   * Queues the connection on the workers if it isn't already running
+   * Must be called with the lock held
+   */
+  void schedule(Conn * conn);
+  void run(Conn * conn);
+
+  /**
+   * Sends the credit the poller granted on a connection, apart from its
+   * commands since one of them may be waiting on the body being granted
+   */
+  void grant(Conn * conn);
+
+  /**
+   * Tears down a closed connection once nothing is running on it
+   * Must be called with the lock held, which is released
+   */
+  void remove(Conn * conn);
+};
+
+#endif
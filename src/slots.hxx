@@ -0,0 +1,148 @@
+/*
+  Table of in flight messages indexed by their sequence numbers
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SLOTS_HXX__
+#define __SLOTS_HXX__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+/**
+ * Maps the ids of in flight messages to their values. Ids are handed out
+ * in sequence so each one indexes a slot of a ring directly, and the slot
+ * keeps the whole id as its generation so a reader can tell it apart from
+ * a later id which reuses the slot. Ids landing on a busy slot spill into
+ * a map behind a mutex, which is only looked at while something is in it
+ *
+ * Inserts and erases must be serialized by the caller, find() may run
+ * alongside them on any thread without locking. An id may only ever be
+ * inserted once, and the table doesn't own its values so a reader must
+ * know they outlive its use of them
+ */
+template <class T>
+class Slots
+{
+public:
+  /**
+   * @param size The number of slots, which must be a power of two
+   */
+  Slots(size_t size) : mask(size - 1), slots(new Slot[size]), spilled(0) {}
+
+  ~Slots()
+  {
+    delete[] slots;
+  }
+
+  /**
+   * @return The value stored for the id, or NULL if there is none
+   */
+  T *find(uint64_t id) const
+  {
+    const Slot & slot = slots[id & mask];
+    if (slot.key.load(std::memory_order_acquire) == id + 1)
+      {
+        // The slot may have been emptied and reused while it was read, a
+        // value stored since then makes the new key visible
+        T *val = slot.val.load(std::memory_order_acquire);
+        if (slot.key.load(std::memory_order_relaxed) == id + 1)
+          return val;
+      }
+
+    if (spilled.load() == 0)
+      return NULL;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = spill.find(id);
+    return it == spill.end() ? NULL : it->second;
+  }
+
+  void insert(uint64_t id, T * val)
+  {
+    Slot & slot = slots[id & mask];
+    if (slot.key.load(std::memory_order_relaxed) == 0)
+      {
+        // The value goes in before the key publishes it
+        slot.val.store(val, std::memory_order_release);
+        slot.key.store(id + 1, std::memory_order_release);
+        return;
+      }
+
+    std::lock_guard<std::mutex> guard(lock);
+    spill[id] = val;
+    spilled++;
+  }
+
+  void erase(uint64_t id)
+  {
+    Slot & slot = slots[id & mask];
+    if (slot.key.load(std::memory_order_relaxed) == id + 1)
+      {
+        slot.key.store(0, std::memory_order_relaxed);
+        slot.val.store(NULL, std::memory_order_release);
+        return;
+      }
+
+    if (spilled.load() == 0)
+      return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (spill.erase(id) > 0)
+      spilled--;
+  }
+
+  /**
+   * Runs the function on every value, which must not insert or erase
+   * Must be serialized with the inserts and erases
+   */
+  template <class F>
+  void each(F f)
+  {
+    for (size_t i = 0; i <= mask; i++)
+      if (slots[i].key.load() != 0)
+        f(slots[i].val.load());
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = spill.begin(), end = spill.end(); it != end; it++)
+      f(it->second);
+  }
+
+private:
+  struct Slot
+  {
+    // The id plus one, or 0 while the slot is empty
+    std::atomic<uint64_t> key;
+    std::atomic<T*> val;
+
+    Slot() : key(0), val(NULL) {}
+  };
+
+  size_t mask;
+  Slot *slots;
+  std::atomic<size_t> spilled;
+  mutable std::mutex lock;
+  std::unordered_map<uint64_t, T*> spill;
+
+  Slots(const Slots &);
+  Slots & operator=(const Slots &);
+};
+
+#endif
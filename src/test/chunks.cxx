@@ -0,0 +1,193 @@
+/*
+  Chunking test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+#include "gtest/gtest.h"
+#include "chunks.hxx"
+
+#define INDEX "chunks.idx"
+
+static std::string random_data(size_t len, unsigned seed)
+{
+  std::mt19937 gen(seed);
+  std::string data(len, '\0');
+  for (size_t i = 0; i < len; i++)
+    data[i] = gen();
+  return data;
+}
+
+static std::vector<Chunker::Chunk> split(const std::string & data)
+{
+  std::istringstream in(data);
+  return Chunker::split(in);
+}
+
+TEST(ChunksTest, Bounds)
+{
+  std::string data = random_data(8 << 20, 1);
+  std::vector<Chunker::Chunk> chunks = split(data);
+
+  uint64_t offset = 0;
+  for (size_t i = 0; i < chunks.size(); i++)
+    {
+      EXPECT_EQ(offset, chunks[i].offset);
+      EXPECT_GE((uint32_t)CHUNK_MAX, chunks[i].length);
+      if (i + 1 < chunks.size())
+        {
+          EXPECT_LE((uint32_t)CHUNK_MIN, chunks[i].length);
+        }
+      EXPECT_EQ(Chunker::hash((uint8_t*)data.data() + offset,
+                              chunks[i].length), chunks[i].hash);
+      offset += chunks[i].length;
+    }
+  EXPECT_EQ(data.length(), offset);
+
+  // Most chunks land near the average
+  size_t avg = data.length() / chunks.size();
+  EXPECT_LT(CHUNK_AVG / 2u, avg);
+  EXPECT_GT(CHUNK_AVG * 2u, avg);
+}
+
+TEST(ChunksTest, Small)
+{
+  EXPECT_EQ(0u, split("").size());
+  std::vector<Chunker::Chunk> chunks = split("a small file");
+  ASSERT_EQ(1u, chunks.size());
+  EXPECT_EQ(12u, chunks[0].length);
+}
+
+TEST(ChunksTest, Shifted)
+{
+  std::string data = random_data(4 << 20, 2);
+  std::vector<Chunker::Chunk> before = split(data);
+  data.insert(1 << 20, "a few bytes inserted into the middle");
+  data.insert(0, "and some at the start");
+  std::vector<Chunker::Chunk> after = split(data);
+
+  // Only the chunks around the inserts change
+  std::unordered_set<std::string> hashes;
+  for (auto & chunk : before)
+    hashes.insert(chunk.hash);
+  size_t shared = 0;
+  for (auto & chunk : after)
+    shared += hashes.count(chunk.hash);
+  EXPECT_LE(after.size() - 4, shared);
+}
+
+TEST(ChunksTest, Reader)
+{
+  std::string data = random_data(2 << 20, 3);
+  std::vector<Chunker::Chunk> chunks = split(data), wanted;
+  ASSERT_LT(3u, chunks.size());
+
+  // Chunks come out in the order asked for, wherever the file starts
+  std::stringstream file("header" + data);
+  wanted.push_back(chunks[2]);
+  wanted.push_back(chunks[0]);
+  ChunkReader reader(file, 6, wanted);
+  std::string out((std::istreambuf_iterator<char>(reader)),
+                  std::istreambuf_iterator<char>());
+  EXPECT_EQ(data.substr(chunks[2].offset, chunks[2].length) +
+            data.substr(0, chunks[0].length), out);
+
+  // A file which shrank ends the stream at the chunk it lost
+  std::stringstream shrunk(data.substr(0, chunks[1].offset + 10));
+  ChunkReader cut(shrunk, 0, chunks);
+  out.assign((std::istreambuf_iterator<char>(cut)),
+             std::istreambuf_iterator<char>());
+  EXPECT_EQ(data.substr(0, chunks[0].length), out);
+}
+
+TEST(ChunksTest, Index)
+{
+  remove(INDEX);
+  Metadata mtd;
+  mtd.new_file("a", 100, 10);
+  mtd.new_file("b", 100, 20);
+
+  ChunkIndex::Location loc;
+  loc.filename = "a";
+  loc.offset = 5;
+  loc.length = 50;
+  loc.modified = 10;
+  std::string h1(CHUNK_HASH, '1'), h2(CHUNK_HASH, '2'), h3(CHUNK_HASH, '3');
+  {
+    ChunkIndex index(INDEX, mtd);
+    index.add(h1, loc, mtd);
+    loc.filename = "b";
+    loc.modified = 20;
+    index.add(h2, loc, mtd);
+    index.add(h3, loc, mtd);
+    index.drop(h3);
+
+    ASSERT_NE((void*)NULL, index.find(h1, mtd));
+    EXPECT_EQ("a", index.find(h1, mtd)->filename);
+    EXPECT_EQ(5u, index.find(h1, mtd)->offset);
+    EXPECT_EQ(50u, index.find(h1, mtd)->length);
+    EXPECT_EQ((void*)NULL, index.find(h3, mtd));
+  }
+
+  // Chunks of the changed file are forgotten once it is reloaded
+  mtd.modify_file("b", 100, 21);
+  ChunkIndex index(INDEX, mtd);
+  EXPECT_EQ(1u, index.size());
+  EXPECT_NE((void*)NULL, index.find(h1, mtd));
+  EXPECT_EQ((void*)NULL, index.find(h2, mtd));
+  EXPECT_EQ((void*)NULL, index.find(h3, mtd));
+  remove(INDEX);
+}
+
+TEST(ChunksTest, TornIndex)
+{
+  remove(INDEX);
+  Metadata mtd;
+  mtd.new_file("a", 100, 10);
+
+  ChunkIndex::Location loc;
+  loc.filename = "a";
+  loc.offset = 0;
+  loc.length = 100;
+  loc.modified = 10;
+  std::string h1(CHUNK_HASH, '1'), h2(CHUNK_HASH, '2');
+  {
+    ChunkIndex index(INDEX, mtd);
+    index.add(h1, loc, mtd);
+  }
+  {
+    std::ofstream out(INDEX, std::ios::out | std::ios::binary |
+                      std::ios::app);
+    out.write("torn", 4);
+  }
+
+  // The torn record is cut off so later ones can still be read
+  {
+    ChunkIndex index(INDEX, mtd);
+    EXPECT_EQ(1u, index.size());
+    index.add(h2, loc, mtd);
+  }
+  ChunkIndex index(INDEX, mtd);
+  EXPECT_EQ(2u, index.size());
+  remove(INDEX);
+}
@@ -0,0 +1,474 @@
+/*
+  SockConnector test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gtest/gtest.h"
+#include "connector_sock.hxx"
+#include "chunks.hxx"
+#include "metadata.hxx"
+#include "netmsg.hxx"
+#include "net.hxx"
+#include "util.hxx"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+// The parts of the protocol the fake server speaks
+#define HAND_MORE 0x40
+#define HAND_INLINE 0x80
+#define HAND_DELTA 0x40
+#define HAND_CHUNKS 0x20
+#define HAND_JOURNAL 0x01
+#define HAND_TREE 0x02
+
+#define CMD_QUIT 0
+#define CMD_META 1
+#define CMD_DEL 4
+#define CMD_PUSH_INLINE 5
+#define CMD_PULL_INLINE 6
+#define CMD_SIG 7
+#define CMD_PUSH_CHUNKS 10
+#define CMD_META_SINCE 11
+#define CMD_TREE 12
+
+#define META_TREE 2
+
+// The server's end of a socket pair, which logs the connector in with the
+// given features and then answers its commands by hand
+struct FakeServer
+{
+  Net *net;
+  NetMsg *netmsg;
+  SockConnector *conn;
+
+  FakeServer(uint8_t features, uint8_t more)
+  {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+      throw "Failed to create the socket pair";
+    net = new Net(fds[1], "remote", 0);
+
+    std::thread hand([this, features, more]()
+      {
+        net->write8(0);
+        uint8_t cmd = net->read8();
+        net->read8();
+        if (cmd & HAND_MORE)
+          net->read8();
+        for (int i = 0; i < 2; i++)
+          {
+            std::string field(net->read16(), '\0');
+            net->read_all((uint8_t*)&field[0], field.length());
+          }
+        net->write8(0);
+        net->write8(features);
+        net->write8(more);
+      });
+    conn = new SockConnector(new Net(fds[0], "local", 0), "user", "pass");
+    hand.join();
+
+    netmsg = new NetMsg(net);
+    netmsg->set_features(features & NETMSG_FEATURES);
+    netmsg->start();
+  }
+
+  ~FakeServer()
+  {
+    delete conn;
+    delete netmsg;
+    delete net;
+  }
+
+  void answer(Message * msg, const std::string & reply)
+  {
+    msg->set(reply);
+    netmsg->reply_only(msg);
+  }
+
+  // Answers commands on a thread of its own until the connector quits or
+  // closes the connection, the handler gets each command with its arguments
+  std::thread serve(const std::function<void(Message *, uint8_t, uint8_t *,
+                                             size_t)> & handler)
+  {
+    return std::thread([this, handler]()
+      {
+        while (true)
+          {
+            Message *msg;
+            try
+              {
+                msg = netmsg->wait_new();
+              }
+            catch (const char *)
+              {
+                return;
+              }
+            std::string cmd = msg->get();
+            uint8_t *data = (uint8_t*)cmd.data();
+            size_t data_len = cmd.length();
+            uint8_t type = Read::i8(data, data_len);
+            if (type == CMD_QUIT)
+              {
+                netmsg->destroy(msg);
+                return;
+              }
+            handler(msg, type, data, data_len);
+          }
+      });
+  }
+};
+
+static std::string status(uint8_t status)
+{
+  std::string ret;
+  Write::i8(status, ret);
+  return ret;
+}
+
+static std::string read_name(uint8_t *& data, size_t & data_len)
+{
+  size_t len = Read::i32(data, data_len);
+  std::string name((char*)data, len);
+  data += len;
+  data_len -= len;
+  return name;
+}
+
+TEST(SockConnectorTest, Window)
+{
+  FakeServer server(0, 0);
+  server.conn->set_window(2);
+
+  std::atomic<int> sent(0);
+  std::vector< std::future<void> > deletes;
+  std::thread client([&]()
+    {
+      for (int i = 0; i < 3; i++)
+        {
+          deletes.push_back(server.conn->delete_file_async("/file", i));
+          sent++;
+        }
+    });
+
+  // Both commands in the window go out before either is answered
+  Message *first = server.netmsg->wait_new();
+  Message *second = server.netmsg->wait_new();
+  EXPECT_EQ(CMD_DEL, (uint8_t)first->get()[0]);
+  EXPECT_EQ(CMD_DEL, (uint8_t)second->get()[0]);
+
+  // The third waits for room
+  usleep(100000);
+  EXPECT_EQ(2, sent);
+
+  server.answer(first, status(0));
+  Message *third = server.netmsg->wait_new();
+  client.join();
+  EXPECT_EQ(3, sent);
+  server.answer(third, status(1));
+  server.answer(second, status(0));
+
+  EXPECT_NO_THROW(deletes[0].get());
+  EXPECT_NO_THROW(deletes[1].get());
+  EXPECT_ANY_THROW(deletes[2].get());
+}
+
+TEST(SockConnectorTest, InlinePush)
+{
+  FakeServer server(HAND_INLINE, 0);
+  std::string filename;
+  std::string body;
+  uint64_t modified = 0;
+  uint8_t answer = 0;
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      EXPECT_EQ(CMD_PUSH_INLINE, cmd);
+      modified = Read::i64(data, data_len);
+      filename = read_name(data, data_len);
+      body.assign((char*)data, data_len);
+      server.answer(msg, status(answer));
+    });
+
+  // The file goes in the command itself, a skip is still a success
+  for (answer = 0; answer < 3; answer++)
+    {
+      std::istringstream data("hello");
+      std::future<void> pushed = server.conn->push_file_async("/f", 7, data,
+                                                              5);
+      if (answer < 2)
+        EXPECT_NO_THROW(pushed.get());
+      else
+        EXPECT_ANY_THROW(pushed.get());
+      EXPECT_EQ("/f", filename);
+      EXPECT_EQ(7u, modified);
+      EXPECT_EQ("hello", body);
+    }
+
+  server.conn->close();
+  serving.join();
+}
+
+TEST(SockConnectorTest, InlinePull)
+{
+  FakeServer server(HAND_INLINE, 0);
+  uint8_t answer = 0;
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      EXPECT_EQ(CMD_PULL_INLINE, cmd);
+      EXPECT_EQ("/f", read_name(data, data_len));
+      std::string reply = status(answer);
+      Write::i64(9, reply);
+      reply.append("world");
+      server.answer(msg, reply);
+    });
+
+  // The contents come back in the reply
+  std::ostringstream out;
+  EXPECT_EQ(9u, server.conn->get_file_async("/f", out).get());
+  EXPECT_EQ("world", out.str());
+
+  answer = 1;
+  std::ostringstream missing;
+  EXPECT_ANY_THROW(server.conn->get_file_async("/f", missing).get());
+
+  server.conn->close();
+  serving.join();
+}
+
+TEST(SockConnectorTest, ChunksWithoutSignature)
+{
+  std::string file;
+  srand(7);
+  for (int i = 0; i < 1000000; i++)
+    file.push_back((char)rand());
+
+  // The server has no copy to sign, so it is sent the list of chunks and
+  // asks for the first and last of them
+  FakeServer server(HAND_DELTA | HAND_CHUNKS, 0);
+  std::vector<Chunker::Chunk> chunks;
+  std::string body;
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      if (cmd == CMD_SIG)
+        {
+          EXPECT_EQ("/f", read_name(data, data_len));
+          server.answer(msg, status(1));
+          return;
+        }
+
+      EXPECT_EQ(CMD_PUSH_CHUNKS, cmd);
+      EXPECT_EQ(7u, Read::i64(data, data_len));
+      EXPECT_EQ("/f", read_name(data, data_len));
+      uint64_t offset = 0;
+      for (uint32_t n = Read::i32(data, data_len); n > 0; n--)
+        {
+          Chunker::Chunk chunk;
+          chunk.offset = offset;
+          chunk.length = Read::i32(data, data_len);
+          chunk.hash.assign((char*)data, CHUNK_HASH);
+          data += CHUNK_HASH;
+          data_len -= CHUNK_HASH;
+          offset += chunk.length;
+          chunks.push_back(chunk);
+        }
+
+      std::string reply = status(0);
+      Write::var(2, reply);
+      Write::var(0, reply);
+      Write::var(chunks.size() - 1, reply);
+      msg->set(reply);
+      Message *sent = server.netmsg->reply_and_wait(msg);
+      body = sent->get();
+      server.answer(sent, status(0));
+    });
+
+  std::istringstream data(file);
+  EXPECT_NO_THROW(server.conn->push_file_async("/f", 7, data,
+                                               file.length()).get());
+
+  ASSERT_LT(1u, chunks.size());
+  EXPECT_EQ(file.length(), chunks.back().offset + chunks.back().length);
+  const Chunker::Chunk & last = chunks.back();
+  EXPECT_EQ(file.substr(0, chunks[0].length) +
+            file.substr(last.offset, last.length), body);
+
+  server.conn->close();
+  serving.join();
+}
+
+TEST(SockConnectorTest, MetaWithoutJournal)
+{
+  Metadata stored;
+  stored.new_file("/a", 1, 10);
+  size_t len;
+  uint8_t *serial = stored.serialize(len);
+  std::string meta((char*)serial, len);
+  delete[] serial;
+
+  // Servers without a journal are asked for all of the metadata
+  FakeServer server(0, 0);
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      EXPECT_EQ(CMD_META, cmd);
+      server.answer(msg, meta);
+    });
+
+  uint64_t epoch = 5, seq = 6;
+  Metadata *mtd = server.conn->get_metadata(NULL, epoch, seq);
+  EXPECT_EQ(10u, mtd->get_file("/a").modified);
+  EXPECT_EQ(0u, epoch);
+  EXPECT_EQ(0u, seq);
+  delete mtd;
+
+  server.conn->close();
+  serving.join();
+}
+
+TEST(SockConnectorTest, MetaSinceTooOld)
+{
+  Metadata stored;
+  stored.new_file("/a", 1, 10);
+  size_t len;
+  uint8_t *serial = stored.serialize(len);
+  std::string meta((char*)serial, len);
+  delete[] serial;
+
+  // Without the tree a cursor which is too old gets all of the metadata
+  FakeServer server(0, HAND_JOURNAL);
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      EXPECT_EQ(CMD_META_SINCE, cmd);
+      EXPECT_EQ(5u, Read::i64(data, data_len));
+      EXPECT_EQ(6u, Read::i64(data, data_len));
+      EXPECT_EQ(0, Read::i8(data, data_len));
+      std::string reply = status(1);
+      Write::i64(8, reply);
+      Write::i64(9, reply);
+      reply.append(meta);
+      server.answer(msg, reply);
+    });
+
+  Metadata copy;
+  copy.new_file("/b", 1, 10);
+  uint64_t epoch = 5, seq = 6;
+  Metadata *mtd = server.conn->get_metadata(&copy, epoch, seq);
+  EXPECT_NE(&copy, mtd);
+  EXPECT_EQ(10u, mtd->get_file("/a").modified);
+  EXPECT_EQ(0u, mtd->get_file("/b").modified);
+  EXPECT_EQ(8u, epoch);
+  EXPECT_EQ(9u, seq);
+  delete mtd;
+
+  server.conn->close();
+  serving.join();
+}
+
+TEST(SockConnectorTest, TreeReconcile)
+{
+  Metadata stored;
+  stored.new_file("/a", 1, 10);
+  stored.new_file("/d/b", 2, 25);
+  stored.new_file("/e/f", 4, 40);
+  stored.new_file("/g", 5, 50);
+
+  Metadata copy;
+  copy.new_file("/a", 1, 10);
+  copy.new_file("/d/b", 2, 20);
+  copy.new_file("/d/c", 3, 30);
+  copy.new_file("/e/f", 4, 40);
+
+  // The server lists only the directories asked for, from its own tree
+  FakeServer server(0, HAND_JOURNAL | HAND_TREE);
+  std::vector<std::string> asked;
+  std::thread serving = server.serve([&](Message * msg, uint8_t cmd,
+                                         uint8_t * data, size_t data_len)
+    {
+      std::string reply;
+      if (cmd == CMD_META_SINCE)
+        {
+          Read::i64(data, data_len);
+          Read::i64(data, data_len);
+          EXPECT_EQ(1, Read::i8(data, data_len));
+          std::string root = stored.digest("/");
+          reply = status(META_TREE);
+          Write::i64(3, reply);
+          Write::i64(4, reply);
+          Write::i8(root.length(), reply);
+          reply.append(root);
+          server.answer(msg, reply);
+          return;
+        }
+
+      EXPECT_EQ(CMD_TREE, cmd);
+      for (uint32_t n = Read::i32(data, data_len); n > 0; n--)
+        {
+          std::string dir = read_name(data, data_len);
+          asked.push_back(dir);
+          std::vector<Metadata::Child> children = stored.children(dir);
+          Write::i32(children.size(), reply);
+          for (auto it = children.begin(), end = children.end(); it != end;
+               it++)
+            {
+              Write::i32(it->name.length(), reply);
+              reply.append(it->name);
+              Write::i8(it->dir, reply);
+              Write::i8(it->digest.length(), reply);
+              reply.append(it->digest);
+              if (it->dir)
+                continue;
+              Metadata::Data fd =
+                stored.get_file(Metadata::join(dir, it->name));
+              Write::i64(fd.modified, reply);
+              Write::i8(fd.deleted, reply);
+              Write::i64(fd.size, reply);
+              Write::i8(fd.hash.length(), reply);
+              reply.append(fd.hash);
+            }
+        }
+      server.answer(msg, reply);
+    });
+
+  uint64_t epoch = 1, seq = 2;
+  EXPECT_EQ(&copy, server.conn->get_metadata(&copy, epoch, seq));
+  EXPECT_EQ(3u, epoch);
+  EXPECT_EQ(4u, seq);
+
+  // The directory which matched is never listed
+  ASSERT_EQ(2u, asked.size());
+  EXPECT_EQ("/", asked[0]);
+  EXPECT_EQ("/d", asked[1]);
+
+  EXPECT_EQ(stored.digest("/"), copy.digest("/"));
+  EXPECT_EQ(25u, copy.get_file("/d/b").modified);
+  EXPECT_EQ(0u, copy.get_file("/d/c").modified);
+  EXPECT_EQ(50u, copy.get_file("/g").modified);
+
+  server.conn->close();
+  serving.join();
+}
@@ -19,6 +19,7 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <sstream>
 #include <cstdio>
 #include "gtest/gtest.h"
@@ -184,3 +185,71 @@ TEST(CryptTest, DecStreamFailSig)
 
   delete cs;
 }
+
+TEST(CryptTest, ReaderLong)
+{
+  Crypt c(KEY);
+  std::string in;
+  for (size_t i = 0; in.length() < 200000; i++)
+    in.append(std::to_string(i));
+  std::istringstream plain(in + "trailing bytes past the length");
+
+  // The reader hands out exactly the ciphertext of the promised length
+  CryptReader reader(c.ecstream(), plain, in.length());
+  std::stringstream enc;
+  enc << reader.rdbuf();
+  EXPECT_EQ(c.enc_len(in.length()) + c.hash_len(), enc.str().length());
+
+  // Which decrypts back to the plaintext
+  CryptStream *cs = c.dcstream();
+  std::string out;
+  char buff[4096];
+  ssize_t red;
+  cs->write(enc.str().data(), enc.str().length());
+  cs->write(NULL, 0);
+  while ((red = cs->read(buff, sizeof(buff))) > 0)
+    out.append(buff, red);
+  EXPECT_EQ(in, out);
+
+  delete cs;
+}
+
+TEST(CryptTest, ReaderShort)
+{
+  Crypt c(KEY);
+  std::istringstream plain("I am awesome");
+
+  // A plaintext shorter than promised gives a short ciphertext
+  CryptReader reader(c.ecstream(), plain, 1000);
+  std::stringstream enc;
+  enc << reader.rdbuf();
+  EXPECT_GT(c.enc_len(1000) + c.hash_len(), enc.str().length());
+}
+
+TEST(CryptTest, WriterLong)
+{
+  Crypt c(KEY);
+  std::string in;
+  for (size_t i = 0; in.length() < 200000; i++)
+    in.append(std::to_string(i));
+  std::string enc = c.encrypt(in) + c.sign(in);
+
+  // Ciphertext written in uneven pieces comes out as the plaintext
+  std::ostringstream out;
+  CryptWriter writer(c.dcstream(), out);
+  for (size_t off = 0; off < enc.length(); off += 1000)
+    writer.write(enc.data() + off, std::min((size_t)1000, enc.length() - off));
+  writer.finish();
+  EXPECT_EQ(in, out.str());
+}
+
+TEST(CryptTest, WriterFailSig)
+{
+  Crypt c(KEY);
+  std::string in = "I am awesome", enc = c.encrypt(in) + c.sign("blah");
+  std::ostringstream out;
+
+  CryptWriter writer(c.dcstream(), out);
+  writer.write(enc.data(), enc.length());
+  EXPECT_ANY_THROW(writer.finish());
+}
@@ -0,0 +1,181 @@
+/*
+  Delta test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <random>
+#include <sstream>
+#include "gtest/gtest.h"
+#include "delta.hxx"
+
+static std::string random_data(size_t len, unsigned seed)
+{
+  std::mt19937 gen(seed);
+  std::string data(len, '\0');
+  for (size_t i = 0; i < len; i++)
+    data[i] = gen();
+  return data;
+}
+
+/**
+ * Sends the new file as a delta against the old one
+ * @param delta_len Set to the length of the delta
+ * @return The file rebuilt from the old one and the delta
+ */
+static std::string patch(const std::string & basis, const std::string & data,
+                         uint64_t & delta_len)
+{
+  std::istringstream bin(basis), din(data);
+  std::string sig = Delta::signature(bin, basis.length());
+  std::stringstream delta;
+  delta_len = Delta::encode(sig, din, delta);
+  EXPECT_EQ(delta_len, delta.str().length());
+
+  bin.clear();
+  std::ostringstream out;
+  DeltaWriter dw(bin, out);
+  dw << delta.rdbuf();
+  dw.finish();
+  return out.str();
+}
+
+TEST(DeltaTest, Roll)
+{
+  std::string data = random_data(10000, 1);
+  uint8_t *d = (uint8_t*)data.data();
+  uint32_t hash = Delta::weak(d, 2048);
+  for (size_t i = 1; i + 2048 <= data.length(); i++)
+    {
+      hash = Delta::roll(hash, d[i-1], d[i+2047], 2048);
+      ASSERT_EQ(Delta::weak(d + i, 2048), hash);
+    }
+}
+
+TEST(DeltaTest, BlockSize)
+{
+  EXPECT_EQ(2048u, Delta::block_size(0));
+  EXPECT_EQ(2048u, Delta::block_size(1 << 20));
+  EXPECT_EQ(32768u, Delta::block_size(1ull << 30));
+  EXPECT_EQ(131072u, Delta::block_size(1ull << 40));
+}
+
+TEST(DeltaTest, Same)
+{
+  std::string basis = random_data(1 << 20, 2);
+  uint64_t len;
+  EXPECT_EQ(basis, patch(basis, basis, len));
+  EXPECT_GT(100u, len);
+}
+
+TEST(DeltaTest, Edited)
+{
+  std::string basis = random_data(1 << 20, 3);
+  std::string data = basis;
+  data.insert(1000, "inserted into the file");
+  data.erase(300000, 5000);
+  data.replace(600000, 10, "overwrites");
+  data.append(random_data(1234, 4));
+  data.insert(0, "at the start");
+
+  uint64_t len;
+  EXPECT_EQ(data, patch(basis, data, len));
+  EXPECT_GT(20000u, len);
+}
+
+TEST(DeltaTest, ShortLastBlock)
+{
+  std::string basis = random_data(10000, 5);
+  std::string data = std::string("prefix") + basis;
+  uint64_t len;
+  EXPECT_EQ(data, patch(basis, data, len));
+  EXPECT_GT(100u, len);
+}
+
+TEST(DeltaTest, Empty)
+{
+  std::string data = random_data(5000, 6);
+  uint64_t len;
+  EXPECT_EQ(data, patch("", data, len));
+  EXPECT_EQ("", patch(data, "", len));
+}
+
+TEST(DeltaTest, Unrelated)
+{
+  std::string basis = random_data(200000, 7);
+  std::string data = random_data(300000, 8);
+  uint64_t len;
+  EXPECT_EQ(data, patch(basis, data, len));
+}
+
+TEST(DeltaTest, ByteAtATime)
+{
+  std::string basis = random_data(50000, 9);
+  std::string data = basis;
+  data.replace(20000, 100, random_data(100, 10));
+
+  std::istringstream bin(basis), din(data);
+  std::string sig = Delta::signature(bin, basis.length());
+  std::stringstream delta;
+  Delta::encode(sig, din, delta);
+
+  bin.clear();
+  std::ostringstream out;
+  DeltaWriter dw(bin, out);
+  for (char c : delta.str())
+    dw.put(c);
+  dw.finish();
+  EXPECT_EQ(data, out.str());
+}
+
+TEST(DeltaTest, WrongBasis)
+{
+  std::string basis = random_data(50000, 11);
+  std::string data = basis;
+  data.replace(20000, 100, random_data(100, 12));
+
+  std::istringstream bin(basis), din(data);
+  std::string sig = Delta::signature(bin, basis.length());
+  std::stringstream delta;
+  Delta::encode(sig, din, delta);
+
+  // The old file changed since it was signed
+  std::string other = basis;
+  other[100] ^= 1;
+  std::istringstream oin(other);
+  std::ostringstream out;
+  DeltaWriter dw(oin, out);
+  dw << delta.rdbuf();
+  EXPECT_THROW(dw.finish(), const char *);
+}
+
+TEST(DeltaTest, CutShort)
+{
+  std::string basis = random_data(50000, 13);
+  std::istringstream bin(basis), din(basis);
+  std::string sig = Delta::signature(bin, basis.length());
+  std::stringstream delta;
+  Delta::encode(sig, din, delta);
+
+  bin.clear();
+  std::string d = delta.str();
+  std::ostringstream out;
+  DeltaWriter dw(bin, out);
+  dw.write(d.data(), d.length() - 1);
+  EXPECT_THROW(dw.finish(), const char *);
+}
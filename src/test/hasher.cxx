@@ -0,0 +1,123 @@
+/*
+  Content hashes of files and a cache of them
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gtest/gtest.h"
+#include "hasher.hxx"
+#include "openssl/evp.h"
+
+#define CACHE "hashes.cache"
+
+static std::string write_file(const std::string & path,
+                              const std::string & data)
+{
+  std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.length());
+  return path;
+}
+
+static std::string sha256(const std::string & data)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  EVP_Digest(data.data(), data.length(), md, &md_len, EVP_sha256(), NULL);
+  return std::string((char*)md, md_len);
+}
+
+TEST(HasherTest, File)
+{
+  std::string data(200000, 'x');
+  data[123456] = 'y';
+  write_file("hash.a", data);
+  EXPECT_EQ(sha256(data), Hasher::file("hash.a"));
+  write_file("hash.b", "");
+  EXPECT_EQ(sha256(""), Hasher::file("hash.b"));
+  EXPECT_ANY_THROW(Hasher::file("hash.missing"));
+  unlink("hash.a");
+  unlink("hash.b");
+}
+
+TEST(HasherTest, Files)
+{
+  std::vector<std::string> paths;
+  for (int i = 0; i < 20; i++)
+    paths.push_back(write_file("hash." + std::to_string(i),
+                               std::string(i * 1000, 'a' + i)));
+  paths.push_back("hash.missing");
+
+  std::vector<std::string> hashes = Hasher::files(paths, 4);
+  ASSERT_EQ(paths.size(), hashes.size());
+  for (int i = 0; i < 20; i++)
+    {
+      EXPECT_EQ(sha256(std::string(i * 1000, 'a' + i)), hashes[i]);
+      unlink(paths[i].c_str());
+    }
+  EXPECT_EQ("", hashes[20]);
+  EXPECT_EQ(0u, Hasher::files(std::vector<std::string>(), 4).size());
+}
+
+TEST(HasherTest, Keyed)
+{
+  std::string hash = sha256("contents");
+  EXPECT_EQ(Hasher::keyed("key", hash), Hasher::keyed("key", hash));
+  EXPECT_NE(Hasher::keyed("key", hash), Hasher::keyed("other", hash));
+  EXPECT_NE(hash, Hasher::keyed("key", hash));
+  EXPECT_EQ((size_t)HASH_LEN, Hasher::keyed("key", hash).length());
+}
+
+TEST(HasherTest, Cache)
+{
+  unlink(CACHE);
+  write_file("hash.c", "first");
+  {
+    HashCache cache(CACHE);
+    EXPECT_EQ(sha256("first"), cache.hash("hash.c"));
+    EXPECT_EQ("", cache.hash("hash.missing"));
+    cache.save();
+  }
+
+  // A saved hash is used while the file looks the same, even if the
+  // contents were swapped behind its back
+  struct stat stats;
+  stat("hash.c", &stats);
+  write_file("hash.c", "other");
+  struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+  utimensat(AT_FDCWD, "hash.c", times, 0);
+  {
+    HashCache cache(CACHE);
+    EXPECT_EQ(sha256("first"), cache.hash("hash.c"));
+  }
+
+  // Any change to the size or time hashes it again
+  write_file("hash.c", "changed");
+  {
+    HashCache cache(CACHE);
+    EXPECT_EQ(sha256("changed"), cache.hash("hash.c"));
+  }
+
+  unlink("hash.c");
+  unlink(CACHE);
+}
@@ -0,0 +1,136 @@
+/*
+  A journal of the changes made to the stored files
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <fstream>
+#include "gtest/gtest.h"
+#include "journal.hxx"
+
+#define JOURNAL "changes.journal"
+
+TEST(JournalTest, Since)
+{
+  remove(JOURNAL);
+  Journal journal(JOURNAL, 10);
+  uint64_t epoch = journal.epoch();
+  EXPECT_NE(0u, epoch);
+  EXPECT_EQ(0u, journal.seq());
+
+  std::vector<std::string> changed;
+  EXPECT_TRUE(journal.since(epoch, 0, changed));
+  EXPECT_EQ(0u, changed.size());
+
+  EXPECT_EQ(1u, journal.record("/a"));
+  EXPECT_EQ(2u, journal.record("/b"));
+  EXPECT_EQ(3u, journal.record("/a"));
+  EXPECT_EQ(4u, journal.record("/c"));
+
+  ASSERT_TRUE(journal.since(epoch, 0, changed));
+  ASSERT_EQ(3u, changed.size());
+  EXPECT_EQ("/a", changed[0]);
+  EXPECT_EQ("/b", changed[1]);
+  EXPECT_EQ("/c", changed[2]);
+
+  ASSERT_TRUE(journal.since(epoch, 2, changed));
+  ASSERT_EQ(2u, changed.size());
+  EXPECT_EQ("/a", changed[0]);
+  EXPECT_EQ("/c", changed[1]);
+
+  EXPECT_TRUE(journal.since(epoch, 4, changed));
+  EXPECT_EQ(0u, changed.size());
+
+  // Cursors from the future or from another journal can't be trusted
+  EXPECT_FALSE(journal.since(epoch, 5, changed));
+  EXPECT_FALSE(journal.since(epoch + 1, 4, changed));
+  remove(JOURNAL);
+}
+
+TEST(JournalTest, Window)
+{
+  remove(JOURNAL);
+  Journal journal(JOURNAL, 4);
+  for (int i = 0; i < 50; i++)
+    journal.record("/" + std::to_string(i));
+
+  std::vector<std::string> changed;
+  EXPECT_FALSE(journal.since(journal.epoch(), 45, changed));
+  ASSERT_TRUE(journal.since(journal.epoch(), 46, changed));
+  ASSERT_EQ(4u, changed.size());
+  EXPECT_EQ("/46", changed[0]);
+  EXPECT_EQ("/49", changed[3]);
+  remove(JOURNAL);
+}
+
+TEST(JournalTest, Reload)
+{
+  remove(JOURNAL);
+  uint64_t epoch;
+  {
+    Journal journal(JOURNAL, 4);
+    epoch = journal.epoch();
+    for (int i = 0; i < 11; i++)
+      journal.record("/" + std::to_string(i));
+  }
+
+  // The epoch, the numbering and the window carry over
+  std::vector<std::string> changed;
+  {
+    Journal journal(JOURNAL, 4);
+    EXPECT_EQ(epoch, journal.epoch());
+    EXPECT_EQ(11u, journal.seq());
+    EXPECT_FALSE(journal.since(epoch, 6, changed));
+    ASSERT_TRUE(journal.since(epoch, 7, changed));
+    EXPECT_EQ(4u, changed.size());
+    EXPECT_EQ(12u, journal.record("/x"));
+  }
+
+  // A torn record is dropped along with anything after it
+  {
+    std::ofstream out(JOURNAL, std::ios::out | std::ios::binary |
+                      std::ios::app);
+    out.write("torn", 4);
+  }
+  {
+    Journal journal(JOURNAL, 4);
+    EXPECT_EQ(epoch, journal.epoch());
+    EXPECT_EQ(12u, journal.seq());
+    EXPECT_EQ(13u, journal.record("/y"));
+  }
+  Journal journal(JOURNAL, 4);
+  EXPECT_EQ(13u, journal.seq());
+  ASSERT_TRUE(journal.since(epoch, 11, changed));
+  ASSERT_EQ(2u, changed.size());
+  EXPECT_EQ("/x", changed[0]);
+  EXPECT_EQ("/y", changed[1]);
+
+  // Losing the head starts a new epoch
+  journal.flush();
+  {
+    std::ofstream out(JOURNAL, std::ios::out | std::ios::binary |
+                      std::ios::trunc);
+    out.write("short", 5);
+  }
+  Journal fresh(JOURNAL, 4);
+  EXPECT_NE(epoch, fresh.epoch());
+  EXPECT_EQ(0u, fresh.seq());
+  remove(JOURNAL);
+}
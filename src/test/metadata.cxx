@@ -86,3 +86,105 @@ TEST(MetadataTest, ComplexSerial)
   EXPECT_EQ(11, f.modified);
   EXPECT_FALSE(f.deleted);
 }
+
+TEST(MetadataTest, HashSerial)
+{
+  Metadata meta("test/config");
+  meta.new_file("/bin", 3, 11, std::string(32, 'h'));
+  meta.new_file("/unhashed", 4, 12);
+  meta.delete_file("/basic", 10);
+  size_t len;
+  uint8_t * serial = meta.serialize(len, true);
+  Metadata meta2(serial, len);
+  delete serial;
+
+  EXPECT_EQ(std::string(32, 'h'), meta2.get_file("/bin").hash);
+  EXPECT_EQ(11, meta2.get_file("/bin").modified);
+  EXPECT_EQ("", meta2.get_file("/unhashed").hash);
+  EXPECT_EQ(12, meta2.get_file("/unhashed").modified);
+  EXPECT_TRUE(meta2.get_file("/basic").deleted);
+
+  // Hashes are left out unless asked for
+  serial = meta.serialize(len);
+  Metadata meta3(serial, len);
+  delete serial;
+  EXPECT_EQ("", meta3.get_file("/bin").hash);
+  EXPECT_EQ(11, meta3.get_file("/bin").modified);
+}
+
+TEST(MetadataTest, TreeDigest)
+{
+  Metadata a, b;
+  EXPECT_EQ("", a.digest("/"));
+
+  a.new_file("/x/1", 1, 10);
+  a.new_file("/x/y/2", 2, 20);
+  a.new_file("/z", 3, 30);
+  b.new_file("/z", 3, 30);
+  b.new_file("/x/y/2", 2, 20);
+  b.new_file("/x/1", 1, 10);
+  EXPECT_EQ((size_t)MTD_DIGEST, a.digest("/").length());
+  EXPECT_EQ(a.digest("/"), b.digest("/"));
+
+  // A change only shows in the directories above it
+  b.modify_file("/x/y/2", 2, 21);
+  EXPECT_NE(a.digest("/"), b.digest("/"));
+  EXPECT_NE(a.digest("/x"), b.digest("/x"));
+  EXPECT_NE(a.digest("/x/y"), b.digest("/x/y"));
+  EXPECT_EQ(a.digest("/x/1"), b.digest("/x/1"));
+  EXPECT_EQ(a.digest("/z"), b.digest("/z"));
+
+  // Sizes and hashes aren't part of the digest, and deleted files count
+  // as missing
+  b.modify_file("/x/y/2", 48, 20, std::string(32, 'h'));
+  EXPECT_EQ(a.digest("/"), b.digest("/"));
+  b.new_file("/gone/3", 4, 40);
+  EXPECT_NE(a.digest("/"), b.digest("/"));
+  b.delete_file("/gone/3", 41);
+  EXPECT_EQ(a.digest("/"), b.digest("/"));
+  EXPECT_EQ("", b.digest("/gone"));
+
+  std::vector<Metadata::Child> kids = b.children("/");
+  ASSERT_EQ(3u, kids.size());
+  EXPECT_EQ("gone", kids[0].name);
+  EXPECT_TRUE(kids[0].dir);
+  EXPECT_EQ("", kids[0].digest);
+  EXPECT_EQ("x", kids[1].name);
+  EXPECT_EQ(a.digest("/x"), kids[1].digest);
+  EXPECT_EQ("z", kids[2].name);
+  EXPECT_FALSE(kids[2].dir);
+  ASSERT_EQ(1u, b.children("/gone").size());
+  EXPECT_EQ("", b.children("/gone")[0].digest);
+
+  // Forgetting a directory takes everything below it
+  b.erase("/gone");
+  EXPECT_EQ(2u, b.children("/").size());
+  EXPECT_EQ(0u, b.get_file("/gone/3").modified);
+  a.erase("/x");
+  EXPECT_EQ(0u, a.get_file("/x/y/2").modified);
+  EXPECT_EQ(1u, a.children("/").size());
+  EXPECT_NE(a.digest("/"), b.digest("/"));
+  b.erase("/x/1");
+  b.erase("/x/y/2");
+  EXPECT_EQ(a.digest("/"), b.digest("/"));
+  EXPECT_EQ(1u, b.children("/").size());
+}
+
+TEST(MetadataTest, TreeSerial)
+{
+  Metadata meta;
+  meta.new_file("/a/b", 1, 10);
+  meta.delete_file("/a/c", 11);
+  size_t len;
+  uint8_t * serial = meta.serialize(len);
+  Metadata meta2(serial, len);
+  delete serial;
+  EXPECT_EQ(meta.digest("/"), meta2.digest("/"));
+  EXPECT_EQ(2u, meta2.children("/a").size());
+
+  // Copies keep their own trees
+  Metadata meta3(meta2);
+  meta3.modify_file("/a/b", 1, 12);
+  EXPECT_NE(meta2.digest("/"), meta3.digest("/"));
+  EXPECT_EQ(meta.digest("/"), meta2.digest("/"));
+}
@@ -0,0 +1,86 @@
+/*
+  Mpsc test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gtest/gtest.h"
+#include "mpsc.hxx"
+#include <vector>
+#include <thread>
+
+struct Item
+{
+  size_t producer, seq;
+  Item *next;
+};
+
+TEST(MpscTest, Order)
+{
+  Mpsc<Item> queue;
+  Item items[3];
+  EXPECT_TRUE(queue.empty());
+  EXPECT_TRUE(queue.take() == NULL);
+
+  for (size_t i = 0; i < 3; i++)
+    {
+      items[i].seq = i;
+      queue.push(&items[i]);
+    }
+  EXPECT_FALSE(queue.empty());
+
+  Item *item = queue.take();
+  for (size_t i = 0; i < 3; i++, item = item->next)
+    EXPECT_EQ(i, item->seq);
+  EXPECT_TRUE(item == NULL);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(MpscTest, ManyProducers)
+{
+  const size_t producers = 8, count = 100000;
+  Mpsc<Item> queue;
+  std::vector<Item> items(producers * count);
+  std::vector<std::thread> threads;
+
+  for (size_t p = 0; p < producers; p++)
+    threads.push_back(std::thread([&, p]()
+      {
+        for (size_t i = 0; i < count; i++)
+          {
+            Item *item = &items[p * count + i];
+            item->producer = p;
+            item->seq = i;
+            queue.push(item);
+          }
+      }));
+
+  // Each producer's items come out complete and in the order pushed
+  std::vector<size_t> next(producers, 0);
+  size_t got = 0;
+  while (got < producers * count)
+    for (Item *item = queue.take(); item != NULL; item = item->next, got++)
+      {
+        ASSERT_EQ(next[item->producer], item->seq);
+        next[item->producer]++;
+      }
+
+  for (size_t p = 0; p < producers; p++)
+    threads[p].join();
+  EXPECT_TRUE(queue.empty());
+}
@@ -0,0 +1,887 @@
+/*
+  NetMsg test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gtest/gtest.h"
+#include "netmsg.hxx"
+#include "net.hxx"
+#include "util.hxx"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+
+// Produces an endless body while counting how much has been read
+class CountingSource : public std::streambuf
+{
+public:
+  std::atomic<uint64_t> red;
+
+  CountingSource() : red(0) {}
+
+protected:
+  std::streamsize xsgetn(char * s, std::streamsize n)
+  {
+    memset(s, 'x', n);
+    red += n;
+    return n;
+  }
+};
+
+// A sink which holds its writes until it is opened then writes roughly 16k
+// per millisecond, tracking how far the source has run ahead of it
+class SlowSink : public std::streambuf
+{
+public:
+  std::atomic<uint64_t> wrote;
+  std::atomic<bool> waiting, open;
+  uint64_t lead;
+
+  SlowSink(CountingSource * source)
+    : wrote(0), waiting(false), open(false), lead(0), source(source) {}
+
+protected:
+  std::streamsize xsputn(const char * s, std::streamsize n)
+  {
+    waiting = true;
+    for (int i = 0; i < 5000 && !open; i++)
+      usleep(1000);
+
+    lead = std::max(lead, (uint64_t)(source->red - wrote));
+    usleep(n / 16);
+    wrote += n;
+    return n;
+  }
+
+private:
+  CountingSource *source;
+};
+
+// Counts every allocation made by the test binary, the default delete
+// already frees with free()
+static std::atomic<uint64_t> allocations(0);
+
+void * operator new(size_t size)
+{
+  allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+static std::string frame(uint64_t id, const std::string & body)
+{
+  std::string out;
+  Write::i8(1, out);
+  Write::i64(id, out);
+  Write::i64(body.length(), out);
+  return out + body;
+}
+
+static std::string compact(uint8_t flags, uint64_t id,
+                           const std::string & body)
+{
+  std::string out;
+  Write::i8(flags, out);
+  Write::var(id, out);
+  Write::var(body.length(), out);
+  return out + body;
+}
+
+TEST(NetMsgTest, SplitFrames)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net net(fds[0], "local", 0);
+  NetMsg netmsg(&net);
+  netmsg.start();
+
+  // Headers and bodies trickle in a byte at a time
+  std::string data = frame(0, "hello") + frame(1, "") + frame(2, "world");
+  for (size_t i = 0; i < data.length(); i++)
+    ASSERT_EQ(1, write(fds[1], data.data() + i, 1));
+
+  Message *msg = netmsg.wait_new();
+  EXPECT_EQ("hello", msg->get());
+  msg = netmsg.wait_new();
+  EXPECT_EQ("", msg->get());
+  msg = netmsg.wait_new();
+  EXPECT_EQ("world", msg->get());
+
+  netmsg.close();
+  close(fds[1]);
+}
+
+TEST(NetMsgTest, ManyFramesInOneRead)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net net(fds[0], "local", 0);
+  NetMsg netmsg(&net);
+
+  std::string data;
+  for (int i = 0; i < 1000; i++)
+    data += frame(i, std::to_string(i));
+  std::thread writer([&]() { Net(fds[1], "remote", 0).write(data); });
+
+  netmsg.start();
+  for (int i = 0; i < 1000; i++)
+    {
+      Message *msg = netmsg.wait_new();
+      EXPECT_EQ(std::to_string(i), msg->get());
+      netmsg.destroy(msg);
+    }
+
+  writer.join();
+  netmsg.close();
+}
+
+TEST(NetMsgTest, StreamedBody)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.start();
+  remote.start();
+
+  std::string body;
+  for (int i = 0; i < 1000000; i++)
+    body.push_back((char)(i * 7));
+
+  std::thread server([&]()
+    {
+      // Answer the request with a body larger than the receive buffer
+      Message *msg = remote.wait_new();
+      msg->set("meta");
+      msg = remote.reply_and_wait(msg);
+      EXPECT_EQ("ready", msg->get());
+      std::istringstream in(body);
+      msg = remote.reply_and_wait(msg, &in, body.length());
+      EXPECT_EQ("done", msg->get());
+      remote.destroy(msg);
+    });
+
+  Message *msg = local.send_and_wait("get");
+  EXPECT_EQ("meta", msg->get());
+  std::ostringstream out;
+  msg->set("ready");
+  local.reply_and_wait(msg, &out);
+  EXPECT_EQ(body.length(), out.str().length());
+  EXPECT_TRUE(body == out.str());
+  msg->set("done");
+  local.reply_only(msg);
+
+  server.join();
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, AsyncStreamedBody)
+{
+  std::string body;
+  for (int i = 0; i < 1000000; i++)
+    body.push_back((char)(i * 13));
+
+  // The listener writes the body whether or not credit is granted
+  for (uint8_t features : {0, NETMSG_CHUNKED | NETMSG_CREDIT})
+    {
+      int fds[2];
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+      Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+      NetMsg local(&lnet), remote(&rnet);
+      local.set_features(features);
+      remote.set_features(features);
+      local.start();
+      remote.start();
+
+      std::thread server([&]()
+        {
+          Message *msg = remote.wait_new();
+          msg->set("meta");
+          msg = remote.reply_and_wait(msg);
+          std::istringstream in(body);
+          msg = remote.reply_and_wait(msg, &in, body.length());
+          EXPECT_EQ("done", msg->get());
+          remote.destroy(msg);
+        });
+
+      Message *msg = local.send_and_wait("get");
+      std::ostringstream out;
+      std::promise<Message *> written;
+      msg->set("ready");
+      local.reply_async(msg, &out, [&](Message * msg)
+        {
+          written.set_value(msg);
+        });
+      msg = written.get_future().get();
+      ASSERT_TRUE(msg != NULL);
+      EXPECT_EQ("", msg->get());
+      EXPECT_TRUE(body == out.str());
+      msg->set("done");
+      local.reply_only(msg);
+
+      server.join();
+      local.close();
+      remote.close();
+    }
+}
+
+TEST(NetMsgTest, FileBody)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.start();
+  remote.start();
+
+  std::string body;
+  for (int i = 0; i < 3000000; i++)
+    body.push_back((char)(i * 13));
+  std::ofstream("test/netmsg_file", std::ios::binary) << body;
+
+  std::thread server([&]()
+    {
+      // The body comes straight from the file descriptor
+      Message *msg = remote.wait_new();
+      int file = open("test/netmsg_file", O_RDONLY);
+      msg->set("");
+      msg = remote.reply_and_wait(msg, file, body.length());
+      close(file);
+      remote.destroy(msg);
+    });
+
+  Message *msg = local.send_and_wait("pull");
+  EXPECT_EQ(body.length(), msg->get().length());
+  EXPECT_TRUE(body == msg->get());
+  msg->set("done");
+  local.reply_only(msg);
+
+  server.join();
+  local.close();
+  remote.close();
+  remove("test/netmsg_file");
+}
+
+TEST(NetMsgTest, FileSink)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.start();
+  remote.start();
+
+  std::string body;
+  for (int i = 0; i < 3000000; i++)
+    body.push_back((char)(i * 7));
+
+  std::thread server([&]()
+    {
+      // The reply body is written straight into the file descriptor
+      Message *msg = remote.wait_new();
+      int file = open("test/netmsg_sink", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      msg->set("ready");
+      remote.reply_and_wait(msg, file);
+      close(file);
+      EXPECT_EQ("", msg->get());
+      msg->set("done");
+      remote.reply_only(msg);
+    });
+
+  Message *msg = local.send_and_wait("push");
+  EXPECT_EQ("ready", msg->get());
+  msg->set(body);
+  msg = local.reply_and_wait(msg);
+  EXPECT_EQ("done", msg->get());
+  local.destroy(msg);
+  server.join();
+
+  std::ifstream in("test/netmsg_sink", std::ios::binary);
+  std::string got((std::istreambuf_iterator<char>(in)),
+                  std::istreambuf_iterator<char>());
+  EXPECT_EQ(body.length(), got.length());
+  EXPECT_TRUE(body == got);
+
+  local.close();
+  remote.close();
+  remove("test/netmsg_sink");
+}
+
+TEST(NetMsgTest, ChunkedInterleave)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_CHUNKED);
+  remote.set_features(NETMSG_CHUNKED);
+  local.start();
+  remote.start();
+
+  std::string body;
+  for (int i = 0; i < 8000000; i++)
+    body.push_back((char)(i * 11));
+
+  // The small message overtakes the bulk one which is queued first
+  local.send_only(body);
+  local.send_only("small");
+
+  Message *msg = remote.wait_new();
+  EXPECT_EQ("small", msg->get());
+  remote.destroy(msg);
+
+  msg = remote.wait_new();
+  EXPECT_EQ(body.length(), msg->get().length());
+  EXPECT_TRUE(body == msg->get());
+  remote.destroy(msg);
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, CreditSlowSink)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  remote.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  local.start();
+  remote.start();
+
+  const uint64_t size = 8388608;
+  CountingSource source;
+  SlowSink sink(&source);
+  std::istream in(&source);
+  std::ostream out(&sink);
+
+  std::thread ponger;
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      ponger = std::thread([&]()
+        {
+          remote.reply_only(remote.wait_new());
+        });
+      msg->set("ready");
+      msg = remote.reply_and_wait(msg);
+      msg = remote.reply_and_wait(msg, &in, size);
+      EXPECT_EQ("done", msg->get());
+      remote.destroy(msg);
+    });
+
+  Message *msg = local.send_and_wait("pull");
+  EXPECT_EQ("ready", msg->get());
+
+  // Other messages keep flowing while the sink holds up the body
+  bool overtook = false;
+  std::thread pinger([&]()
+    {
+      while (!sink.waiting)
+        usleep(1000);
+      Message *ping = local.send_and_wait("ping");
+      overtook = sink.wrote == 0;
+      sink.open = true;
+      local.destroy(ping);
+    });
+
+  local.reply_and_wait(msg, &out);
+  msg->set("done");
+  local.reply_only(msg);
+
+  pinger.join();
+  server.join();
+  ponger.join();
+
+  EXPECT_EQ(size, sink.wrote);
+  EXPECT_TRUE(overtook);
+
+  // The sender never gets more than the 1M window ahead of the sink
+  EXPECT_EQ(size, source.red);
+  EXPECT_LE(sink.lead, 1048576u);
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, CreditSlowSinkAsync)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  remote.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  local.start();
+  remote.start();
+
+  const uint64_t size = 8388608;
+  CountingSource source;
+  SlowSink sink(&source);
+  std::istream in(&source);
+  std::ostream out(&sink);
+
+  std::thread ponger;
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      ponger = std::thread([&]()
+        {
+          remote.reply_only(remote.wait_new());
+        });
+      msg->set("ready");
+      msg = remote.reply_and_wait(msg);
+      msg = remote.reply_and_wait(msg, &in, size);
+      EXPECT_EQ("done", msg->get());
+      remote.destroy(msg);
+    });
+
+  Message *msg = local.send_and_wait("pull");
+  EXPECT_EQ("ready", msg->get());
+
+  // The listener isn't the one writing, so replies still get through while
+  // the sink holds up the body
+  std::promise<Message *> written;
+  local.reply_async(msg, &out, [&](Message * msg)
+    {
+      written.set_value(msg);
+    });
+  while (!sink.waiting)
+    usleep(1000);
+  Message *ping = local.send_and_wait("ping");
+  EXPECT_EQ(0u, sink.wrote);
+  sink.open = true;
+  local.destroy(ping);
+
+  msg = written.get_future().get();
+  ASSERT_TRUE(msg != NULL);
+  msg->set("done");
+  local.reply_only(msg);
+
+  server.join();
+  ponger.join();
+
+  EXPECT_EQ(size, sink.wrote);
+  EXPECT_LE(sink.lead, 1048576u);
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, Async)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.start();
+  remote.start();
+
+  const int count = 64;
+  std::thread server([&]()
+    {
+      // Only answer once every request is in flight
+      std::vector<Message *> msgs;
+      for (int i = 0; i < count + 1; i++)
+        msgs.push_back(remote.wait_new());
+      for (int i = 0; i < count + 1; i++)
+        {
+          msgs[i]->set(msgs[i]->get() + " reply");
+          remote.reply_only(msgs[i]);
+        }
+    });
+
+  std::atomic<int> replies(0);
+  for (int i = 0; i < count; i++)
+    local.send_async(std::to_string(i), [&, i](Message * msg)
+      {
+        if (msg != NULL && msg->get() == std::to_string(i) + " reply")
+          replies++;
+        if (msg != NULL)
+          local.destroy(msg);
+      });
+
+  std::future<Message *> future = local.send_async("future");
+  Message *msg = future.get();
+  EXPECT_EQ("future reply", msg->get());
+  local.destroy(msg);
+  server.join();
+
+  // The replies are sent in order so the callbacks have all run
+  EXPECT_EQ(count, replies);
+
+  // Outstanding requests fail once the connection goes away
+  bool failed = false;
+  local.send_async("lost", [&](Message * msg)
+    {
+      failed = msg == NULL;
+    });
+  future = local.send_async("lost");
+  remote.close();
+  local.close();
+  EXPECT_TRUE(failed);
+  EXPECT_THROW(future.get(), const char *);
+
+  // Requests made after the close fail straight away
+  failed = false;
+  local.send_async("late", [&](Message * msg)
+    {
+      failed = msg == NULL;
+    });
+  EXPECT_TRUE(failed);
+}
+
+TEST(NetMsgTest, Deadlines)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_FEATURES);
+  remote.set_features(NETMSG_FEATURES);
+  local.start();
+  remote.start();
+
+  // A request the remote end sits on gives up after its deadline, which is
+  // counted in whole milliseconds
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_THROW(local.send_and_wait("stalled", 50), const char *);
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(45));
+
+  // The late reply is dropped and doesn't upset the next request
+  Message *msg = remote.wait_new();
+  EXPECT_EQ("stalled", msg->get());
+  remote.reply_only(msg);
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      msg->set(msg->get() + " reply");
+      remote.reply_only(msg);
+    });
+  msg = local.send_and_wait("prompt", 5000);
+  EXPECT_EQ("prompt reply", msg->get());
+  local.destroy(msg);
+  server.join();
+
+  // Asynchronous requests are failed by the writer thread
+  std::atomic<int> failed(0);
+  local.send_async("stalled", [&](Message * msg)
+    {
+      if (msg == NULL)
+        failed++;
+    }, 50);
+  for (int i = 0; i < 500 && failed == 0; i++)
+    usleep(1000);
+  EXPECT_EQ(1, failed);
+  remote.destroy(remote.wait_new());
+
+  // Cancelled requests fail straight away, but only while in flight
+  uint64_t id = local.send_async("cancelled", [&](Message * msg)
+    {
+      if (msg == NULL)
+        failed++;
+    });
+  EXPECT_TRUE(local.cancel(id));
+  EXPECT_EQ(2, failed);
+  EXPECT_FALSE(local.cancel(id));
+  remote.destroy(remote.wait_new());
+
+  // The connection default applies to the plain calls
+  local.set_timeout(50);
+  EXPECT_THROW(local.send_and_wait("stalled"), const char *);
+  std::future<Message *> future = local.send_async("stalled");
+  EXPECT_THROW(future.get(), const char *);
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, BodyDeadlines)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  remote.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  remote.set_timeout(100);
+  local.start();
+  remote.start();
+
+  // A body which keeps moving may take longer than the deadline
+  const uint64_t size = 8388608;
+  CountingSource source;
+  SlowSink sink(&source);
+  sink.open = true;
+  std::istream in(&source);
+  std::ostream out(&sink);
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      msg->set("ready");
+      msg = remote.reply_and_wait(msg);
+      msg = remote.reply_and_wait(msg, &in, size);
+      EXPECT_EQ("done", msg->get());
+      remote.destroy(msg);
+    });
+  Message *msg = local.send_and_wait("pull");
+  local.reply_and_wait(msg, &out);
+  msg->set("done");
+  local.reply_only(msg);
+  server.join();
+  EXPECT_EQ(size, sink.wrote);
+  local.close();
+  remote.close();
+
+  // One whose reader stops takes the connection down once it stalls
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net snet(fds[1], "remote", 0);
+  NetMsg stalled(&snet);
+  stalled.set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  stalled.set_timeout(100);
+  stalled.start();
+  std::string data = frame(0, "pull");
+  ASSERT_EQ((ssize_t)data.length(), write(fds[0], data.data(), data.length()));
+  msg = stalled.wait_new();
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_THROW(stalled.reply_and_wait(msg, &in, size), const char *);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(5000));
+  stalled.close();
+  ::close(fds[0]);
+}
+
+TEST(NetMsgTest, PooledMessages)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_FEATURES);
+  remote.set_features(NETMSG_FEATURES);
+  local.start();
+  remote.start();
+
+  // Fill the pools and grow the buffers to their working size, the burst
+  // leaves spare messages for when a send overtakes the writer's cleanup
+  std::string data(100, 'x');
+  for (int i = 0; i < 32; i++)
+    local.send_only(data);
+  for (int i = 0; i < 32; i++)
+    remote.destroy(remote.wait_new());
+  for (int i = 0; i < 1000; i++)
+    {
+      local.send_only(data);
+      remote.destroy(remote.wait_new());
+    }
+
+  // The steady state never touches the allocator
+  uint64_t before = allocations;
+  for (int i = 0; i < 1000; i++)
+    {
+      local.send_only(data);
+      Message *msg = remote.wait_new();
+      EXPECT_EQ(data, msg->get());
+      remote.destroy(msg);
+    }
+  EXPECT_EQ(0u, allocations - before);
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, CompactHeaders)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net net(fds[0], "local", 0);
+  NetMsg netmsg(&net);
+  netmsg.set_features(NETMSG_COMPACT);
+  netmsg.start();
+
+  // Headers with multi byte integers trickle in a byte at a time
+  std::string big(300, 'b');
+  std::string data = compact(1, 0, "hello") + compact(1, 1ull << 40, big) +
+    compact(1, 2, "");
+  for (size_t i = 0; i < data.length(); i++)
+    ASSERT_EQ(1, write(fds[1], data.data() + i, 1));
+
+  Message *msg = netmsg.wait_new();
+  EXPECT_EQ("hello", msg->get());
+  msg = netmsg.wait_new();
+  EXPECT_EQ(big, msg->get());
+  msg = netmsg.wait_new();
+  EXPECT_EQ("", msg->get());
+
+  // A one byte reply only takes three bytes of header
+  msg->set(std::string(1, '\0'));
+  netmsg.reply_only(msg);
+  std::string reply = compact(0, 2, std::string(1, '\0'));
+  char buff[16];
+  size_t got = 0;
+  while (got < reply.length())
+    got += read(fds[1], buff + got, reply.length() - got);
+  EXPECT_EQ(4u, got);
+  EXPECT_EQ(reply, std::string(buff, got));
+
+  // Round trips work when both ends agree on everything
+  int pair[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  Net lnet(pair[0], "local", 0), rnet(pair[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_FEATURES);
+  remote.set_features(NETMSG_FEATURES);
+  local.start();
+  remote.start();
+
+  std::string large(1 << 20, 'l');
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      remote.reply_only(msg);
+    });
+  msg = local.send_and_wait(large);
+  EXPECT_EQ(large, msg->get());
+  local.destroy(msg);
+  server.join();
+
+  local.close();
+  remote.close();
+  netmsg.close();
+  close(fds[1]);
+}
+
+TEST(NetMsgTest, BatchLimits)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net lnet(fds[0], "local", 0), rnet(fds[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.start();
+  remote.start();
+
+  // Bursts arrive whole and in order whatever the limits
+  uint64_t limits[][2] = { { 1, 0 }, { 65536, 200 }, { 1 << 20, 100000 } };
+  for (int l = 0; l < 3; l++)
+    {
+      local.set_batch(limits[l][0], limits[l][1]);
+      for (int i = 0; i < 1000; i++)
+        local.send_only(std::to_string(i));
+      for (int i = 0; i < 1000; i++)
+        {
+          Message *msg = remote.wait_new();
+          EXPECT_EQ(std::to_string(i), msg->get());
+          remote.destroy(msg);
+        }
+    }
+
+  // A lone request isn't held back for the rest of a batch
+  std::thread server([&]()
+    {
+      remote.reply_only(remote.wait_new());
+    });
+  auto start = std::chrono::steady_clock::now();
+  local.destroy(local.send_and_wait("ping"));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  server.join();
+
+  local.close();
+  remote.close();
+}
+
+TEST(NetMsgTest, Compression)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net net(fds[0], "local", 0), raw(fds[1], "remote", 0);
+  NetMsg netmsg(&net);
+  netmsg.set_features(NETMSG_CHUNKED | NETMSG_COMPRESS);
+  netmsg.start();
+
+  // Repetitive bodies are sent compressed
+  std::string paths;
+  for (int i = 0; i < 1000; i++)
+    paths += "/home/user/documents/file" + std::to_string(i) + ".txt";
+  netmsg.send_only(paths);
+  uint8_t flags = raw.read8();
+  raw.read64();
+  uint64_t len = raw.read64();
+  EXPECT_TRUE(flags & 0x10);
+  EXPECT_LT(len, paths.length() / 4);
+  std::string body(len, '\0');
+  for (uint64_t got = 0; got < len; )
+    got += raw.read((uint8_t*)&body[got], len - got);
+
+  // Data which doesn't shrink is sent as it is
+  std::string noise;
+  for (int i = 0; i < 4096; i++)
+    noise += (char)(rand() & 0xff);
+  netmsg.send_only(noise);
+  flags = raw.read8();
+  raw.read64();
+  EXPECT_FALSE(flags & 0x10);
+  EXPECT_EQ(noise.length(), raw.read64());
+  netmsg.close();
+
+  // Every kind of body makes it through intact between two ends
+  int pair[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+  Net lnet(pair[0], "local", 0), rnet(pair[1], "remote", 0);
+  NetMsg local(&lnet), remote(&rnet);
+  local.set_features(NETMSG_FEATURES);
+  remote.set_features(NETMSG_FEATURES);
+  local.start();
+  remote.start();
+
+  std::string big;
+  while (big.length() < (3 << 20))
+    big += paths + noise;
+  std::thread server([&]()
+    {
+      Message *msg = remote.wait_new();
+      std::string got = msg->get();
+      std::istringstream in(got);
+      msg = remote.reply_and_wait(msg, &in, got.length());
+      remote.reply_only(msg);
+    });
+
+  Message *msg = local.send_and_wait(big);
+  std::ostringstream out;
+  local.reply_and_wait(msg, &out);
+  EXPECT_TRUE(big == out.str());
+  local.destroy(msg);
+  server.join();
+
+  local.close();
+  remote.close();
+}
@@ -0,0 +1,167 @@
+/*
+  Reactor test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gtest/gtest.h"
+#include "reactor.hxx"
+#include "netmsg.hxx"
+#include "net.hxx"
+#include "util.hxx"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+
+static bool echo(NetMsg * netmsg)
+{
+  Message *msg = netmsg->wait_new();
+  if (msg->get() == "quit")
+    {
+      netmsg->destroy(msg);
+      return false;
+    }
+  msg->set(msg->get() + "!");
+  netmsg->reply_only(msg);
+  return true;
+}
+
+TEST(ReactorTest, Echo)
+{
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net local(fds[0], "local", 0), *remote = new Net(fds[1], "remote", 0);
+
+  std::atomic<int> closed(0);
+  Reactor reactor(2);
+  reactor.start();
+  reactor.add(new NetMsg(remote, false), echo,
+              [&closed](NetMsg * netmsg) { closed++; });
+
+  NetMsg netmsg(&local);
+  netmsg.start();
+  for (int i = 0; i < 100; i++)
+    {
+      Message *msg = netmsg.send_and_wait(std::to_string(i));
+      EXPECT_EQ(std::to_string(i) + "!", msg->get());
+      netmsg.destroy(msg);
+    }
+
+  // Returning false from the handler closes the connection
+  netmsg.send_only("quit");
+  reactor.close();
+  EXPECT_EQ(1, closed);
+  delete remote;
+}
+
+TEST(ReactorTest, ManyConnections)
+{
+  std::vector<Net *> locals;
+  std::vector<NetMsg *> netmsgs;
+  Reactor reactor(4);
+  reactor.start();
+
+  for (int i = 0; i < 50; i++)
+    {
+      int fds[2];
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+      locals.push_back(new Net(fds[0], "local", 0));
+      reactor.add(new NetMsg(new Net(fds[1], "remote", 0), false), echo,
+                  [](NetMsg * netmsg) {});
+      netmsgs.push_back(new NetMsg(locals.back()));
+      netmsgs.back()->start();
+    }
+
+  for (int i = 0; i < 50; i++)
+    {
+      Message *msg = netmsgs[i]->send_and_wait("ping");
+      EXPECT_EQ("ping!", msg->get());
+      netmsgs[i]->destroy(msg);
+    }
+
+  reactor.close();
+  for (int i = 0; i < 50; i++)
+    {
+      delete netmsgs[i];
+      delete locals[i];
+    }
+}
+
+TEST(ReactorTest, GrantsNeverBlockPoller)
+{
+  Reactor reactor(4);
+  reactor.start();
+
+  // The stuck client asks for a large reply and then never reads, so the
+  // worker answering it blocks on the socket
+  int stuck[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, stuck));
+  NetMsg *remote = new NetMsg(new Net(stuck[1], "remote", 0), false);
+  remote->set_features(NETMSG_CHUNKED | NETMSG_CREDIT);
+  reactor.add(remote, [](NetMsg * netmsg)
+    {
+      Message *msg = netmsg->wait_new();
+      msg->set(std::string(8 << 20, 'x'));
+      netmsg->reply_only(msg);
+      return true;
+    }, [](NetMsg * netmsg) {});
+
+  std::string frame;
+  Write::i8(0x01, frame);
+  Write::i64(1, frame);
+  Write::i64(5, frame);
+  frame.append("flood");
+  ASSERT_EQ((ssize_t)frame.length(),
+            write(stuck[0], frame.data(), frame.length()));
+  usleep(100000);
+
+  // Then it sends enough of another body that the poller grants credit,
+  // which must not wait for the socket the worker holds
+  for (int i = 0; i < 5; i++)
+    {
+      frame.clear();
+      Write::i8(0x03, frame);
+      Write::i64(2, frame);
+      Write::i64(65536, frame);
+      frame.append(65536, 'y');
+      ASSERT_EQ((ssize_t)frame.length(),
+                write(stuck[0], frame.data(), frame.length()));
+    }
+  usleep(100000);
+
+  // Other connections carry on
+  int fds[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  Net local(fds[0], "local", 0);
+  reactor.add(new NetMsg(new Net(fds[1], "remote", 0), false), echo,
+              [](NetMsg * netmsg) {});
+  NetMsg netmsg(&local);
+  netmsg.start();
+  Message *msg = NULL;
+  EXPECT_NO_THROW(msg = netmsg.send_and_wait("ping", 2000));
+  if (msg != NULL)
+    {
+      EXPECT_EQ("ping!", msg->get());
+      netmsg.destroy(msg);
+    }
+
+  // Closing the stuck client breaks the blocked sends
+  close(stuck[0]);
+  netmsg.close();
+  reactor.close();
+}
@@ -0,0 +1,137 @@
+/*
+  Slots test suite
+
+  Copyright (C) 2012 William A. Kennington III
+
+  This file is part of Libsync.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gtest/gtest.h"
+#include "slots.hxx"
+#include <vector>
+#include <thread>
+#include <atomic>
+
+struct Item
+{
+  uint64_t id;
+};
+
+TEST(SlotsTest, Basic)
+{
+  Slots<Item> slots(8);
+  Item items[3] = { { 0 }, { 1 }, { 5 } };
+
+  EXPECT_TRUE(slots.find(0) == NULL);
+  for (size_t i = 0; i < 3; i++)
+    slots.insert(items[i].id, &items[i]);
+  for (size_t i = 0; i < 3; i++)
+    EXPECT_EQ(&items[i], slots.find(items[i].id));
+  EXPECT_TRUE(slots.find(2) == NULL);
+
+  slots.erase(1);
+  EXPECT_TRUE(slots.find(1) == NULL);
+  EXPECT_EQ(&items[0], slots.find(0));
+  EXPECT_EQ(&items[2], slots.find(5));
+
+  // Erasing an id which isn't there leaves the others alone
+  slots.erase(3);
+  EXPECT_EQ(&items[2], slots.find(5));
+}
+
+TEST(SlotsTest, Generations)
+{
+  Slots<Item> slots(4);
+  Item old = { 2 }, young = { 6 };
+
+  // A later id reusing the slot is never mistaken for the earlier one
+  slots.insert(old.id, &old);
+  slots.erase(old.id);
+  slots.insert(young.id, &young);
+  EXPECT_TRUE(slots.find(old.id) == NULL);
+  EXPECT_EQ(&young, slots.find(young.id));
+  slots.erase(old.id);
+  EXPECT_EQ(&young, slots.find(young.id));
+}
+
+TEST(SlotsTest, Spill)
+{
+  const size_t count = 100;
+  Slots<Item> slots(4);
+  std::vector<Item> items(count);
+
+  // Far more ids than slots are in flight at once
+  for (size_t i = 0; i < count; i++)
+    {
+      items[i].id = i;
+      slots.insert(i, &items[i]);
+    }
+  for (size_t i = 0; i < count; i++)
+    EXPECT_EQ(&items[i], slots.find(i));
+
+  size_t seen = 0;
+  slots.each([&](Item * item) { seen++; });
+  EXPECT_EQ(count, seen);
+
+  for (size_t i = 0; i < count; i += 2)
+    slots.erase(i);
+  for (size_t i = 0; i < count; i++)
+    EXPECT_EQ(i % 2 ? &items[i] : NULL, slots.find(i));
+}
+
+TEST(SlotsTest, ConcurrentFind)
+{
+  const uint64_t window = 64, count = 200000;
+  Slots<Item> slots(128);
+  std::vector<Item> items(count);
+  std::atomic<uint64_t> next(0);
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> wrong(0);
+
+  // Readers only ever see the item for the id they asked for
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; r++)
+    readers.push_back(std::thread([&]()
+      {
+        while (!done)
+          {
+            uint64_t top = next;
+            for (uint64_t id = top > window ? top - window : 0; id < top; id++)
+              {
+                Item *item = slots.find(id);
+                if (item != NULL && item->id != id)
+                  wrong++;
+              }
+          }
+      }));
+
+  // The writer keeps a sliding window of ids in flight
+  for (uint64_t id = 0; id < count; id++)
+    {
+      items[id].id = id;
+      slots.insert(id, &items[id]);
+      next = id + 1;
+      if (id >= window)
+        slots.erase(id - window);
+    }
+  done = true;
+  for (size_t r = 0; r < readers.size(); r++)
+    readers[r].join();
+
+  EXPECT_EQ(0u, wrong);
+  for (uint64_t id = count - window; id < count; id++)
+    EXPECT_EQ(&items[id], slots.find(id));
+}
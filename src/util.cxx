@@ -19,6 +19,11 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstdlib>
+#ifndef WIN32
+#  include <unistd.h>
+#endif
+
 #include "util.hxx"
 
 #ifdef WIN32
@@ -79,6 +84,19 @@ uint64_t Read::i64(uint8_t * & data, size_t & size)
   return be64toh(out);
 }
 
+uint64_t Read::var(uint8_t * & data, size_t & size)
+{
+  uint64_t out = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+    {
+      uint8_t byte = i8(data, size);
+      out |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return out;
+    }
+  throw "Variable length integer is too long";
+}
+
 void Write::i8(uint8_t i, uint8_t * data, size_t & offset)
 {
   *((uint8_t*)(data+offset)) = i;
@@ -126,6 +144,24 @@ void Write::i64(uint64_t i, std::string & data)
   data.append((char*)&i, 8);
 }
 
+void Write::var(uint64_t i, uint8_t * data, size_t & offset)
+{
+  while (i >= 0x80)
+    {
+      data[offset++] = (i & 0x7f) | 0x80;
+      i >>= 7;
+    }
+  data[offset++] = i;
+}
+
+void Write::var(uint64_t i, std::string & data)
+{
+  uint8_t buff[10];
+  size_t len = 0;
+  var(i, buff, len);
+  data.append((char*)buff, len);
+}
+
 void File::recursive_remove(const std::string & filename)
 {
   remove(filename.c_str());
@@ -134,3 +170,19 @@ void File::recursive_remove(const std::string & filename)
 void File::recursive_create(const std::string & filename)
 {
 }
+
+void File::temp(std::fstream & file)
+{
+  std::string path = (fs::temp_directory_path() / "libsync-XXXXXX").string();
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+    throw "Failed to create a temporary file";
+  file.open(path, std::ios::in | std::ios::out | std::ios::binary |
+            std::ios::trunc);
+  close(fd);
+
+  // The open stream keeps the file around once its name is gone
+  unlink(path.c_str());
+  if (!file)
+    throw "Failed to open a temporary file";
+}
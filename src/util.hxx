@@ -24,6 +24,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <fstream>
 #include <string>
 
 #ifdef WIN32
@@ -62,6 +63,12 @@ namespace Read
   uint16_t i16(uint8_t * & data, size_t & size);
   uint32_t i32(uint8_t * & data, size_t & size);
   uint64_t i64(uint8_t * & data, size_t & size);
+
+  /**
+   * Reads a variable length integer, seven bits per byte with the lowest
+   * bits first and the top bit set on every byte but the last
+   */
+  uint64_t var(uint8_t * & data, size_t & size);
 };
 
 namespace Write
@@ -74,6 +81,8 @@ namespace Write
   void i32(uint32_t i, std::string & data);
   void i64(uint64_t i, uint8_t * data, size_t & offset);
   void i64(uint64_t i, std::string & data);
+  void var(uint64_t i, uint8_t * data, size_t & offset);
+  void var(uint64_t i, std::string & data);
 };
 
 namespace File
@@ -89,6 +98,12 @@ namespace File
    * @param filename The name of the file to create
    */
   void recursive_create(const std::string & filename);
+
+  /**
+   * Opens a scratch file which is removed as soon as the stream closes
+   * @param file The stream to open the file with for reading and writing
+   */
+  void temp(std::fstream & file);
 };
 
 #endif